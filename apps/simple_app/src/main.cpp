@@ -32,19 +32,12 @@ class SimpleApp : public AppBase {
     model_ = GetModelHandler(framework_, model_name_, version_,
                              latency_sla_ms_, estimate_workload_,
                              {image_height_, image_width_});
-    auto func1 = [&](std::shared_ptr<RequestContext> ctx) {
+    qp_ = new QueryProcessor([&](std::shared_ptr<RequestContext> ctx) {
       auto output = model_->Execute(ctx, ctx->const_request().input());
-      return std::vector<VariablePtr>{
-        std::make_shared<Variable>("output", output)};
-    };
-    auto func2 = [&](std::shared_ptr<RequestContext> ctx) {
-      auto output = ctx->GetVariable("output")->result();
-      output->ToProto(ctx->reply());
-      return std::vector<VariablePtr>{};
-    };
-    ExecBlock* b1 = new ExecBlock(0, func1, {});
-    ExecBlock* b2 = new ExecBlock(1, func2, {"output"});
-    qp_ = new QueryProcessor({b1, b2});
+      ctx->Then(output, [output](std::shared_ptr<RequestContext> ctx) {
+        output->ToProto(ctx->reply());
+      });
+    });
   }
   
  private:
@@ -52,15 +52,18 @@ class AsyncClient:
         reply, recv_time = await self._wait_reply(req.req_id)
         return send_time, recv_time, reply
 
-    def request(self, img):
-        req = self._prepare_req(img)
+    def request(self, img, stream_key='', deadline_ms=0, priority=0):
+        req = self._prepare_req(img, stream_key, deadline_ms, priority)
         msg = self._prepare_message(MSG_USER_REQUEST, req)
         return self._do_request(req, msg)
 
-    def _prepare_req(self, img):
+    def _prepare_req(self, img, stream_key='', deadline_ms=0, priority=0):
         req = npb.RequestProto()
         req.user_id = self._user_id
         req.req_id = self._req_id
+        req.stream_key = stream_key
+        req.deadline_ms = deadline_ms
+        req.priority = priority
         req.input.data_type = npb.DT_IMAGE
         req.input.image.data = img
         req.input.image.format = npb.ImageProto.JPEG
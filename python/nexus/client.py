@@ -38,31 +38,50 @@ class Client:
         assert reply.status == 0
         
 
-    def request(self, img):
-        req = self._prepare_req(img)
+    def request(self, img, stream_key='', deadline_ms=0, priority=0):
+        req = self._prepare_req(img, stream_key, deadline_ms, priority)
         msg = self._prepare_message(MSG_USER_REQUEST, req)
+        return self._send_request(msg)
+
+
+    def request_batch(self, imgs, stream_key='', deadline_ms=0, priority=0):
+        req = self._prepare_req(None, stream_key, deadline_ms, priority)
+        for img in imgs:
+            value = req.inputs.add()
+            value.data_type = npb.DT_IMAGE
+            value.image.data = img
+            value.image.format = npb.ImageProto.JPEG
+            value.image.color = True
+        msg = self._prepare_message(MSG_USER_REQUEST, req)
+        return self._send_request(msg)
+
+
+    def _send_request(self, msg):
         failed = 0
         while True:
             try:
                 self.sock.sendall(msg)
-                reply = self._recv_reply()
-                break
+                return self._recv_reply()
             except socket.timeout:
                 failed += 1
                 if failed == 3:
                     return None
-        return reply
 
 
-    def _prepare_req(self, img):
+    def _prepare_req(self, img, stream_key='', deadline_ms=0, priority=0):
         req = npb.RequestProto()
         req.user_id = self.user_id
         req.req_id = self.req_id
+        req.stream_key = stream_key
+        req.deadline_ms = deadline_ms
+        req.priority = priority
+        self.req_id += 1
+        if img is None:
+            return req
         req.input.data_type = npb.DT_IMAGE
         req.input.image.data = img
         req.input.image.format = npb.ImageProto.JPEG
         req.input.image.color = True
-        self.req_id += 1
         return req
 
 
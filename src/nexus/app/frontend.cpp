@@ -5,6 +5,8 @@
 #include "nexus/common/config.h"
 
 DECLARE_int32(load_balance);
+DEFINE_int32(utilization_refresh_ms, 10, "Interval to refresh stale backend "
+             "utilization in ms");
 
 namespace nexus {
 namespace app {
@@ -42,6 +44,7 @@ void Frontend::Run(QueryProcessor* qp, size_t nthreads) {
   }
   running_ = true;
   daemon_thread_ = std::thread(&Frontend::Daemon, this);
+  utilization_thread_ = std::thread(&Frontend::UtilizationDaemon, this);
   LOG(INFO) << "Frontend server (id: " << node_id_ << ") is listening on " <<
       address();
   io_context_.run();
@@ -69,6 +72,7 @@ void Frontend::Stop() {
     worker->Join();
   }
   daemon_thread_.join();
+  utilization_thread_.join();
   // Stop RPC service
   rpc_service_.Stop();
   LOG(INFO) << "Frontend server stopped";
@@ -105,20 +109,54 @@ void Frontend::HandleMessage(std::shared_ptr<Connection> conn,
         LOG(ERROR) << "UserRequest message comes from non-user connection";
         break;
       }
-      request_pool_.AddNewRequest(std::make_shared<RequestContext>(
-          user_sess, message, request_pool_));
+      auto req = std::make_shared<RequestContext>(user_sess, message,
+                                                  request_pool_);
+      std::vector<std::shared_ptr<RequestContext> > reqs;
+      if (req->is_batch()) {
+        // Items run as separate requests, and their queries to the same
+        // backend are coalesced into batch messages
+        reqs = req->SplitBatch();
+      } else {
+        reqs.push_back(std::move(req));
+      }
+      for (auto& item : reqs) {
+        if (!request_pool_.AddNewRequest(item)) {
+          // Fast reject without taking a worker
+          item->HandleError(RATE_LIMITED, "Request rate limit exceeded");
+          item->SendReply();
+        }
+      }
       break;
     }
     case kBackendReply: {
       QueryResultProto result;
       message->DecodeBody(&result);
-      std::string model_session_id = result.model_session_id();
-      auto itr = model_pool_.find(model_session_id);
+      HandleBackendReply(&result);
+      break;
+    }
+    case kBackendReplyBatch: {
+      std::vector<std::pair<const char*, size_t> > entries;
+      if (!message->SplitBatchBody(&entries)) {
+        LOG(ERROR) << "Malformed reply batch";
+        break;
+      }
+      QueryResultProto result;
+      for (auto& entry : entries) {
+        result.ParseFromArray(entry.first, entry.second);
+        HandleBackendReply(&result);
+      }
+      break;
+    }
+    case kBackendCancelReply: {
+      CancelQueryProto reply;
+      message->DecodeBody(&reply);
+      auto itr = model_pool_.find(reply.model_session_id());
       if (itr == model_pool_.end()) {
-        LOG(ERROR) << "Cannot find model handler for " << model_session_id;
+        LOG(ERROR) << "Cannot find model handler for " <<
+            reply.model_session_id();
         break;
       }
-      itr->second->HandleReply(result);
+      itr->second->HandleCancelReply(reply);
       break;
     }
     default: {
@@ -129,6 +167,29 @@ void Frontend::HandleMessage(std::shared_ptr<Connection> conn,
   }
 }
 
+void Frontend::HandleBackendReply(QueryResultProto* result) {
+  uint32_t handle = result->model_session_handle();
+  if (handle > 0) {
+    if (handle >= model_handles_.size() || model_handles_[handle] == nullptr) {
+      LOG(ERROR) << "Cannot find model handler for handle " << handle;
+      return;
+    }
+    auto& model_handler = model_handles_[handle];
+    if (result->model_session_id().empty()) {
+      result->set_model_session_id(model_handler->model_session_id());
+    }
+    model_handler->HandleReply(*result);
+    return;
+  }
+  auto itr = model_pool_.find(result->model_session_id());
+  if (itr == model_pool_.end()) {
+    LOG(ERROR) << "Cannot find model handler for " <<
+        result->model_session_id();
+    return;
+  }
+  itr->second->HandleReply(*result);
+}
+
 void Frontend::HandleError(std::shared_ptr<Connection> conn,
                            boost::system::error_code ec) {
   if (auto backend_conn = std::dynamic_pointer_cast<BackendSession>(conn)) {
@@ -202,6 +263,13 @@ std::shared_ptr<ModelHandler> Frontend::LoadModel(const LoadModelRequest& req,
       reply.model_route().model_session_id(), backend_pool_, lb_policy);
   // Only happens at Setup stage, so no concurrent modification to model_pool_
   model_pool_.emplace(model_handler->model_session_id(), model_handler);
+  uint32_t handle = reply.model_route().model_session_handle();
+  if (handle > 0) {
+    if (handle >= model_handles_.size()) {
+      model_handles_.resize(handle + 1);
+    }
+    model_handles_[handle] = model_handler;
+  }
   UpdateBackendPoolAndModelRoute(reply.model_route());
 
   return model_handler;
@@ -388,6 +456,23 @@ void Frontend::Daemon() {
       }
     }
     ReportWorkload(workload_stats);
+    for (auto const& stats : request_pool_.GetTenantStats()) {
+      LOG(INFO) << "User " << stats.user_id << ": admitted " <<
+          stats.admitted << ", rejected " << stats.rejected << ", failed " <<
+          stats.failed << ", avg latency " << (stats.replied > 0 ?
+          stats.total_latency_us / stats.replied : 0) << " us, max latency " <<
+          stats.max_latency_us << " us";
+    }
+    std::this_thread::sleep_until(next_time);
+  }
+}
+
+void Frontend::UtilizationDaemon() {
+  auto interval = std::chrono::milliseconds(FLAGS_utilization_refresh_ms);
+  while (running_) {
+    auto next_time = Clock::now() + interval;
+    // Keeps GetUtilization off RPC for the load balancer
+    backend_pool_.RefreshUtilization(interval);
     std::this_thread::sleep_until(next_time);
   }
 }
@@ -7,6 +7,7 @@
 #include <random>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "nexus/app/model_handler.h"
 #include "nexus/app/query_processor.h"
@@ -80,11 +81,18 @@ class Frontend : public ServerBase, public MessageHandler {
   void KeepAlive();
 
   bool UpdateBackendPoolAndModelRoute(const ModelRouteProto& route);
+  /*!
+   * \brief Dispatches a query result to its model handler. Fills in the
+   *   model session id if the backend only sent the handle.
+   */
+  void HandleBackendReply(QueryResultProto* result);
 
   void RegisterUser(std::shared_ptr<UserSession> user_sess,
                     const RequestProto& request, ReplyProto* reply);
 
   void Daemon();
+  /*! \brief Refreshes backend utilization requested by load balancers. */
+  void UtilizationDaemon();
 
   void ReportWorkload(const WorkloadStatsProto& request);
 
@@ -119,8 +127,15 @@ class Frontend : public ServerBase, public MessageHandler {
    * \brief Map from model session ID to model handler.
    */
   std::unordered_map<std::string, std::shared_ptr<ModelHandler> > model_pool_;
+  /*!
+   * \brief Model handlers indexed by model session handle, nullptr for
+   *   handles not loaded by this frontend.
+   */
+  std::vector<std::shared_ptr<ModelHandler> > model_handles_;
 
   std::thread daemon_thread_;
+  /*! \brief Backend utilization refresh thread */
+  std::thread utilization_thread_;
   /*! \brief Mutex for connection_pool_ and user_sessions_ */
   std::mutex user_mutex_;
 
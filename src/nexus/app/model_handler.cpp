@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cmath>
 #include <glog/logging.h>
 #include <gflags/gflags.h>
 #include <typeinfo>
@@ -8,14 +10,137 @@
 
 DEFINE_int32(count_interval, 1, "Interval to count number of requests in sec");
 DEFINE_int32(load_balance, 1, "Load balance policy (1: random, 2: choice of 2, "
-             "3: deficit round robin)");
+             "3: deficit round robin, 4: least outstanding, "
+             "5: consistent hash)");
+DEFINE_double(hedge_delay, 0., "Fraction of latency SLA after which an "
+              "unfinished query is duplicated to another backend, 0 to "
+              "disable hedging");
+DEFINE_int32(query_batch_window_us, 0, "Window in us to coalesce queries to "
+             "the same backend into one message, 0 to coalesce queries sent "
+             "within an IO loop iteration, -1 to disable coalescing");
+DEFINE_uint64(max_query_batch, 32, "Max number of queries in one message");
+DEFINE_double(hedge_budget, 0.05, "Max ratio of hedged queries to all "
+              "queries");
+DEFINE_bool(query_coalescing, false, "Attach queries identical to one in "
+            "flight to it instead of sending them to backends");
+DEFINE_int32(query_cache_ttl_ms, 0, "Time in ms to reuse the result of a "
+             "query for identical queries, 0 to disable the cache");
+DEFINE_int32(query_cache_size, 256, "Max number of cached query results per "
+             "model");
+DEFINE_double(hash_load_factor, 1.25, "Max outstanding queries of a backend "
+              "relative to its fair share under consistent hash routing");
 
 namespace nexus {
 namespace app {
 
+namespace {
+
+/*! \brief Random number engine of the calling thread */
+std::mt19937& ThreadRandomEngine() {
+  static thread_local std::mt19937 engine{std::random_device{}()};
+  return engine;
+}
+
+/*!
+ * \brief Builds a Walker alias table with Vose's method, such that drawing
+ *   slot i uniformly and then keeping it with probability prob[i], or taking
+ *   alias[i] otherwise, picks i in proportion to weights[i].
+ */
+void BuildAliasTable(const std::vector<double>& weights,
+                     std::vector<double>* prob, std::vector<uint32_t>* alias) {
+  size_t n = weights.size();
+  double total = 0.;
+  for (auto w : weights) {
+    total += w;
+  }
+  prob->assign(n, 1.);
+  alias->resize(n);
+  std::vector<double> scaled(n, 1.);
+  std::vector<uint32_t> small, large;
+  for (uint32_t i = 0; i < n; ++i) {
+    (*alias)[i] = i;
+    if (total > 0) {
+      scaled[i] = weights[i] * n / total;
+    }
+    if (scaled[i] < 1.) {
+      small.push_back(i);
+    } else {
+      large.push_back(i);
+    }
+  }
+  while (!small.empty() && !large.empty()) {
+    uint32_t s = small.back();
+    small.pop_back();
+    uint32_t l = large.back();
+    (*prob)[s] = scaled[s];
+    (*alias)[s] = l;
+    scaled[l] -= 1. - scaled[s];
+    if (scaled[l] < 1.) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // Leftovers are 1 up to rounding errors
+}
+
+/*! \brief Finalizer of splitmix64, spreads the bits of x over the output */
+uint64_t MixHash(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/*! \brief FNV-1a hash of a string, stable across processes */
+uint64_t HashString(const std::string& str) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return MixHash(hash);
+}
+
+/*!
+ * \brief Builds a hash ring with points of each backend in proportion to its
+ *   rate. Points only depend on the backend id and the point index, so a
+ *   backend keeps its points across route updates.
+ */
+void BuildHashRing(const std::vector<uint32_t>& backends,
+                   const std::vector<double>& rates, double total_rate,
+                   std::vector<std::pair<uint64_t, uint32_t> >* ring) {
+  // Average number of points per backend
+  const double kPointsPerBackend = 100.;
+  ring->clear();
+  size_t n = backends.size();
+  for (uint32_t i = 0; i < n; ++i) {
+    double share = (total_rate > 0) ? rates[i] / total_rate : 1. / n;
+    uint32_t npoints = std::max<uint32_t>(
+        1, uint32_t(std::round(kPointsPerBackend * n * share)));
+    for (uint32_t j = 0; j < npoints; ++j) {
+      ring->emplace_back(MixHash((uint64_t(backends[i]) << 32) | j), i);
+    }
+  }
+  std::sort(ring->begin(), ring->end());
+}
+
+/*!
+ * \brief Whether a result with the status holds for identical queries, i.e.,
+ *   it is OK or an error caused by the query content.
+ */
+bool IsSharedResult(uint32_t status) {
+  return status == CTRL_OK || status == MODEL_NOT_FOUND ||
+      status == MODEL_TYPE_NOT_SUPPORT || status == INPUT_TYPE_INCORRECT;
+}
+
+} // namespace
+
 QueryResult::QueryResult(uint64_t qid) :
     qid_(qid),
-    ready_(false) {
+    ready_(false),
+    chain_stages_(0) {
 }
 
 uint32_t QueryResult::status() const {
@@ -46,6 +171,11 @@ const Record& QueryResult::operator[](uint32_t idx) const {
   return records_.at(idx);
 }
 
+uint32_t QueryResult::chain_stages() const {
+  CheckReady();
+  return chain_stages_;
+}
+
 uint32_t QueryResult::num_records() const {
   CheckReady();
   return records_.size();
@@ -57,6 +187,7 @@ void QueryResult::CheckReady() const {
 
 void QueryResult::SetResult(const QueryResultProto& result) {
   status_ = result.status();
+  chain_stages_ = result.chain_stages();
   if (status_ != CTRL_OK) {
     error_message_ = result.error_message();
   } else {
@@ -78,26 +209,38 @@ std::atomic<uint64_t> ModelHandler::global_query_id_(0);
 ModelHandler::ModelHandler(const std::string& model_session_id,
                            BackendPool& pool, LoadBalancePolicy lb_policy) :
     model_session_id_(model_session_id),
+    model_session_handle_(0),
     backend_pool_(pool),
     lb_policy_(lb_policy),
-    total_throughput_(0.),
-    rand_gen_(rd_()) {
+    route_(std::make_shared<Route>()),
+    hedge_delay_(0.),
+    hedge_budget_(0.),
+    hedge_tokens_(0.),
+    backend_idx_(0),
+    running_(true) {
   ParseModelSession(model_session_id, &model_session_);
   counter_ = MetricRegistry::Singleton().CreateIntervalCounter(
       FLAGS_count_interval);
   LOG(INFO) << model_session_id_ << " load balance policy: " << lb_policy_;
   if (lb_policy_ == LB_DeficitRR) {
-    running_ = true;
     deficit_thread_ = std::thread(&ModelHandler::DeficitDaemon, this);
   }
+  SetHedging(FLAGS_hedge_delay, FLAGS_hedge_budget);
 }
 
 ModelHandler::~ModelHandler() {
   MetricRegistry::Singleton().RemoveMetric(counter_);
-  if (deficit_thread_.joinable()) {
+  {
+    std::lock_guard<std::mutex> lock(hedge_mu_);
     running_ = false;
+  }
+  hedge_cv_.notify_all();
+  if (deficit_thread_.joinable()) {
     deficit_thread_.join();
   }
+  if (hedge_thread_.joinable()) {
+    hedge_thread_.join();
+  }
 }
 
 std::shared_ptr<QueryResult> ModelHandler::Execute(
@@ -105,113 +248,480 @@ std::shared_ptr<QueryResult> ModelHandler::Execute(
     std::vector<std::string> output_fields, uint32_t topk,
     std::vector<RectProto> windows) {
   uint64_t qid = global_query_id_.fetch_add(1, std::memory_order_relaxed);
-  counter_->Increase(1);
   auto reply = std::make_shared<QueryResult>(qid);
-  auto backend = GetBackend();
-  if (backend == nullptr) {
-    ctx->HandleError(SERVICE_UNAVAILABLE, "Service unavailable");
+  if (ctx->const_request().deadline_ms() > 0 &&
+      ctx->deadline() <= Clock::now()) {
+    // Client has given up on the request
+    ctx->HandleError(TIMEOUT, "Deadline exceeded");
     return reply;
   }
   QueryProto query;
-  query.set_query_id(qid);
-  query.set_model_session_id(model_session_id_);
   query.mutable_input()->CopyFrom(input);
   for (auto field : output_fields) {
     query.add_output_field(field);
   }
+  if (!chain_.empty()) {
+    // Chained stages need the boxes and their classes
+    if (!output_fields.empty()) {
+      for (auto field : {"rect", "class_name"}) {
+        if (std::find(output_fields.begin(), output_fields.end(), field) ==
+            output_fields.end()) {
+          query.add_output_field(field);
+        }
+      }
+    }
+    for (size_t i = 0; i < chain_.size(); ++i) {
+      auto stage = query.add_chain();
+      stage->CopyFrom(chain_[i]);
+      // Handles are assigned after chaining, so they are set per query
+      uint32_t handle = chain_handlers_[i]->model_session_handle();
+      if (handle > 0) {
+        stage->set_model_session_handle(handle);
+      }
+    }
+  }
   if (topk > 0) {
     query.set_topk(topk);
   }
   for (auto rect : windows) {
     query.add_window()->CopyFrom(rect);
   }
+  // Identical queries are found by content, before per query fields are set
+  std::string key;
+  uint64_t key_hash = 0;
+  bool lead = false;
+  if (FLAGS_query_coalescing || FLAGS_query_cache_ttl_ms > 0) {
+    query.SerializeToString(&key);
+    key_hash = std::hash<std::string>()(key);
+    if (JoinIdenticalQuery(ctx, qid, key_hash, key, &lead)) {
+      return reply;
+    }
+  }
+  SendQuery(std::move(ctx), qid, &query, lead, key_hash);
+  return reply;
+}
+
+void ModelHandler::SendQuery(std::shared_ptr<RequestContext> ctx,
+                             uint64_t qid, QueryProto* query, bool lead,
+                             uint64_t key_hash) {
+  int64_t deadline_ms = 0;
+  uint32_t error = CTRL_OK;
+  std::shared_ptr<BackendSession> backend;
+  if (ctx->const_request().deadline_ms() > 0) {
+    deadline_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        ctx->deadline() - Clock::now()).count();
+    if (deadline_ms <= 0) {
+      error = TIMEOUT;
+    }
+  }
+  if (error == CTRL_OK) {
+    backend = GetBackend(ctx->const_request().stream_key());
+    if (backend == nullptr) {
+      error = SERVICE_UNAVAILABLE;
+    }
+  }
+  if (error != CTRL_OK) {
+    std::string error_msg = (error == TIMEOUT) ? "Deadline exceeded" :
+                            "Service unavailable";
+    ctx->HandleError(error, error_msg);
+    if (lead) {
+      QueryResultProto result;
+      result.set_model_session_id(model_session_id_);
+      result.set_status(CtrlStatus(error));
+      result.set_error_message(error_msg);
+      FinishFlight(key_hash, qid, result);
+    }
+    return;
+  }
+  // Only queries actually sent to backends count as workload
+  counter_->Increase(1);
+  query->set_query_id(qid);
+  uint32_t handle = model_session_handle_;
+  if (handle > 0) {
+    // Backends look up the model session by handle
+    query->set_model_session_handle(handle);
+  } else {
+    query->set_model_session_id(model_session_id_);
+  }
   if (ctx->slack_ms() > 0) {
-    query.set_slack_ms(int(floor(ctx->slack_ms())));
+    query->set_slack_ms(int(floor(ctx->slack_ms())));
   }
-  ctx->RecordQuerySend(qid);
+  query->set_deadline_ms(uint32_t(deadline_ms));
+  query->set_priority(ctx->const_request().priority());
+  ctx->RecordQuerySend(qid, this);
   {
-    std::lock_guard<std::mutex> lock(query_ctx_mu_);
-    query_ctx_.emplace(qid, ctx);
+    QueryState state{ctx, {backend->node_id()}, 1, Clock::now(), {}, lead,
+                     key_hash};
+    if (tracks_load()) {
+      auto load = GetBackendLoad(backend->node_id());
+      if (load != nullptr) {
+        ++load->outstanding;
+        state.loads.push_back(std::move(load));
+      }
+    }
+    auto& shard = query_shard(qid);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    shard.queries.emplace(qid, std::move(state));
+  }
+  auto msg = std::make_shared<Message>(kBackendRequest, query->ByteSizeLong());
+  msg->EncodeBody(*query);
+  double hedge_delay = hedge_delay_;
+  if (hedge_delay > 0) {
+    // The message is only read by connections, so a duplicate can share it
+    auto delay = std::chrono::microseconds(
+        uint64_t(model_session_.latency_sla() * 1000 * hedge_delay));
+    HedgeItem item{Clock::now() + delay, qid, backend->node_id(), msg};
+    std::lock_guard<std::mutex> lock(hedge_mu_);
+    // Allow a small burst of hedges on top of the budget
+    const double kMaxHedgeTokens = 10.;
+    hedge_tokens_ = std::min(hedge_tokens_ + hedge_budget_, kMaxHedgeTokens);
+    hedge_queue_.push_back(std::move(item));
+    if (hedge_queue_.size() == 1) {
+      hedge_cv_.notify_one();
+    }
+  }
+  if (FLAGS_query_batch_window_us < 0) {
+    backend->Write(std::move(msg));
+  } else {
+    backend->WriteCoalesced(std::move(msg), kBackendRequestBatch,
+                            FLAGS_query_batch_window_us,
+                            FLAGS_max_query_batch);
   }
-  auto msg = std::make_shared<Message>(kBackendRequest, query.ByteSizeLong());
-  msg->EncodeBody(query);
-  backend->Write(std::move(msg));
-  return reply;
 }
 
 void ModelHandler::HandleReply(const QueryResultProto& result) {
-  std::lock_guard<std::mutex> lock(query_ctx_mu_);
   uint64_t qid = result.query_id();
-  auto iter = query_ctx_.find(qid);
-  if (iter == query_ctx_.end()) {
-    // FIXME why this happens? lower from FATAL to ERROR temporarily
-    LOG(ERROR) << model_session_id_ << " cannot find query context for query " << qid;
+  std::shared_ptr<RequestContext> ctx;
+  std::vector<uint32_t> losers;
+  uint64_t flight_hash = 0;
+  bool leads_flight = false;
+  {
+    auto& shard = query_shard(qid);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    auto iter = shard.queries.find(qid);
+    if (iter == shard.queries.end()) {
+      // FIXME why this happens? lower from FATAL to ERROR temporarily
+      LOG(ERROR) << model_session_id_ << " cannot find query context for query " << qid;
+      return;
+    }
+    auto& state = iter->second;
+    if (state.ctx != nullptr && state.backends.size() == 1 &&
+        !state.loads.empty()) {
+      // Latency is only attributable to a backend if not hedged
+      const double kLatencyAlpha = 0.2;
+      double latency = std::chrono::duration_cast<std::chrono::microseconds>(
+          Clock::now() - state.send_time).count();
+      auto& ewma = state.loads[0]->latency_us;
+      double prev = ewma.load(std::memory_order_relaxed);
+      ewma.store((prev == 0.) ? latency :
+                 prev + kLatencyAlpha * (latency - prev),
+                 std::memory_order_relaxed);
+    }
+    ctx = std::move(state.ctx);
+    leads_flight = state.leads_flight;
+    flight_hash = state.flight_hash;
+    if (--state.outstanding == 0) {
+      ReleaseLoads(state);
+      shard.queries.erase(iter);
+    } else if (ctx != nullptr) {
+      // First reply of a hedged query wins, cancel the other copies
+      losers = state.backends;
+    }
+  }
+  if (!losers.empty()) {
+    SendCancel(qid, losers);
+  }
+  if (leads_flight) {
+    // Waiters get the result even if the leader is cancelled
+    FinishFlight(flight_hash, qid, result);
+  }
+  // Replies of replied or cancelled queries are dropped
+  if (ctx != nullptr) {
+    ctx->HandleQueryResult(result);
+  }
+}
+
+void ModelHandler::CancelQuery(uint64_t qid) {
+  std::vector<uint32_t> backends;
+  {
+    auto& shard = query_shard(qid);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    auto iter = shard.queries.find(qid);
+    if (iter == shard.queries.end() || iter->second.ctx == nullptr) {
+      return;
+    }
+    iter->second.ctx = nullptr;
+    if (iter->second.leads_flight &&
+        !AbandonFlight(iter->second.flight_hash, qid)) {
+      // Identical queries still need the result
+      return;
+    }
+    backends = iter->second.backends;
+  }
+  SendCancel(qid, backends);
+}
+
+void ModelHandler::HandleCancelReply(const CancelQueryProto& reply) {
+  for (auto qid : reply.query_id()) {
+    auto& shard = query_shard(qid);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    auto iter = shard.queries.find(qid);
+    if (iter == shard.queries.end()) {
+      continue;
+    }
+    // Cancelled copy won't be replied
+    if (--iter->second.outstanding == 0) {
+      ReleaseLoads(iter->second);
+      shard.queries.erase(iter);
+    }
+  }
+}
+
+bool ModelHandler::JoinIdenticalQuery(std::shared_ptr<RequestContext> ctx,
+                                      uint64_t qid, uint64_t key_hash,
+                                      const std::string& key, bool* lead) {
+  std::unique_lock<std::mutex> lock(flight_mu_);
+  if (FLAGS_query_cache_ttl_ms > 0) {
+    auto iter = result_cache_.find(key_hash);
+    if (iter != result_cache_.end()) {
+      if (Clock::now() >= iter->second.expire) {
+        result_cache_.erase(iter);
+      } else if (iter->second.key == key) {
+        QueryResultProto result(iter->second.result);
+        lock.unlock();
+        result.set_query_id(qid);
+        ctx->RecordQuerySend(qid, this);
+        ctx->HandleQueryResult(result);
+        return true;
+      }
+    }
+  }
+  if (!FLAGS_query_coalescing) {
+    return false;
+  }
+  auto iter = flights_.find(key_hash);
+  if (iter == flights_.end()) {
+    flights_.emplace(key_hash, Flight{key, qid, ctx->priority(),
+                                      ctx->deadline(), {}});
+    *lead = true;
+    return false;
+  }
+  if (iter->second.key != key) {
+    // Hash collision, the query runs on its own
+    return false;
+  }
+  if (ctx->priority() < iter->second.priority ||
+      ctx->deadline() > iter->second.deadline) {
+    // The leader is scheduled by its own class and deadline, which could
+    // fail a more urgent request or time out one that can wait longer
+    return false;
+  }
+  // Recorded before the flight can finish, which takes flight_mu_
+  ctx->RecordQuerySend(qid, this);
+  iter->second.waiters.emplace_back(std::move(ctx), qid);
+  return true;
+}
+
+void ModelHandler::FinishFlight(uint64_t key_hash, uint64_t qid,
+                                const QueryResultProto& result) {
+  std::vector<std::pair<std::shared_ptr<RequestContext>, uint64_t> > waiters;
+  std::string key;
+  {
+    std::lock_guard<std::mutex> lock(flight_mu_);
+    auto iter = flights_.find(key_hash);
+    if (iter == flights_.end() || iter->second.leader_qid != qid) {
+      return;
+    }
+    waiters.swap(iter->second.waiters);
+    if (!IsSharedResult(result.status()) && !waiters.empty()) {
+      key = std::move(iter->second.key);
+    }
+    if (FLAGS_query_cache_ttl_ms > 0 && result.status() == CTRL_OK) {
+      if (result_cache_.size() >= size_t(FLAGS_query_cache_size)) {
+        TimePoint now = Clock::now();
+        for (auto it = result_cache_.begin(); it != result_cache_.end();) {
+          if (now >= it->second.expire) {
+            it = result_cache_.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+      if (result_cache_.size() < size_t(FLAGS_query_cache_size)) {
+        auto& cached = result_cache_[key_hash];
+        cached.key = std::move(iter->second.key);
+        cached.result = result;
+        cached.expire = Clock::now() +
+                        std::chrono::milliseconds(FLAGS_query_cache_ttl_ms);
+      }
+    }
+    flights_.erase(iter);
+  }
+  if (!IsSharedResult(result.status())) {
+    // The failure is specific to the leader, e.g., its deadline, so waiters
+    // are sent on their own
+    for (auto& waiter : waiters) {
+      if (waiter.first->state() == kError) {
+        continue;
+      }
+      QueryProto query;
+      query.ParseFromString(key);
+      SendQuery(std::move(waiter.first), waiter.second, &query, false, 0);
+    }
     return;
   }
-  auto ctx = iter->second;
-  ctx->HandleQueryResult(result);
-  query_ctx_.erase(qid);
+  for (auto& waiter : waiters) {
+    QueryResultProto waiter_result(result);
+    waiter_result.set_query_id(waiter.second);
+    waiter.first->HandleQueryResult(waiter_result);
+  }
+}
+
+bool ModelHandler::AbandonFlight(uint64_t key_hash, uint64_t qid) {
+  std::lock_guard<std::mutex> lock(flight_mu_);
+  auto iter = flights_.find(key_hash);
+  if (iter == flights_.end() || iter->second.leader_qid != qid) {
+    return true;
+  }
+  if (!iter->second.waiters.empty()) {
+    return false;
+  }
+  // No more identical queries can attach to a cancelled query
+  flights_.erase(iter);
+  return true;
 }
 
 void ModelHandler::UpdateRoute(const ModelRouteProto& route) {
-  std::lock_guard<std::mutex> lock(route_mu_);
-  backends_.clear();
-  backend_rates_.clear();
-  total_throughput_ = 0.;
-  
+  if (route.model_session_handle() > 0) {
+    model_session_handle_ = route.model_session_handle();
+  }
+  std::vector<std::pair<uint32_t, double> > backend_rates;
   for (auto itr : route.backend_rate()) {
-    uint32_t backend_id = itr.info().node_id();
-    backends_.push_back(backend_id);
-    backend_rates_.emplace(backend_id, itr.throughput());
-    total_throughput_ += itr.throughput();
-    LOG(INFO) << "- backend " << backend_id << ": " << itr.throughput();
-    if (backend_quantums_.count(backend_id) == 0) {
-      backend_quantums_.emplace(backend_id, 0.);
-    }
-  }
-  LOG(INFO) << "Total throughput: " << total_throughput_;
-  std::sort(backends_.begin(), backends_.end());
-  for (auto iter = backend_quantums_.begin(); iter != backend_quantums_.end();) {
-    if (backend_rates_.count(iter->first) == 0) {
-      iter = backend_quantums_.erase(iter);
+    backend_rates.emplace_back(itr.info().node_id(), itr.throughput());
+    LOG(INFO) << "- backend " << itr.info().node_id() << ": " <<
+        itr.throughput();
+  }
+  std::sort(backend_rates.begin(), backend_rates.end());
+  auto new_route = std::make_shared<Route>();
+  for (auto const& iter : backend_rates) {
+    new_route->backends.push_back(iter.first);
+    new_route->rates.push_back(iter.second);
+    new_route->total_throughput += iter.second;
+  }
+  LOG(INFO) << "Total throughput: " << new_route->total_throughput;
+  BuildAliasTable(new_route->rates, &new_route->prob, &new_route->alias);
+  if (lb_policy_ == LB_ConsistentHash) {
+    BuildHashRing(new_route->backends, new_route->rates,
+                  new_route->total_throughput, &new_route->ring);
+  }
+  auto old_route = route_.Load();
+  for (auto backend_id : new_route->backends) {
+    auto iter = std::lower_bound(old_route->backends.begin(),
+                                 old_route->backends.end(), backend_id);
+    if (iter != old_route->backends.end() && *iter == backend_id) {
+      new_route->loads.push_back(
+          old_route->loads[iter - old_route->backends.begin()]);
     } else {
-      ++iter;
+      new_route->loads.push_back(std::make_shared<BackendLoad>());
     }
   }
+  std::vector<std::atomic<int64_t> > quantums(backend_rates.size());
+  for (auto& quantum : quantums) {
+    quantum.store(0);
+  }
+  new_route->quantums.swap(quantums);
+  route_.Store(std::move(new_route));
 }
 
-std::vector<uint32_t> ModelHandler::BackendList() {
-  std::vector<uint32_t> ret;
-  std::lock_guard<std::mutex> lock(route_mu_);
-  for (auto iter : backend_rates_) {
-    ret.push_back(iter.first);
+void ModelHandler::SetHedging(double delay, double budget) {
+  std::lock_guard<std::mutex> lock(hedge_mu_);
+  hedge_delay_ = std::max(delay, 0.);
+  hedge_budget_ = std::max(budget, 0.);
+  if (hedge_delay_ > 0) {
+    LOG(INFO) << model_session_id_ << " hedges after " << delay <<
+        " of latency SLA with budget " << budget;
+    if (!hedge_thread_.joinable()) {
+      hedge_thread_ = std::thread(&ModelHandler::HedgeDaemon, this);
+    }
   }
-  return ret;
 }
 
-std::shared_ptr<BackendSession> ModelHandler::GetBackend() {
-  std::lock_guard<std::mutex> lock(route_mu_);
+void ModelHandler::ChainTo(std::shared_ptr<ModelHandler> next,
+                           const std::vector<std::string>& class_names,
+                           const std::vector<std::string>& output_fields,
+                           uint32_t topk) {
+  ChainStageProto stage;
+  stage.set_model_session_id(next->model_session_id());
+  for (auto& name : class_names) {
+    stage.add_class_name(name);
+  }
+  for (auto& field : output_fields) {
+    stage.add_output_field(field);
+  }
+  if (!next->chain_.empty() && !output_fields.empty()) {
+    // Stages chained to next need the boxes and their classes
+    for (auto field : {"rect", "class_name"}) {
+      if (std::find(output_fields.begin(), output_fields.end(), field) ==
+          output_fields.end()) {
+        stage.add_output_field(field);
+      }
+    }
+  }
+  stage.set_topk(topk);
+  chain_.push_back(stage);
+  chain_handlers_.push_back(next);
+  for (auto& next_stage : next->chain_) {
+    chain_.push_back(next_stage);
+  }
+  for (auto& handler : next->chain_handlers_) {
+    chain_handlers_.push_back(handler);
+  }
+}
+
+std::vector<uint32_t> ModelHandler::BackendList() {
+  return route_.Load()->backends;
+}
+
+std::shared_ptr<BackendSession> ModelHandler::GetBackend(
+    const std::string& stream_key) {
+  auto route = route_.Load();
   switch (lb_policy_) {
     case LB_WeightedRR: {
-      return GetBackendWeightedRoundRobin();
+      return GetBackendWeightedRoundRobin(*route);
     }
     case LB_DeficitRR: {
-      auto backend = GetBackendDeficitRoundRobin();
+      auto backend = GetBackendDeficitRoundRobin(*route);
       if (backend != nullptr) {
         return backend;
       }
-      return GetBackendWeightedRoundRobin();
+      return GetBackendWeightedRoundRobin(*route);
+    }
+    case LB_LeastOutstanding: {
+      return GetBackendLeastOutstanding(*route);
+    }
+    case LB_ConsistentHash: {
+      if (stream_key.empty()) {
+        return GetBackendLeastOutstanding(*route);
+      }
+      return GetBackendConsistentHash(*route, stream_key);
     }
     case LB_Query: {
-      auto candidate1 = GetBackendWeightedRoundRobin();
+      auto candidate1 = GetBackendWeightedRoundRobin(*route);
       if (candidate1 == nullptr) {
         return nullptr;
       }
-      auto candidate2 = GetBackendWeightedRoundRobin();
-      if (candidate1 == candidate2) {
+      auto candidate2 = GetBackendWeightedRoundRobin(*route);
+      if (candidate2 == nullptr || candidate1 == candidate2) {
         return candidate1;
       }
-      if (candidate1->GetUtilization() <= candidate2->GetUtilization()) {
+      // Negative utilization means unknown, prefer the backend that has one
+      double util1 = candidate1->GetUtilization();
+      double util2 = candidate2->GetUtilization();
+      if (util1 < 0 && util2 < 0) {
+        std::bernoulli_distribution coin(0.5);
+        return coin(ThreadRandomEngine()) ? candidate1 : candidate2;
+      }
+      if (util2 < 0 || (util1 >= 0 && util1 <= util2)) {
         return candidate1;
       }
       return candidate2;
@@ -221,25 +731,46 @@ std::shared_ptr<BackendSession> ModelHandler::GetBackend() {
   }
 }
 
-std::shared_ptr<BackendSession> ModelHandler::GetBackendWeightedRoundRobin() {
-  std::uniform_real_distribution<float> dis(0, total_throughput_);
-  float select = dis(rand_gen_);
-  uint i = 0;
-  for (; i < backends_.size(); ++i) {
-    uint32_t backend_id = backends_[i];
-    float rate = backend_rates_.at(backend_id);
-    select -= rate;
-    if (select < 0) {
-      auto backend_sess = backend_pool_.GetBackend(backend_id);
-      if (backend_sess != nullptr) {
-        return backend_sess;
-      }
-      break;
+std::shared_ptr<BackendSession> ModelHandler::GetBackendExcept(
+    uint32_t backend_id) {
+  auto route = route_.Load();
+  auto const& backends = route->backends;
+  if (backends.empty()) {
+    return nullptr;
+  }
+  std::uniform_int_distribution<size_t> dis(0, backends.size() - 1);
+  size_t start = dis(ThreadRandomEngine());
+  for (size_t i = 0; i < backends.size(); ++i) {
+    uint32_t id = backends[(start + i) % backends.size()];
+    if (id == backend_id) {
+      continue;
+    }
+    auto backend = backend_pool_.GetBackend(id);
+    if (backend != nullptr) {
+      return backend;
     }
   }
-  ++i;
-  for (uint j = 0; j < backends_.size(); ++j, ++i) {
-    auto backend_sess = backend_pool_.GetBackend(backends_[i]);
+  return nullptr;
+}
+
+size_t ModelHandler::SampleBackend(const Route& route) {
+  auto& engine = ThreadRandomEngine();
+  size_t slot = std::uniform_int_distribution<size_t>(
+      0, route.backends.size() - 1)(engine);
+  double coin = std::uniform_real_distribution<double>(0., 1.)(engine);
+  return (coin < route.prob[slot]) ? slot : route.alias[slot];
+}
+
+std::shared_ptr<BackendSession> ModelHandler::GetBackendWeightedRoundRobin(
+    const Route& route) {
+  size_t n = route.backends.size();
+  if (n == 0) {
+    return nullptr;
+  }
+  size_t i = SampleBackend(route);
+  // Fall back to the next available backend
+  for (size_t j = 0; j < n; ++j) {
+    auto backend_sess = backend_pool_.GetBackend(route.backends[(i + j) % n]);
     if (backend_sess != nullptr) {
       return backend_sess;
     }
@@ -247,34 +778,206 @@ std::shared_ptr<BackendSession> ModelHandler::GetBackendWeightedRoundRobin() {
   return nullptr;
 }
 
-std::shared_ptr<BackendSession> ModelHandler::GetBackendDeficitRoundRobin() {
-  for (int i = 0; i < backends_.size(); ++i) {
-    uint32_t idx = backend_idx_.fetch_add(1, std::memory_order_relaxed) %
-                   backends_.size();
-    uint32_t backend_id = backends_[idx];
-    if (backend_quantums_.at(backend_id) >= 1) {
-      auto backend = backend_pool_.GetBackend(backend_id);
-      if (backend != nullptr) {
-        --backend_quantums_[backend_id];
-        return backend;
-      }
+std::shared_ptr<BackendSession> ModelHandler::GetBackendDeficitRoundRobin(
+    const Route& route) {
+  const int64_t kQuery = 1000;
+  size_t n = route.backends.size();
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t idx = backend_idx_.fetch_add(1, std::memory_order_relaxed) % n;
+    auto& quantum = route.quantums[idx];
+    int64_t left = quantum.load(std::memory_order_relaxed);
+    if (left < kQuery) {
+      continue;
+    }
+    auto backend = backend_pool_.GetBackend(route.backends[idx]);
+    if (backend == nullptr) {
+      continue;
+    }
+    // Another thread may take the last query of the deficit first
+    while (left >= kQuery &&
+           !quantum.compare_exchange_weak(left, left - kQuery,
+                                          std::memory_order_relaxed)) {}
+    if (left >= kQuery) {
+      return backend;
     }
   }
   return nullptr;
 }
 
+std::shared_ptr<BackendSession> ModelHandler::GetBackendLeastOutstanding(
+    const Route& route) {
+  if (route.backends.empty()) {
+    return nullptr;
+  }
+  // Candidates are drawn by rate, which bounds the share of each backend
+  size_t i = SampleBackend(route);
+  size_t j = SampleBackend(route);
+  if (i != j) {
+    auto expected_us = [&route](size_t k) {
+      auto& load = *route.loads[k];
+      return (load.outstanding.load(std::memory_order_relaxed) + 1) *
+          load.latency_us.load(std::memory_order_relaxed);
+    };
+    if (expected_us(j) < expected_us(i)) {
+      std::swap(i, j);
+    }
+    auto backend = backend_pool_.GetBackend(route.backends[i]);
+    if (backend != nullptr) {
+      return backend;
+    }
+    i = j;
+  }
+  auto backend = backend_pool_.GetBackend(route.backends[i]);
+  if (backend != nullptr) {
+    return backend;
+  }
+  return GetBackendWeightedRoundRobin(route);
+}
+
+std::shared_ptr<BackendSession> ModelHandler::GetBackendConsistentHash(
+    const Route& route, const std::string& stream_key) {
+  size_t n = route.backends.size();
+  if (n == 0) {
+    return nullptr;
+  }
+  int total_load = 0;
+  for (auto& load : route.loads) {
+    total_load += load->outstanding.load(std::memory_order_relaxed);
+  }
+  // Capacity is counted with the new query included, so that an idle model
+  // handler always has room at the owner of the key
+  double max_load = FLAGS_hash_load_factor * (total_load + 1);
+  auto iter = std::lower_bound(
+      route.ring.begin(), route.ring.end(),
+      std::make_pair(HashString(stream_key), uint32_t(0)));
+  std::vector<bool> visited(n, false);
+  size_t nvisited = 0;
+  for (size_t k = 0; k < route.ring.size() && nvisited < n; ++k, ++iter) {
+    if (iter == route.ring.end()) {
+      iter = route.ring.begin();
+    }
+    uint32_t i = iter->second;
+    if (visited[i]) {
+      continue;
+    }
+    visited[i] = true;
+    ++nvisited;
+    double share = (route.total_throughput > 0) ?
+        route.rates[i] / route.total_throughput : 1. / n;
+    int load = route.loads[i]->outstanding.load(std::memory_order_relaxed);
+    if (load + 1 > std::ceil(max_load * share)) {
+      // Spill over to the next backend on the ring
+      continue;
+    }
+    auto backend = backend_pool_.GetBackend(route.backends[i]);
+    if (backend != nullptr) {
+      return backend;
+    }
+  }
+  // All backends are full or unavailable
+  return GetBackendLeastOutstanding(route);
+}
+
+std::shared_ptr<ModelHandler::BackendLoad> ModelHandler::GetBackendLoad(
+    uint32_t backend_id) {
+  auto route = route_.Load();
+  auto iter = std::lower_bound(route->backends.begin(), route->backends.end(),
+                               backend_id);
+  if (iter == route->backends.end() || *iter != backend_id) {
+    return nullptr;
+  }
+  return route->loads[iter - route->backends.begin()];
+}
+
+void ModelHandler::ReleaseLoads(const QueryState& state) {
+  for (auto& load : state.loads) {
+    --load->outstanding;
+  }
+}
+
 void ModelHandler::DeficitDaemon() {
   std::chrono::milliseconds gap(200); // 200 ms
-  std::unique_lock<std::mutex> lock(route_mu_, std::defer_lock);
   while (running_) {
-    lock.lock();
-    for (auto backend_id : backends_) {
-      backend_quantums_[backend_id] = backend_rates_[backend_id] * .2;
+    auto route = route_.Load();
+    for (size_t i = 0; i < route->backends.size(); ++i) {
+      // Queries per gap, in thousandths of a query
+      route->quantums[i].store(int64_t(route->rates[i] * .2 * 1000),
+                               std::memory_order_relaxed);
     }
-    lock.unlock();
     std::this_thread::sleep_for(gap);
   }
 }
 
+void ModelHandler::HedgeDaemon() {
+  std::unique_lock<std::mutex> lock(hedge_mu_);
+  while (running_) {
+    if (hedge_queue_.empty()) {
+      hedge_cv_.wait(lock);
+      continue;
+    }
+    TimePoint time = hedge_queue_.front().time;
+    if (Clock::now() < time) {
+      hedge_cv_.wait_until(lock, time);
+      continue;
+    }
+    HedgeItem item = std::move(hedge_queue_.front());
+    hedge_queue_.pop_front();
+    if (hedge_tokens_ < 1.) {
+      continue;
+    }
+    lock.unlock();
+    bool sent = SendHedge(item);
+    lock.lock();
+    if (sent) {
+      hedge_tokens_ -= 1.;
+    }
+  }
+}
+
+bool ModelHandler::SendHedge(const HedgeItem& item) {
+  auto backend = GetBackendExcept(item.backend_id);
+  if (backend == nullptr) {
+    return false;
+  }
+  {
+    auto& shard = query_shard(item.qid);
+    std::lock_guard<std::mutex> lock(shard.mu);
+    auto iter = shard.queries.find(item.qid);
+    if (iter == shard.queries.end() || iter->second.ctx == nullptr) {
+      // Query has finished
+      return false;
+    }
+    iter->second.backends.push_back(backend->node_id());
+    ++iter->second.outstanding;
+    if (tracks_load()) {
+      auto load = GetBackendLoad(backend->node_id());
+      if (load != nullptr) {
+        ++load->outstanding;
+        iter->second.loads.push_back(std::move(load));
+      }
+    }
+  }
+  VLOG(1) << model_session_id_ << " hedges query " << item.qid <<
+      " to backend " << backend->node_id();
+  backend->WriteInOrder(item.msg);
+  return true;
+}
+
+void ModelHandler::SendCancel(uint64_t qid,
+                              const std::vector<uint32_t>& backends) {
+  CancelQueryProto request;
+  request.set_model_session_id(model_session_id_);
+  request.add_query_id(qid);
+  auto msg = std::make_shared<Message>(kBackendCancel, request.ByteSizeLong());
+  msg->EncodeBody(request);
+  for (auto backend_id : backends) {
+    auto backend = backend_pool_.GetBackend(backend_id);
+    if (backend != nullptr) {
+      // Must not overtake the query if it is still being coalesced
+      backend->WriteInOrder(msg);
+    }
+  }
+}
+
 } // namespace app
 } // namespace nexus
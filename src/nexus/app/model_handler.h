@@ -3,15 +3,19 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <random>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "nexus/common/backend_pool.h"
 #include "nexus/common/data_type.h"
 #include "nexus/common/metric.h"
+#include "nexus/common/snapshot_ptr.h"
 #include "nexus/proto/nnquery.pb.h"
 
 namespace nexus {
@@ -36,6 +40,12 @@ class QueryResult {
   uint32_t status() const;
   /*! \brief Gets the error message if any error happens in the execution */
   std::string error_message() const;
+  /*!
+   * \brief Gets the number of chained stages whose output is in the result.
+   *   The result is from the last chained stage if it equals the number of
+   *   stages chained to the model.
+   */
+  uint32_t chain_stages() const;
   /*!
    * \brief Output the result to reply protobuf
    * \param reply ReplyProto to be filled
@@ -62,6 +72,7 @@ class QueryResult {
   std::atomic<bool> ready_;
   uint32_t status_;
   std::string error_message_;
+  uint32_t chain_stages_;
   std::vector<Record> records_;
 };
 
@@ -74,6 +85,11 @@ enum LoadBalancePolicy {
   LB_Query = 2,
   // Deficit round robin
   LB_DeficitRR = 3,
+  // Power of two choices on expected completion time from the outstanding
+  // queries and latency observed at each backend
+  LB_LeastOutstanding = 4,
+  // Consistent hashing of the request stream key with bounded loads
+  LB_ConsistentHash = 5,
 };
 
 class ModelHandler {
@@ -86,6 +102,8 @@ class ModelHandler {
   ModelSession model_session() const { return model_session_; }
 
   std::string model_session_id() const { return model_session_id_; }
+  /*! \brief Handle of the model session assigned by scheduler, 0 if none */
+  uint32_t model_session_handle() const { return model_session_handle_; }
 
   std::shared_ptr<IntervalCounter> counter() const { return counter_; }
 
@@ -95,51 +113,270 @@ class ModelHandler {
       std::vector<RectProto> windows={});
 
   void HandleReply(const QueryResultProto& result);
+  /*!
+   * \brief Cancels a query whose result is no longer needed. Backends that
+   *   are still processing the query are asked to drop it.
+   * \param qid Query id
+   */
+  void CancelQuery(uint64_t qid);
+  /*!
+   * \brief Handles the acknowledgement of cancelled queries from a backend.
+   * \param reply Queries that were cancelled at the backend
+   */
+  void HandleCancelReply(const CancelQueryProto& reply);
 
   void UpdateRoute(const ModelRouteProto& route);
 
   std::vector<uint32_t> BackendList();
+  /*!
+   * \brief Configures hedged requests. A query that hasn't finished after
+   *   delay times the latency SLA is duplicated to another backend, and the
+   *   first reply wins.
+   * \param delay Fraction of latency SLA before hedging, 0 disables hedging
+   * \param budget Max ratio of hedged queries to all queries
+   */
+  void SetHedging(double delay, double budget);
+  /*!
+   * \brief Chains a model to run on the boxes detected by this model. When
+   *   both models are on the same backend, the backend runs the chained model
+   *   and replies with its result, otherwise the result of this model is
+   *   returned. Stages chained to next are also run. Must be called before
+   *   queries are executed.
+   * \param next Model handler of the chained model
+   * \param class_names Classes of boxes passed to next, all if empty
+   * \param output_fields Output fields of next
+   * \param topk Top k records of next
+   */
+  void ChainTo(std::shared_ptr<ModelHandler> next,
+               const std::vector<std::string>& class_names = {},
+               const std::vector<std::string>& output_fields = {},
+               uint32_t topk = 1);
+  /*! \brief Number of stages chained to this model. */
+  size_t num_chain_stages() const { return chain_.size(); }
 
  private:
-  std::shared_ptr<BackendSession> GetBackend();
+  /*! \brief Load of a backend observed by this model handler */
+  struct BackendLoad {
+    BackendLoad() : outstanding(0), latency_us(0.) {}
+    /*! \brief Number of queries sent and not yet resolved */
+    std::atomic<int> outstanding;
+    /*! \brief EWMA of query latency in us, 0 before the first reply */
+    std::atomic<double> latency_us;
+  };
+  /*! \brief State of a query sent to backends */
+  struct QueryState {
+    /*! \brief Request context, nullptr once replied or cancelled */
+    std::shared_ptr<RequestContext> ctx;
+    /*! \brief Backends the query was sent to */
+    std::vector<uint32_t> backends;
+    /*! \brief Number of replies still expected from backends */
+    int outstanding;
+    /*! \brief Time the query was sent */
+    TimePoint send_time;
+    /*!
+     * \brief Loads of backends counting the query, only tracked by
+     *   LB_LeastOutstanding and LB_ConsistentHash
+     */
+    std::vector<std::shared_ptr<BackendLoad> > loads;
+    /*! \brief Whether identical queries wait on the result of the query */
+    bool leads_flight;
+    /*! \brief Hash of the query content if it leads a flight */
+    uint64_t flight_hash;
+  };
+  /*! \brief Query in flight whose result is shared by identical queries */
+  struct Flight {
+    /*! \brief Serialized content of the query */
+    std::string key;
+    uint64_t leader_qid;
+    /*! \brief Priority class and deadline of the leader's request */
+    uint32_t priority;
+    TimePoint deadline;
+    /*! \brief Requests waiting on the result and their query ids */
+    std::vector<std::pair<std::shared_ptr<RequestContext>, uint64_t> > waiters;
+  };
+  /*! \brief Result of a query reused by identical queries until expiry */
+  struct CachedResult {
+    /*! \brief Serialized content of the query */
+    std::string key;
+    QueryResultProto result;
+    TimePoint expire;
+  };
+  /*!
+   * \brief Immutable routing snapshot, swapped as a whole on route updates.
+   *   Backends are sampled by their rates in O(1) with an alias table.
+   */
+  struct Route {
+    Route() : total_throughput(0.) {}
+    /*! \brief Backend ids in ascending order */
+    std::vector<uint32_t> backends;
+    /*! \brief Serving rate of each backend */
+    std::vector<double> rates;
+    double total_throughput;
+    /*! \brief Probability to pick backend i when slot i is drawn */
+    std::vector<double> prob;
+    /*! \brief Backend picked otherwise when slot i is drawn */
+    std::vector<uint32_t> alias;
+    /*! \brief Load of each backend, carried over across route updates */
+    std::vector<std::shared_ptr<BackendLoad> > loads;
+    /*!
+     * \brief Hash ring of (point, backend index) in ascending order of
+     *   point. Each backend owns a number of points in proportion to its rate.
+     */
+    std::vector<std::pair<uint64_t, uint32_t> > ring;
+    /*!
+     * \brief Deficit of each backend in thousandths of a query, refilled by
+     *   DeficitDaemon
+     */
+    mutable std::vector<std::atomic<int64_t> > quantums;
+  };
+  /*! \brief Partition of the queries that expect replies */
+  struct QueryShard {
+    /*! \brief Map from query id to query state. Guarded by mu. */
+    std::unordered_map<uint64_t, QueryState> queries;
+    std::mutex mu;
+  };
+  /*! \brief Query that may be duplicated to another backend */
+  struct HedgeItem {
+    /*! \brief Time to send the duplicate */
+    TimePoint time;
+    uint64_t qid;
+    /*! \brief Backend the query was sent to */
+    uint32_t backend_id;
+    /*! \brief Encoded query */
+    std::shared_ptr<Message> msg;
+  };
+
+  std::shared_ptr<BackendSession> GetBackend(const std::string& stream_key);
+  /*! \brief Gets an available backend other than backend_id. */
+  std::shared_ptr<BackendSession> GetBackendExcept(uint32_t backend_id);
   
-  std::shared_ptr<BackendSession> GetBackendWeightedRoundRobin();
+  std::shared_ptr<BackendSession> GetBackendWeightedRoundRobin(
+      const Route& route);
 
-  std::shared_ptr<BackendSession> GetBackendDeficitRoundRobin();
+  std::shared_ptr<BackendSession> GetBackendDeficitRoundRobin(
+      const Route& route);
+  /*!
+   * \brief Draws two backends by rate and picks the one with the earlier
+   *   expected completion time.
+   */
+  std::shared_ptr<BackendSession> GetBackendLeastOutstanding(
+      const Route& route);
+  /*!
+   * \brief Picks the first backend at or after the hash of stream key on the
+   *   hash ring whose load is within hash_load_factor of its fair share.
+   */
+  std::shared_ptr<BackendSession> GetBackendConsistentHash(
+      const Route& route, const std::string& stream_key);
+  /*! \brief Draws the index of a backend in proportion to its rate. */
+  static size_t SampleBackend(const Route& route);
+  /*! \brief Gets the load of a backend in the route, nullptr if absent. */
+  std::shared_ptr<BackendLoad> GetBackendLoad(uint32_t backend_id);
+  /*! \brief Whether the load balance policy tracks backend loads. */
+  bool tracks_load() const {
+    return lb_policy_ == LB_LeastOutstanding ||
+        lb_policy_ == LB_ConsistentHash;
+  }
+  /*!
+   * \brief Releases the backend loads of a resolved query. Must hold the
+   *   lock of its query shard.
+   */
+  static void ReleaseLoads(const QueryState& state);
+
+  /*!
+   * \brief Gets the shard of a query. Query ids are assigned in sequence, so
+   *   concurrent queries spread over all shards.
+   */
+  QueryShard& query_shard(uint64_t qid) {
+    return query_shards_[qid % kNumQueryShards];
+  }
 
   void DeficitDaemon();
+  /*! \brief Sends duplicates of queries that are unfinished by hedge time. */
+  void HedgeDaemon();
+  /*! \brief Sends a duplicate if the query is still pending. */
+  bool SendHedge(const HedgeItem& item);
+  /*! \brief Asks backends to drop the query. */
+  void SendCancel(uint64_t qid, const std::vector<uint32_t>& backends);
+  /*!
+   * \brief Sends a query to a backend.
+   * \param ctx Request context
+   * \param qid Query id
+   * \param query Content of the query, per query fields are set here
+   * \param lead Whether the query leads a flight
+   * \param key_hash Hash of the query content if it leads a flight
+   */
+  void SendQuery(std::shared_ptr<RequestContext> ctx, uint64_t qid,
+                 QueryProto* query, bool lead, uint64_t key_hash);
+  /*!
+   * \brief Serves a query from the result cache or attaches it to an
+   *   identical query in flight. Only requests with a priority class and
+   *   deadline no more urgent than the leader's attach to a flight.
+   *   Otherwise the query leads a new flight if coalescing is enabled.
+   * \param ctx Request context
+   * \param qid Query id
+   * \param key_hash Hash of key
+   * \param key Serialized content of the query
+   * \param lead Set to true if the query leads a new flight
+   * \return Whether the query is served without sending it to backends
+   */
+  bool JoinIdenticalQuery(std::shared_ptr<RequestContext> ctx, uint64_t qid,
+                          uint64_t key_hash, const std::string& key,
+                          bool* lead);
+  /*!
+   * \brief Fans out the result of a flight leader to its waiters, and caches
+   *   the result if enabled. Waiters are sent on their own instead if the
+   *   leader failed for reasons other than the query content, such as a
+   *   timeout under the leader's deadline. No-op if the flight has finished.
+   */
+  void FinishFlight(uint64_t key_hash, uint64_t qid,
+                    const QueryResultProto& result);
+  /*!
+   * \brief Ends a flight whose leader is cancelled.
+   * \return False if requests are still waiting on the flight
+   */
+  bool AbandonFlight(uint64_t key_hash, uint64_t qid);
 
   ModelSession model_session_;
   std::string model_session_id_;
+  std::atomic<uint32_t> model_session_handle_;
   BackendPool& backend_pool_;
   LoadBalancePolicy lb_policy_;
   static std::atomic<uint64_t> global_query_id_;
 
-  std::vector<uint32_t> backends_;
-  /*!
-   * \brief Mapping from backend id to its serving rate,
-   *
-   *   Guarded by route_mu_
-   */
-  std::unordered_map<uint32_t, double> backend_rates_;
-
-  std::unordered_map<uint32_t, double> backend_quantums_;
-  float total_throughput_;
+  /*! \brief Current route, read without locks on the query path */
+  SnapshotPtr<Route> route_;
   /*! \brief Interval counter to count number of requests within each
    *  interval.
    */
   std::shared_ptr<IntervalCounter> counter_;
+  /*! \brief Stages chained to the model */
+  std::vector<ChainStageProto> chain_;
+  /*! \brief Model handlers of the chained stages, in the order of chain_ */
+  std::vector<std::shared_ptr<ModelHandler> > chain_handlers_;
 
-  std::unordered_map<uint64_t, std::shared_ptr<RequestContext> > query_ctx_;
-  std::mutex route_mu_;
-  std::mutex query_ctx_mu_;
-  /*! \brief random number generator */
+  static const size_t kNumQueryShards = 16;
+  /*! \brief Queries that expect replies, sharded by query id */
+  QueryShard query_shards_[kNumQueryShards];
+  /*! \brief Fraction of latency SLA before hedging, 0 if disabled */
+  std::atomic<double> hedge_delay_;
+  /*! \brief Hedge tokens earned per query. Guarded by hedge_mu_. */
+  double hedge_budget_;
+  /*! \brief Available hedge tokens. Guarded by hedge_mu_. */
+  double hedge_tokens_;
+  /*! \brief Queries in order of hedge time. Guarded by hedge_mu_. */
+  std::deque<HedgeItem> hedge_queue_;
+  std::mutex hedge_mu_;
+  std::condition_variable hedge_cv_;
+  /*! \brief Map from content hash to query in flight. Guarded by flight_mu_. */
+  std::unordered_map<uint64_t, Flight> flights_;
+  /*! \brief Map from content hash to cached result. Guarded by flight_mu_. */
+  std::unordered_map<uint64_t, CachedResult> result_cache_;
+  std::mutex flight_mu_;
   std::atomic<uint32_t> backend_idx_;
-  std::random_device rd_;
-  std::mt19937 rand_gen_;
 
   std::atomic<bool> running_;
   std::thread deficit_thread_;
+  std::thread hedge_thread_;
 };
 
 } // namespace app
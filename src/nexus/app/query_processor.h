@@ -3,15 +3,27 @@
 
 #include "nexus/app/exec_block.h"
 #include "nexus/app/request_context.h"
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+DECLARE_bool(parallel_blocks);
+
 namespace nexus {
 namespace app {
 
 class QueryProcessor {
  public:
-  QueryProcessor(std::vector<ExecBlock*> blocks) :
-      blocks_(blocks) {
+  /*!
+   * \brief Constructor of QueryProcessor
+   * \param blocks Exec blocks of a request
+   * \param parallel Whether ready blocks of a request are dispatched to
+   *   workers in parallel. Blocks that may run at the same time must not
+   *   both write to the reply.
+   */
+  QueryProcessor(std::vector<ExecBlock*> blocks,
+                 bool parallel = FLAGS_parallel_blocks) :
+      blocks_(blocks),
+      parallel_(parallel) {
     std::unordered_set<int> block_ids;
     for (auto block : blocks) {
       if (block_ids.count(block->id()) > 0) {
@@ -21,33 +33,55 @@ class QueryProcessor {
     }
   }
 
+  /*!
+   * \brief Constructor of QueryProcessor for continuation-style app logic
+   * \param entry Entry of app logic, which chains continuations by
+   *   RequestContext::Then
+   */
+  QueryProcessor(Continuation entry) :
+      parallel_(false),
+      entry_(entry) {}
+
   void Process(std::shared_ptr<RequestContext> ctx) {
+    if (entry_) {
+      if (ctx->state() == kUninitialized) {
+        ctx->Start(entry_);
+      } else {
+        // Queued when query results made continuations ready
+        ctx->RunReadyContinuations();
+      }
+      return;
+    }
     if (ctx->state() == kUninitialized) {
       // LOG(INFO) << "Init req " << ctx->const_request().user_id() << ":" <<
       //     ctx->const_request().req_id();
-      ctx->SetExecBlocks(blocks_);
+      ctx->SetExecBlocks(blocks_, parallel_);
     }
-    while (!ctx->finished()) {
+    while (true) {
+      // Other workers may run ready blocks of the request in parallel mode
       auto block = ctx->NextReadyBlock();
       if (block == nullptr) {
-        ctx->SetState(kBlocking);
-        return;
+        break;
       }
       // LOG(INFO) << "Exec req " << ctx->const_request().user_id() << ":" <<
       //     ctx->const_request().req_id() << ", block " << block->id();
       auto ret = block->Run(ctx);
       if (ctx->state() == kError) {
-        break;
+        ret.clear();
       }
       ctx->AddBlockReturn(ret);
     }
-    // LOG(INFO) << "Reply req " << ctx->const_request().user_id() << ":" <<
-    //     ctx->const_request().req_id();
-    ctx->SendReply();
+    if (ctx->finished()) {
+      // LOG(INFO) << "Reply req " << ctx->const_request().user_id() << ":" <<
+      //     ctx->const_request().req_id();
+      ctx->SendReply();
+    }
   }
 
  private:
   std::vector<ExecBlock*> blocks_;
+  bool parallel_;
+  Continuation entry_;
 };
 
 } // namespace app
@@ -1,27 +1,117 @@
+#include <algorithm>
+
 #include "nexus/app/exec_block.h"
 #include "nexus/app/request_context.h"
 #include "nexus/common/model_def.h"
+#include "nexus/common/util.h"
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+DEFINE_int32(request_deadline_ms, 50, "Default time budget of a request in "
+             "ms, used when the client doesn't specify a deadline");
+DEFINE_double(user_rate_limit, 0., "Max rate of requests per user in reqs/sec, "
+              "0 for no limit");
+DEFINE_double(user_burst, 10., "Max burst of requests per user above the rate "
+              "limit");
+DEFINE_int32(user_max_queued, 0, "Max number of new requests queued per user, "
+             "0 for no limit");
+DEFINE_string(user_weights, "", "Weights of users in fair queuing as comma "
+              "separated user_id:weight pairs, 1 for users not listed");
+
 namespace nexus {
 namespace app {
 
+BatchReply::BatchReply(std::shared_ptr<UserSession> user_sess,
+                       const RequestProto& request) :
+    user_session_(user_sess),
+    begin_(Clock::now()),
+    remaining_(request.inputs_size()) {
+  reply_.set_user_id(request.user_id());
+  reply_.set_req_id(request.req_id());
+  reply_.set_status(CTRL_OK);
+  for (int i = 0; i < request.inputs_size(); ++i) {
+    reply_.add_item();
+  }
+}
+
+void BatchReply::SetItemReply(int index, const ReplyProto& reply) {
+  std::lock_guard<std::mutex> lock(mu_);
+  reply_.mutable_item(index)->CopyFrom(reply);
+  if (--remaining_ > 0) {
+    return;
+  }
+  reply_.set_latency_us(std::chrono::duration_cast<std::chrono::microseconds>(
+      Clock::now() - begin_).count());
+  auto reply_msg = std::make_shared<Message>(kUserReply,
+                                             reply_.ByteSizeLong());
+  reply_msg->EncodeBody(reply_);
+  user_session_->Write(std::move(reply_msg));
+}
+
 RequestContext::RequestContext(std::shared_ptr<UserSession> user_sess,
                                std::shared_ptr<Message> msg,
                                RequestPool& req_pool) :
     DeadlineItem(),
     user_session_(user_sess),
     req_pool_(req_pool),
+    batch_index_(0),
     state_(kUninitialized),
-    slack_ms_(0.) {
-  SetDeadline(std::chrono::milliseconds(50));
+    slack_ms_(0.),
+    parallel_(false),
+    replied_(false),
+    running_blocks_(0),
+    active_conts_(0) {
   //beg_ = Clock::now();
   msg->DecodeBody(&request_);
+  Init();
+}
+
+RequestContext::RequestContext(std::shared_ptr<UserSession> user_sess,
+                               RequestProto* request, RequestPool& req_pool,
+                               std::shared_ptr<BatchReply> batch, int index) :
+    DeadlineItem(),
+    user_session_(user_sess),
+    req_pool_(req_pool),
+    batch_(batch),
+    batch_index_(index),
+    state_(kUninitialized),
+    slack_ms_(0.),
+    parallel_(false),
+    replied_(false),
+    running_blocks_(0),
+    active_conts_(0) {
+  request_.Swap(request);
+  Init();
+}
+
+std::vector<std::shared_ptr<RequestContext> > RequestContext::SplitBatch() {
+  auto batch = std::make_shared<BatchReply>(user_session_, request_);
+  google::protobuf::RepeatedPtrField<ValueProto> inputs;
+  inputs.Swap(request_.mutable_inputs());
+  request_.clear_input();
+  std::vector<std::shared_ptr<RequestContext> > items;
+  for (int i = 0; i < inputs.size(); ++i) {
+    RequestProto item(request_);
+    item.mutable_input()->Swap(inputs.Mutable(i));
+    items.push_back(std::make_shared<RequestContext>(
+        user_session_, &item, req_pool_, batch, i));
+  }
+  return items;
+}
+
+void RequestContext::Init() {
+  int deadline_ms = request_.deadline_ms();
+  if (deadline_ms == 0) {
+    deadline_ms = FLAGS_request_deadline_ms;
+  }
+  SetDeadline(std::chrono::milliseconds(deadline_ms));
+  SetPriority(request_.priority());
 }
 
 bool RequestContext::finished() {
   std::lock_guard<std::mutex> lock(mu_);
-  return (pending_blocks_.empty() && ready_blocks_.empty());
+  return (pending_blocks_.empty() && ready_blocks_.empty() &&
+          running_blocks_ == 0);
 }
 
 void RequestContext::SetState(RequestState state) {
@@ -43,8 +133,10 @@ void RequestContext::SetState(RequestState state) {
   }
 }
 
-void RequestContext::SetExecBlocks(std::vector<ExecBlock*> blocks) {
+void RequestContext::SetExecBlocks(std::vector<ExecBlock*> blocks,
+                                   bool parallel) {
   CHECK_EQ(state_, kUninitialized) << "Request context is alrealdy initialized";
+  parallel_ = parallel;
   for (auto block : blocks) {
     auto deps = block->dependency();
     if (deps.empty()) {
@@ -60,10 +152,20 @@ void RequestContext::SetExecBlocks(std::vector<ExecBlock*> blocks) {
 ExecBlock* RequestContext::NextReadyBlock() {
   std::lock_guard<std::mutex> lock(mu_);
   if (ready_blocks_.empty()) {
+    // Decided under mu_, so a block made ready by a query result either is
+    // seen here or wakes up the request
+    if (running_blocks_ == 0 && !pending_blocks_.empty()) {
+      SetState(kBlocking);
+    }
     return nullptr;
   }
   auto block = ready_blocks_.front();
   ready_blocks_.pop_front();
+  ++running_blocks_;
+  if (parallel_ && !ready_blocks_.empty()) {
+    // Let another worker take the next ready block
+    req_pool_.AddReadyRequest(shared_from_this());
+  }
   // LOG(INFO) << "Ready blocks: " << ready_blocks_.size() <<
   //     ", pending blocks: " << pending_blocks_.size();
   return block;
@@ -79,6 +181,7 @@ VariablePtr RequestContext::GetVariable(const std::string& var_name) {
 
 void RequestContext::AddBlockReturn(std::vector<VariablePtr> vars) {
   std::lock_guard<std::mutex> lock(mu_);
+  --running_blocks_;
   for (auto var : vars) {
     auto var_name = var->name();
     for (auto qid : var->query_ids()) {
@@ -98,13 +201,72 @@ void RequestContext::AddBlockReturn(std::vector<VariablePtr> vars) {
   }
 }
 
+void RequestContext::Start(Continuation entry) {
+  CHECK_EQ(state_, kUninitialized) << "Request context is alrealdy initialized";
+  state_.store(kRunning);
+  auto cont = std::make_shared<PendingContinuation>();
+  cont->func = std::move(entry);
+  cont->pending = 0;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    ++active_conts_;
+  }
+  RunContinuation(cont);
+}
+
+void RequestContext::Then(std::shared_ptr<QueryResult> result,
+                          Continuation func) {
+  Then(std::vector<std::shared_ptr<QueryResult> >{result}, std::move(func));
+}
+
+void RequestContext::Then(
+    const std::vector<std::shared_ptr<QueryResult> >& results,
+    Continuation func) {
+  auto cont = std::make_shared<PendingContinuation>();
+  cont->func = std::move(func);
+  cont->pending = 0;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (state_ == kError) {
+      return;
+    }
+    ++active_conts_;
+    for (auto& result : results) {
+      if (result->ready()) {
+        continue;
+      }
+      auto itr = dangling_results_.find(result->query_id());
+      if (itr != dangling_results_.end()) {
+        result->SetResult(itr->second);
+        dangling_results_.erase(itr);
+      } else {
+        cont_results_.emplace(result->query_id(), std::make_pair(result, cont));
+        ++cont->pending;
+      }
+    }
+    if (cont->pending > 0) {
+      return;
+    }
+  }
+  RunContinuation(cont);
+}
+
 void RequestContext::HandleQueryResult(const QueryResultProto& result) {
   if (state_ == kError) {
     return;
   }
-  std::lock_guard<std::mutex> lock(mu_);
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    HandleQueryResultLocked(result);
+  }
+  CancelAbandonedQueries();
+  ScheduleReadyContinuations();
+}
+
+void RequestContext::HandleQueryResultLocked(const QueryResultProto& result) {
   // Add query latency info
   uint64_t qid = result.query_id();
+  query_handlers_.erase(qid);
 
   auto query_latency = reply_.add_query_latency();
   auto recv_ts = std::chrono::duration_cast<std::chrono::microseconds>(
@@ -130,6 +292,17 @@ void RequestContext::HandleQueryResult(const QueryResultProto& result) {
     return;
   }
 
+  auto cont_itr = cont_results_.find(qid);
+  if (cont_itr != cont_results_.end()) {
+    cont_itr->second.first->SetResult(result);
+    auto cont = cont_itr->second.second;
+    cont_results_.erase(cont_itr);
+    if (--cont->pending == 0) {
+      ready_conts_.push_back(cont);
+    }
+    return;
+  }
+
   auto qid_itr = qid_var_map_.find(qid);
   if (qid_itr == qid_var_map_.end()) {
     dangling_results_.emplace(qid, result);
@@ -147,27 +320,40 @@ void RequestContext::HandleQueryResult(const QueryResultProto& result) {
 
 void RequestContext::HandleError(uint32_t status,
                                  const std::string& error_msg) {
-  std::lock_guard<std::mutex> lock(mu_);
-  HandleErrorLocked(status, error_msg);
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    HandleErrorLocked(status, error_msg);
+  }
+  CancelAbandonedQueries();
+  ScheduleReadyContinuations();
 }
 
-void RequestContext::RecordQuerySend(uint64_t qid) {
+void RequestContext::RecordQuerySend(uint64_t qid, ModelHandler* handler) {
   std::lock_guard<std::mutex> lock(mu_);
   uint64_t ts = std::chrono::duration_cast<std::chrono::microseconds>(
       Clock::now() - begin_).count();
   query_send_.emplace(qid, ts);
+  query_handlers_.emplace(qid, handler);
 }
 
 void RequestContext::SendReply() {
+  if (replied_.exchange(true)) {
+    return;
+  }
   reply_.set_user_id(request_.user_id());
   reply_.set_req_id(request_.req_id());
   auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
       Clock::now() - begin_).count();
   reply_.set_latency_us(latency);
-  auto reply_msg = std::make_shared<Message>(kUserReply,
-                                             reply_.ByteSizeLong());
-  reply_msg->EncodeBody(reply_);
-  user_session_->Write(std::move(reply_msg));
+  if (batch_ != nullptr) {
+    batch_->SetItemReply(batch_index_, reply_);
+  } else {
+    auto reply_msg = std::make_shared<Message>(kUserReply,
+                                               reply_.ByteSizeLong());
+    reply_msg->EncodeBody(reply_);
+    user_session_->Write(std::move(reply_msg));
+  }
+  req_pool_.RecordReply(request_.user_id(), reply_.status(), latency);
 }
 
 void RequestContext::AddReadyVariable(std::shared_ptr<Variable> var) {
@@ -185,7 +371,14 @@ void RequestContext::AddReadyVariable(std::shared_ptr<Variable> var) {
     block_deps_.erase(block_id);
     ready_blocks_.push_back(block);
   }
-  if (!ready_blocks_.empty()) {
+  if (ready_blocks_.empty()) {
+    return;
+  }
+  if (parallel_ && state_ == kRunning) {
+    // Workers running other blocks of the request can't take them until
+    // their blocks return
+    req_pool_.AddReadyRequest(shared_from_this());
+  } else {
     SetState(kRunning);
   }
 }
@@ -197,6 +390,227 @@ void RequestContext::HandleErrorLocked(uint32_t status,
   ready_blocks_.clear();
   pending_blocks_.clear();
   SetState(kError);
+  // Results of outstanding queries are no longer needed
+  for (auto& iter : query_handlers_) {
+    abandoned_queries_.emplace_back(iter.first, iter.second);
+  }
+  query_handlers_.clear();
+  // Waiting continuations are released to be skipped, so that the reply is
+  // sent once running ones return
+  for (auto& iter : cont_results_) {
+    auto& cont = iter.second.second;
+    if (cont->pending > 0) {
+      cont->pending = 0;
+      ready_conts_.push_back(cont);
+    }
+  }
+  cont_results_.clear();
+}
+
+void RequestContext::RunContinuation(
+    std::shared_ptr<PendingContinuation> cont) {
+  if (state_ != kError) {
+    cont->func(shared_from_this());
+  }
+  bool done;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    done = (--active_conts_ == 0);
+  }
+  if (done) {
+    SendReply();
+  }
+}
+
+void RequestContext::RunReadyContinuations() {
+  std::vector<std::shared_ptr<PendingContinuation> > conts;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    conts.swap(ready_conts_);
+  }
+  for (auto& cont : conts) {
+    RunContinuation(cont);
+  }
+}
+
+void RequestContext::ScheduleReadyContinuations() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (ready_conts_.empty()) {
+      return;
+    }
+  }
+  req_pool_.AddContinuationRequest(shared_from_this());
+}
+
+void RequestContext::CancelAbandonedQueries() {
+  std::vector<std::pair<uint64_t, ModelHandler*> > queries;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    queries.swap(abandoned_queries_);
+  }
+  for (auto& query : queries) {
+    query.second->CancelQuery(query.first);
+  }
+}
+
+RequestPool::RequestPool() {
+  std::vector<std::string> pairs;
+  SplitString(FLAGS_user_weights, ',', &pairs);
+  for (auto& pair : pairs) {
+    if (pair.empty()) {
+      continue;
+    }
+    std::vector<std::string> tokens;
+    SplitString(pair, ':', &tokens);
+    CHECK_EQ(tokens.size(), 2) << "Malformed user weight " << pair;
+    double weight = std::stod(tokens[1]);
+    CHECK_GT(weight, 0) << "User weight must be positive: " << pair;
+    weights_[std::stoul(tokens[0])] = weight;
+  }
+}
+
+bool RequestPool::AddNewRequest(std::shared_ptr<RequestContext> req) {
+  uint32_t user_id = req->const_request().user_id();
+  {
+    std::lock_guard<std::mutex> lock(queue_mu_);
+    auto& tenant = GetTenant(user_id);
+    if (FLAGS_user_rate_limit > 0) {
+      TimePoint now = Clock::now();
+      double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+          now - tenant.last_refill).count() / 1e6;
+      tenant.tokens = std::min(
+          tenant.tokens + elapsed * FLAGS_user_rate_limit,
+          std::max(FLAGS_user_burst, 1.));
+      tenant.last_refill = now;
+      if (tenant.tokens < 1.) {
+        ++tenant.stats.rejected;
+        return false;
+      }
+    }
+    if (FLAGS_user_max_queued > 0 &&
+        tenant.requests.size() >= size_t(FLAGS_user_max_queued)) {
+      ++tenant.stats.rejected;
+      return false;
+    }
+    if (FLAGS_user_rate_limit > 0) {
+      tenant.tokens -= 1.;
+    }
+    ++tenant.stats.admitted;
+    if (tenant.requests.empty()) {
+      tenant.deficit = tenant.weight;
+      active_tenants_.push_back(user_id);
+    }
+    tenant.requests.push(std::move(req));
+  }
+  queue_cv_.notify_one();
+  return true;
+}
+
+void RequestPool::AddReadyRequest(std::shared_ptr<RequestContext> req) {
+  {
+    std::lock_guard<std::mutex> lock(queue_mu_);
+    ready_requests_.push(std::move(req));
+  }
+  queue_cv_.notify_one();
+}
+
+void RequestPool::AddContinuationRequest(
+    std::shared_ptr<RequestContext> req) {
+  {
+    std::lock_guard<std::mutex> lock(queue_mu_);
+    cont_requests_.push_back(std::move(req));
+  }
+  queue_cv_.notify_one();
+}
+
+std::shared_ptr<RequestContext> RequestPool::GetRequest(
+    std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(queue_mu_);
+  if (!queue_cv_.wait_for(lock, timeout, [this]() {
+        return !cont_requests_.empty() || !ready_requests_.empty() ||
+            !active_tenants_.empty(); })) {
+    return nullptr;
+  }
+  std::shared_ptr<RequestContext> req;
+  // Continuations only run app logic on results already received
+  if (!cont_requests_.empty()) {
+    req = std::move(cont_requests_.front());
+    cont_requests_.pop_front();
+    return req;
+  }
+  // Requests in progress are already admitted, finish them first
+  if (!ready_requests_.empty()) {
+    req = ready_requests_.top();
+    ready_requests_.pop();
+    return req;
+  }
+  // Deficit round robin, each user takes weight requests per round
+  while (true) {
+    auto& tenant = tenants_.at(active_tenants_.front());
+    if (tenant.deficit >= 1.) {
+      break;
+    }
+    tenant.deficit += tenant.weight;
+    active_tenants_.push_back(active_tenants_.front());
+    active_tenants_.pop_front();
+  }
+  auto& tenant = tenants_.at(active_tenants_.front());
+  req = tenant.requests.top();
+  tenant.requests.pop();
+  tenant.deficit -= 1.;
+  if (tenant.requests.empty()) {
+    tenant.deficit = 0.;
+    active_tenants_.pop_front();
+  }
+  return req;
+}
+
+void RequestPool::RecordReply(uint32_t user_id, uint32_t status,
+                              uint64_t latency_us) {
+  if (status == RATE_LIMITED) {
+    // Counted as rejected on admission
+    return;
+  }
+  std::lock_guard<std::mutex> lock(queue_mu_);
+  auto& stats = GetTenant(user_id).stats;
+  ++stats.replied;
+  if (status != CTRL_OK) {
+    ++stats.failed;
+  }
+  stats.total_latency_us += latency_us;
+  stats.max_latency_us = std::max(stats.max_latency_us, latency_us);
+}
+
+std::vector<TenantStats> RequestPool::GetTenantStats() {
+  std::vector<TenantStats> ret;
+  std::lock_guard<std::mutex> lock(queue_mu_);
+  for (auto& iter : tenants_) {
+    auto& stats = iter.second.stats;
+    if (stats.admitted == 0 && stats.rejected == 0 && stats.replied == 0) {
+      continue;
+    }
+    ret.push_back(stats);
+    stats = TenantStats();
+    stats.user_id = iter.first;
+  }
+  return ret;
+}
+
+RequestPool::Tenant& RequestPool::GetTenant(uint32_t user_id) {
+  auto iter = tenants_.find(user_id);
+  if (iter != tenants_.end()) {
+    return iter->second;
+  }
+  auto& tenant = tenants_[user_id];
+  auto weight_iter = weights_.find(user_id);
+  tenant.weight = (weight_iter == weights_.end()) ? 1. : weight_iter->second;
+  tenant.tokens = std::max(FLAGS_user_burst, 1.);
+  tenant.last_refill = Clock::now();
+  tenant.deficit = 0.;
+  tenant.stats = TenantStats();
+  tenant.stats.user_id = user_id;
+  return tenant;
 }
 
 } // namespace app
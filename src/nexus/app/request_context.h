@@ -1,6 +1,10 @@
 #ifndef NEXUS_APP_REQUEST_CONTEXT_H_
 #define NEXUS_APP_REQUEST_CONTEXT_H_
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <queue>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -83,13 +87,64 @@ enum RequestState {
 };
 
 class ExecBlock;
+class RequestContext;
 class RequestPool;
 
+/*! \brief Collects the replies of the items of a batched request. */
+class BatchReply {
+ public:
+  /*!
+   * \brief Constructor of BatchReply
+   * \param user_sess User session to reply to
+   * \param request Batched request
+   */
+  BatchReply(std::shared_ptr<UserSession> user_sess,
+             const RequestProto& request);
+  /*!
+   * \brief Sets the reply of an item, and sends the batched reply after the
+   *   last item.
+   */
+  void SetItemReply(int index, const ReplyProto& reply);
+
+ private:
+  std::shared_ptr<UserSession> user_session_;
+  TimePoint begin_;
+  /*! \brief Guarded by mu_ */
+  ReplyProto reply_;
+  /*! \brief Number of items not yet replied. Guarded by mu_. */
+  int remaining_;
+  std::mutex mu_;
+};
+
+/*!
+ * \brief Continuation of app logic, run once the query results it awaits are
+ *   ready.
+ */
+using Continuation = std::function<void(std::shared_ptr<RequestContext> ctx)>;
+
 class RequestContext : public DeadlineItem,
                        public std::enable_shared_from_this<RequestContext> {
  public:
   RequestContext(std::shared_ptr<UserSession> user_sess,
                  std::shared_ptr<Message> msg, RequestPool& req_pool);
+  /*!
+   * \brief Constructor of an item of a batched request
+   * \param user_sess User session
+   * \param request Request of the item, swapped out
+   * \param req_pool Request pool
+   * \param batch Replies of the batched request
+   * \param index Index of the item
+   */
+  RequestContext(std::shared_ptr<UserSession> user_sess, RequestProto* request,
+                 RequestPool& req_pool, std::shared_ptr<BatchReply> batch,
+                 int index);
+  /*! \brief Whether the request carries a batch of inputs. */
+  bool is_batch() const { return request_.inputs_size() > 0; }
+  /*!
+   * \brief Splits a batched request into one request per input, which reply
+   *   through a shared BatchReply.
+   */
+  std::vector<std::shared_ptr<RequestContext> > SplitBatch();
 
   RequestProto* request() { return &request_; }
 
@@ -101,42 +156,118 @@ class RequestContext : public DeadlineItem,
 
   RequestState state() const { return state_; }
 
+  /*!
+   * \brief Whether all blocks have finished, or the request failed and no
+   *   block is running.
+   */
   bool finished();
 
   double slack_ms() const { return slack_ms_; }
 
   void SetState(RequestState state);
 
-  void SetExecBlocks(std::vector<ExecBlock*> blocks);
-
+  /*!
+   * \brief Initializes the exec blocks of the request.
+   * \param blocks Exec blocks
+   * \param parallel Whether ready blocks are dispatched to workers in parallel
+   */
+  void SetExecBlocks(std::vector<ExecBlock*> blocks, bool parallel = false);
+  /*!
+   * \brief Takes a ready block to run, whose return must be added by
+   *   AddBlockReturn. In parallel mode, the request is put back to the ready
+   *   queue if more blocks are ready.
+   * \return Ready block, or nullptr if none. The request is marked blocking
+   *   if no block is ready or running and some blocks are pending.
+   */
   ExecBlock* NextReadyBlock();
 
   VariablePtr GetVariable(const std::string& var_name);
 
+  /*! \brief Adds variables returned by a block taken by NextReadyBlock. */
   void AddBlockReturn(std::vector<VariablePtr> vars);
+  /*!
+   * \brief Runs the entry of continuation-style app logic instead of exec
+   *   blocks. The reply is sent once the entry and all continuations chained
+   *   from it have run.
+   * \param entry Entry of app logic
+   */
+  void Start(Continuation entry);
+  /*!
+   * \brief Runs func once the result is ready. Must be called from the entry
+   *   or a continuation.
+   *
+   * The continuation runs on a worker, which takes it ahead of new requests
+   * and requests queued by deadline. It is skipped if the request fails.
+   * \param result Result of ModelHandler::Execute
+   * \param func Continuation
+   */
+  void Then(std::shared_ptr<QueryResult> result, Continuation func);
+  /*! \brief Runs func once all results are ready. */
+  void Then(const std::vector<std::shared_ptr<QueryResult> >& results,
+            Continuation func);
 
   void HandleQueryResult(const QueryResultProto& result);
+  /*!
+   * \brief Runs continuations made ready by query results or errors. Called
+   *   by workers, must not hold mu_.
+   */
+  void RunReadyContinuations();
 
   void HandleError(uint32_t status, const std::string& error_msg);
 
-  void RecordQuerySend(uint64_t qid);
+  /*!
+   * \brief Records a query sent to backends.
+   * \param qid Query id
+   * \param handler Model handler that sent the query
+   */
+  void RecordQuerySend(uint64_t qid, ModelHandler* handler);
 
+  /*! \brief Sends the reply to user, only the first call takes effect. */
   void SendReply();
 
  private:
+  /*! \brief Continuation waiting for query results */
+  struct PendingContinuation {
+    Continuation func;
+    /*! \brief Number of results not yet ready */
+    size_t pending;
+  };
+
+  /*! \brief Sets the deadline and priority from the request. */
+  void Init();
+
   void AddReadyVariable(std::shared_ptr<Variable> var);
+  /*! \brief Runs a continuation and sends the reply after the last one. */
+  void RunContinuation(std::shared_ptr<PendingContinuation> cont);
+  /*!
+   * \brief Hands continuations made ready to workers, so that they don't run
+   *   on the thread that delivers query results. Must not hold mu_.
+   */
+  void ScheduleReadyContinuations();
+
+  void HandleQueryResultLocked(const QueryResultProto& result);
 
   void HandleErrorLocked(uint32_t status, const std::string& error_msg);
+  /*! \brief Cancels queries abandoned by an error, must not hold mu_. */
+  void CancelAbandonedQueries();
 
  protected:
   std::shared_ptr<UserSession> user_session_;
   RequestPool& req_pool_;
+  /*! \brief Replies of the batched request if the request is an item */
+  std::shared_ptr<BatchReply> batch_;
+  int batch_index_;
   RequestProto request_;
   ReplyProto reply_;
   std::atomic<RequestState> state_;
   double slack_ms_;
+  /*! \brief Whether ready blocks are dispatched to workers in parallel */
+  bool parallel_;
+  std::atomic<bool> replied_;
   
   std::deque<ExecBlock*> ready_blocks_;
+  /*! \brief Number of blocks taken by workers and not yet returned */
+  int running_blocks_;
   std::unordered_map<int, ExecBlock*> pending_blocks_;
   std::unordered_map<int, std::unordered_set<std::string> > block_deps_;
   
@@ -145,14 +276,59 @@ class RequestContext : public DeadlineItem,
   std::unordered_map<uint64_t, std::string> qid_var_map_;
   std::unordered_map<uint64_t, QueryResultProto> dangling_results_;
   std::unordered_map<uint64_t, uint64_t> query_send_;
+  /*! \brief Map from query id to model handler of outstanding queries */
+  std::unordered_map<uint64_t, ModelHandler*> query_handlers_;
+  /*! \brief Outstanding queries left behind when the request fails */
+  std::vector<std::pair<uint64_t, ModelHandler*> > abandoned_queries_;
+  /*! \brief Number of continuations waiting or running */
+  int active_conts_;
+  /*! \brief Map from query id to its result and the continuation awaiting it */
+  std::unordered_map<uint64_t, std::pair<
+    std::shared_ptr<QueryResult>, std::shared_ptr<PendingContinuation> > >
+      cont_results_;
+  /*! \brief Continuations whose results are ready, run outside of mu_ */
+  std::vector<std::shared_ptr<PendingContinuation> > ready_conts_;
   std::mutex mu_;
 };
 
+/*! \brief Request statistics of a user within a reporting interval */
+struct TenantStats {
+  uint32_t user_id;
+  /*! \brief Number of requests admitted */
+  uint64_t admitted;
+  /*! \brief Number of requests rejected by rate or queue limits */
+  uint64_t rejected;
+  /*! \brief Number of admitted requests that failed, e.g., timed out */
+  uint64_t failed;
+  /*! \brief Number of requests replied */
+  uint64_t replied;
+  /*! \brief Total and max latency of replied requests in us */
+  uint64_t total_latency_us;
+  uint64_t max_latency_us;
+};
+
+/*!
+ * \brief Pool of requests to be processed by workers.
+ *
+ * New requests are admitted per user with a token bucket and queued per
+ * user. Workers take requests in progress first, and otherwise take new
+ * requests across users by deficit round robin in proportion to user weights.
+ */
 class RequestPool {
  public:
-  void AddNewRequest(std::shared_ptr<RequestContext> req) {
-    ready_requests_.push(req);
-  }
+  RequestPool();
+  /*!
+   * \brief Admits a new request.
+   * \return False if the request is rejected by the limits of its user
+   */
+  bool AddNewRequest(std::shared_ptr<RequestContext> req);
+  /*! \brief Queues a request in progress that has more work to run. */
+  void AddReadyRequest(std::shared_ptr<RequestContext> req);
+  /*!
+   * \brief Queues a request whose continuations are ready. These are taken
+   *   in FIFO order before any other request.
+   */
+  void AddContinuationRequest(std::shared_ptr<RequestContext> req);
 
   void AddBlockRequest(std::shared_ptr<RequestContext> req) {
     std::lock_guard<std::mutex> lock(mu_);
@@ -160,17 +336,49 @@ class RequestPool {
   }
 
   void MoveToReady(std::shared_ptr<RequestContext> req) {
-    ready_requests_.push(req);
+    AddReadyRequest(req);
     std::lock_guard<std::mutex> lock(mu_);
     block_requests_.erase(req);
   }
 
-  std::shared_ptr<RequestContext> GetRequest(std::chrono::milliseconds timeout) {
-    return ready_requests_.pop(timeout);
-  }
+  std::shared_ptr<RequestContext> GetRequest(std::chrono::milliseconds timeout);
+  /*! \brief Records the reply of a request for user statistics. */
+  void RecordReply(uint32_t user_id, uint32_t status, uint64_t latency_us);
+  /*! \brief Gets statistics of active users since last call and resets them. */
+  std::vector<TenantStats> GetTenantStats();
 
  private:
-  BlockPriorityQueue<RequestContext> ready_requests_;
+  using RequestQueue = std::priority_queue<
+    std::shared_ptr<RequestContext>,
+    std::vector<std::shared_ptr<RequestContext> >, CompareDeadlineItem>;
+
+  struct Tenant {
+    /*! \brief Share of workers relative to other users */
+    double weight;
+    /*! \brief Tokens of rate limit */
+    double tokens;
+    TimePoint last_refill;
+    /*! \brief Requests that can be taken in the current round */
+    double deficit;
+    RequestQueue requests;
+    TenantStats stats;
+  };
+  /*! \brief Gets the state of a user, creating it if absent. */
+  Tenant& GetTenant(uint32_t user_id);
+
+  /*! \brief Requests with ready continuations. Guarded by queue_mu_. */
+  std::deque<std::shared_ptr<RequestContext> > cont_requests_;
+  /*! \brief Requests in progress. Guarded by queue_mu_. */
+  RequestQueue ready_requests_;
+  /*! \brief Map from user id to its state. Guarded by queue_mu_. */
+  std::unordered_map<uint32_t, Tenant> tenants_;
+  /*! \brief Users with queued new requests in round robin order */
+  std::deque<uint32_t> active_tenants_;
+  /*! \brief Weights of users from flag */
+  std::unordered_map<uint32_t, double> weights_;
+  std::mutex queue_mu_;
+  std::condition_variable queue_cv_;
+
   std::unordered_set<std::shared_ptr<RequestContext> > block_requests_;
   std::mutex mu_;
 };
@@ -1,6 +1,11 @@
+#include <gflags/gflags.h>
+
 #include "nexus/app/frontend.h"
 #include "nexus/app/worker.h"
 
+DEFINE_bool(parallel_blocks, false, "Dispatch ready exec blocks of a request "
+            "to workers in parallel");
+
 namespace nexus {
 namespace app {
 
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <pthread.h>
@@ -11,6 +12,24 @@
 
 DEFINE_bool(multi_batch, true, "Enable multi batching");
 DEFINE_int32(occupancy_valid, 10, "Backup backend occupancy valid time in ms");
+DEFINE_int32(task_pool_size, 1024, "Max number of tasks kept for reuse");
+DEFINE_int32(chain_task_pool_size, 128, "Max number of tasks of chained "
+             "stages kept for reuse");
+DEFINE_int32(cancel_retain_ms, 1000, "Time in ms to keep the id of a query "
+             "cancelled by a frontend for dropping its queued task");
+DEFINE_int32(model_loaders, 2, "Number of threads loading model instances");
+DEFINE_bool(model_warmup, true, "Forward all batch sizes up to max batch "
+            "before a new model instance serves queries");
+DEFINE_uint64(standby_memory_mb, 1024, "Memory budget in MB of unloaded model "
+              "instances kept parked for reuse, 0 disables the standby pool");
+DEFINE_uint64(min_workers, 1, "Min number of preprocess workers");
+DEFINE_uint64(max_workers, 0, "Max number of preprocess workers (default: "
+              "number of cores)");
+DEFINE_uint64(postprocess_workers, 1, "Initial number of postprocess workers");
+DEFINE_uint64(max_postprocess_workers, 0, "Max number of postprocess workers "
+              "(default: same as max_workers)");
+DEFINE_int32(worker_scale_interval_ms, 200, "Interval to scale worker pools "
+             "in ms, 0 to disable autoscaling");
 
 namespace nexus {
 namespace backend {
@@ -21,7 +40,15 @@ BackendServer::BackendServer(std::string port, std::string rpc_port,
     ServerBase(port),
     gpu_id_(gpu_id),
     running_(false),
+    utilization_(0.),
     rpc_service_(this, rpc_port),
+    num_cancelled_(0),
+    task_pool_(FLAGS_task_pool_size),
+    chain_task_pool_(FLAGS_chain_task_pool_size),
+    model_table_(std::make_shared<ModelTableSnapshot>()),
+    table_version_(0),
+    standby_memory_(0),
+    ready_dirty_(false),
     rand_gen_(rd_()) {
   // Start RPC service
   rpc_service_.Start();
@@ -64,7 +91,7 @@ BackendServer::BackendServer(std::string port, std::string rpc_port,
   LOG(FATAL) << "backend needs the USE_GPU flag set at compile-time.";
 #endif
 
-  // Init workers
+  // Init worker pools
   if (num_workers == 0) {
     if (cores.empty()) {
       num_workers = 4;
@@ -72,15 +99,27 @@ BackendServer::BackendServer(std::string port, std::string rpc_port,
       num_workers = cores.size();
     }
   }
-  for (size_t i = 0; i < num_workers; ++i) {
-    std::unique_ptr<Worker> worker(new Worker(i, this, task_queue_));
+  size_t max_workers = FLAGS_max_workers;
+  if (max_workers == 0) {
     if (cores.empty()) {
-      worker->Start();
+      max_workers = std::thread::hardware_concurrency();
     } else {
-      worker->Start(cores[i % cores.size()]);
+      max_workers = cores.size();
     }
-    workers_.push_back(std::move(worker));
   }
+  max_workers = std::max(max_workers, num_workers);
+  size_t max_post_workers = FLAGS_max_postprocess_workers;
+  if (max_post_workers == 0) {
+    max_post_workers = max_workers;
+  }
+  preprocess_pool_.reset(new WorkerPool(
+      "preprocess", this, task_queue_, FLAGS_min_workers, max_workers, cores));
+  preprocess_pool_->Start(num_workers);
+  // Pin postprocess workers starting from the other end of the cores
+  postprocess_pool_.reset(new WorkerPool(
+      "postprocess", this, postprocess_queue_, 1, max_post_workers,
+      std::vector<int>(cores.rbegin(), cores.rend())));
+  postprocess_pool_->Start(FLAGS_postprocess_workers);
 }
 
 BackendServer::~BackendServer() {
@@ -95,7 +134,15 @@ void BackendServer::Run() {
   Register();
   // Start the daemon thread
   model_table_thread_ = std::thread(&BackendServer::ModelTableDaemon, this);
+  for (int i = 0; i < FLAGS_model_loaders; ++i) {
+    loader_threads_.emplace_back(&BackendServer::ModelLoaderDaemon, this);
+  }
   daemon_thread_ = std::thread(&BackendServer::Daemon, this);
+  utilization_thread_ = std::thread(&BackendServer::UtilizationDaemon, this);
+  if (FLAGS_worker_scale_interval_ms > 0) {
+    worker_scale_thread_ = std::thread(&BackendServer::WorkerScaleDaemon,
+                                       this);
+  }
   LOG(INFO) << "Backend server (id: " << node_id_ << ") is listening on " <<
       address();
   // Start the IO service
@@ -103,7 +150,11 @@ void BackendServer::Run() {
 }
 
 void BackendServer::Stop() {
-  running_ = false;
+  {
+    std::lock_guard<std::mutex> lock(ready_mu_);
+    running_ = false;
+  }
+  ready_cv_.notify_all();
   // Unregister backend server
   Unregister();
   // Stop accept new connections
@@ -113,15 +164,21 @@ void BackendServer::Stop() {
     conn->Stop();
   }
   frontend_connections_.clear();
+  // Wait for model loads in progress
+  for (auto& thread : loader_threads_) {
+    thread.join();
+  }
+  loader_threads_.clear();
 #ifdef USE_GPU
   // Stop GPU executor
   gpu_executor_->Stop();
 #endif
   // Stop workers
-  for (auto& worker : workers_) {
-    worker->Stop();
+  if (worker_scale_thread_.joinable()) {
+    worker_scale_thread_.join();
   }
-  workers_.clear();
+  preprocess_pool_->Stop();
+  postprocess_pool_->Stop();
   // Stop daemon thread
   if (daemon_thread_.joinable()) {
     daemon_thread_.join();
@@ -129,6 +186,9 @@ void BackendServer::Stop() {
   if (model_table_thread_.joinable()) {
     model_table_thread_.join();
   }
+  if (utilization_thread_.joinable()) {
+    utilization_thread_.join();
+  }
   // Stop RPC service
   rpc_service_.Stop();
   LOG(INFO) << "Backend server stopped";
@@ -146,15 +206,54 @@ void BackendServer::HandleMessage(std::shared_ptr<Connection> conn,
   switch (message->type()) {
     case kBackendRequest:
     case kBackendRelay: {
-      auto task = std::make_shared<Task>(conn);
+      auto task = task_pool_.Acquire(conn);
       task->DecodeQuery(message);
+      ResolveModelSession(task.get());
       task_queue_.push(std::move(task));
       break;
     }
+    case kBackendRequestBatch: {
+      std::vector<std::pair<const char*, size_t> > entries;
+      if (!message->SplitBatchBody(&entries)) {
+        LOG(ERROR) << "Malformed request batch";
+        break;
+      }
+      std::vector<std::shared_ptr<Task> > tasks;
+      tasks.reserve(entries.size());
+      for (auto& entry : entries) {
+        auto task = task_pool_.Acquire(conn);
+        task->DecodeQuery(entry.first, entry.second);
+        ResolveModelSession(task.get());
+        tasks.push_back(std::move(task));
+      }
+      task_queue_.push(std::move(tasks));
+      break;
+    }
     case kBackendRelayReply: {
       std::static_pointer_cast<BackupClient>(conn)->Reply(std::move(message));
       break;
     }
+    case kBackendCancel: {
+      CancelQueryProto request;
+      message->DecodeBody(&request);
+      CancelQueryProto reply;
+      reply.set_model_session_id(request.model_session_id());
+      std::unordered_set<uint64_t> query_ids(request.query_id().begin(),
+                                             request.query_id().end());
+      // Tasks still waiting for preprocessing are dropped by the workers
+      AddCancelledQueries(conn, query_ids);
+      auto model = GetModel(request.model_session_id());
+      if (model != nullptr) {
+        for (auto qid : model->CancelTasks(conn, query_ids)) {
+          reply.add_query_id(qid);
+        }
+      }
+      auto reply_msg = std::make_shared<Message>(kBackendCancelReply,
+                                                 reply.ByteSizeLong());
+      reply_msg->EncodeBody(reply);
+      conn->Write(std::move(reply_msg));
+      break;
+    }
     default:
       LOG(INFO) << "Wrong message type: " << message->type();
   }
@@ -168,11 +267,66 @@ void BackendServer::HandleError(std::shared_ptr<Connection> conn,
   } else {
     LOG(ERROR) << "Frontend connection error (" << ec << "): " << ec.message();
   }
+  {
+    std::lock_guard<std::mutex> lock(cancel_mu_);
+    auto iter = cancelled_queries_.find(conn.get());
+    if (iter != cancelled_queries_.end()) {
+      num_cancelled_ -= iter->second.current.size() +
+                        iter->second.previous.size();
+      cancelled_queries_.erase(iter);
+    }
+  }
   std::lock_guard<std::mutex> lock(frontend_mutex_);
   frontend_connections_.erase(conn);
   conn->Stop();
 }
 
+void BackendServer::AddCancelledQueries(
+    const std::shared_ptr<Connection>& conn,
+    const std::unordered_set<uint64_t>& query_ids) {
+  std::lock_guard<std::mutex> lock(cancel_mu_);
+  auto& cancelled = cancelled_queries_[conn.get()];
+  RotateCancelledQueries(&cancelled, Clock::now());
+  for (auto qid : query_ids) {
+    if (cancelled.previous.count(qid) == 0 &&
+        cancelled.current.insert(qid).second) {
+      ++num_cancelled_;
+    }
+  }
+}
+
+bool BackendServer::TakeCancelledQuery(const std::shared_ptr<Connection>& conn,
+                                       uint64_t query_id) {
+  if (num_cancelled_.load(std::memory_order_relaxed) == 0) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(cancel_mu_);
+  auto iter = cancelled_queries_.find(conn.get());
+  if (iter == cancelled_queries_.end()) {
+    return false;
+  }
+  auto& cancelled = iter->second;
+  RotateCancelledQueries(&cancelled, Clock::now());
+  if (cancelled.current.erase(query_id) == 0 &&
+      cancelled.previous.erase(query_id) == 0) {
+    return false;
+  }
+  --num_cancelled_;
+  return true;
+}
+
+void BackendServer::RotateCancelledQueries(CancelledQueries* cancelled,
+                                           TimePoint now) {
+  if (now < cancelled->rotate_time) {
+    return;
+  }
+  num_cancelled_ -= cancelled->previous.size();
+  cancelled->previous.swap(cancelled->current);
+  cancelled->current.clear();
+  cancelled->rotate_time = now + std::chrono::milliseconds(
+      FLAGS_cancel_retain_ms);
+}
+
 void BackendServer::UpdateModelTableAsync(const ModelTableConfig& request) {
   auto cfg = std::make_shared<ModelTableConfig>();
   cfg->CopyFrom(request);
@@ -204,18 +358,24 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
     }
   }
 
-  // Start to update model table
-  std::lock_guard<std::mutex> lock(model_table_mu_);
+  // Start to update model table on a copy of the current snapshot
+  std::unique_lock<std::mutex> lock(model_table_mu_);
+  ++table_version_;
+  latest_table_.CopyFrom(request);
+  latest_sessions_ = all_sessions;
+  auto snapshot = std::make_shared<ModelTableSnapshot>();
+  snapshot->models = model_table_.Load()->models;
+  ModelTable& model_table = snapshot->models;
   // Remove unused model instances
   std::vector<std::string> to_remove;
-  for (auto iter : model_table_) {
+  for (auto iter : model_table) {
     if (all_sessions.count(iter.first) == 0) {
       to_remove.push_back(iter.first);
     }
   }
   for (auto session_id : to_remove) {
-    auto model = model_table_.at(session_id);
-    model_table_.erase(session_id);
+    auto model = model_table.at(session_id);
+    model_table.erase(session_id);
     if (model->IsTFShareModel()) {
       auto tf_model = dynamic_cast<TFShareModel*>(model->model());
       LOG(INFO) << "Remove model session " << session_id << " from TFShare model " << tf_model->model_session_id();
@@ -240,6 +400,7 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
     } else {
       LOG(INFO) << "Remove model instance " << session_id;
       gpu_executor_->RemoveModel(model);
+      ParkModel(session_id, model);
     }
   }
   
@@ -262,8 +423,8 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
         std::shared_ptr<ModelExecutor> sp_model = nullptr;
         for (const auto &model_sess : config.model_session()) {
           auto session_id = ModelSessionToString(model_sess);
-          auto iter = model_table_.find(session_id);
-          if (iter != model_table_.end()) {
+          auto iter = model_table.find(session_id);
+          if (iter != model_table.end()) {
             auto model = iter->second;
             CHECK(model->IsTFShareModel());
             sp_model = model;
@@ -273,12 +434,7 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
         if (sp_model == nullptr) {
           // Create a new prefix model
           LOG(INFO) << "Load TFShareModel instance [" << str_model_sessions << "] batch=" << config.batch();
-          auto model = std::make_shared<ModelExecutor>(gpu_id_, config, task_queue_);
-          gpu_executor_->AddModel(model);
-          for (const auto& model_sess : config.model_session()) {
-            std::string session_id = ModelSessionToString(model_sess);
-            model_table_.emplace(session_id, model);
-          }
+          LoadModelAsync(config);
         } else {
           // Prefix model already exists
           auto *tf_model = dynamic_cast<TFShareModel*>(sp_model->model());
@@ -292,7 +448,7 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
             auto session_id = ModelSessionToString(model_sess);
             auto not_exist = tf_model->AddModelSession(model_sess);
             if (not_exist)
-              model_table_.emplace(session_id, sp_model);
+              model_table.emplace(session_id, sp_model);
           }
           sp_model->UpdateBackupBackends(config);
         }
@@ -301,8 +457,8 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
         std::shared_ptr<ModelExecutor> sp_model = nullptr;
         for (auto model_sess : config.model_session()) {
           std::string session_id = ModelSessionToString(model_sess);
-          auto iter = model_table_.find(session_id);
-          if (iter != model_table_.end()) {
+          auto iter = model_table.find(session_id);
+          if (iter != model_table.end()) {
             auto model = iter->second;
             if (model->IsSharePrefixModel()) {
               sp_model = model;
@@ -310,7 +466,7 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
             } else {
               // Remove its original model
               gpu_executor_->RemoveModel(model);
-              model_table_.erase(session_id);
+              model_table.erase(session_id);
             }
           }
         }
@@ -319,13 +475,7 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
           LOG(INFO) << "Load prefix model instance " <<
                     ModelSessionToString(config.model_session(0)) << ", batch: " <<
                     config.batch() << ", backup: " << config.backup();
-          auto model = std::make_shared<ModelExecutor>(gpu_id_, config,
-                                                       task_queue_);
-          gpu_executor_->AddModel(model);
-          for (auto model_sess : config.model_session()) {
-            std::string session_id = ModelSessionToString(model_sess);
-            model_table_.emplace(session_id, model);
-          }
+          LoadModelAsync(config);
         } else {
           // Prefix model already exists
           // Need to update batch size, and add new model sessions sharing prefix
@@ -342,7 +492,7 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
               LOG(INFO) << "Add model session " << session_id <<
                         " to prefix model " << sp_internal->model_session_id();
               sp_internal->AddModelSession(model_sess);
-              model_table_.emplace(session_id, sp_model);
+              model_table.emplace(session_id, sp_model);
             }
           }
           sp_model->UpdateBackupBackends(config);
@@ -352,15 +502,22 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
       // Regular model session
       auto model_sess = config.model_session(0);
       std::string session_id = ModelSessionToString(model_sess);
-      auto model_iter = model_table_.find(session_id);
-      if (model_iter == model_table_.end()) {
-        // Load new model instance
-        auto model = std::make_shared<ModelExecutor>(gpu_id_, config,
-                                                     task_queue_);
-        model_table_.emplace(session_id, model);
-        gpu_executor_->AddModel(model);
-        LOG(INFO) << "Load model instance " << session_id <<
-            ", batch: " << config.batch() << ", backup: " << config.backup();
+      auto model_iter = model_table.find(session_id);
+      if (model_iter == model_table.end()) {
+        auto model = UnparkModel(config);
+        if (model != nullptr) {
+          LOG(INFO) << "Resume parked model instance " << session_id <<
+              ", batch: " << config.batch() << ", backup: " << config.backup();
+          model->SetBatch(config.batch());
+          model->UpdateBackupBackends(config);
+          model_table.emplace(session_id, model);
+          gpu_executor_->AddModel(model);
+        } else {
+          // Load new model instance
+          LOG(INFO) << "Load model instance " << session_id <<
+              ", batch: " << config.batch() << ", backup: " << config.backup();
+          LoadModelAsync(config);
+        }
       } else {
         auto model = model_iter->second;
         if (model->model()->batch() != config.batch()) {
@@ -374,27 +531,247 @@ void BackendServer::UpdateModelTable(const ModelTableConfig& request) {
     }
   }
   
+  // Build the handle index and publish the snapshot
+  for (auto const& config : request.model_instance_config()) {
+    IndexModelSessions(config, snapshot.get());
+  }
+  model_table_.Store(std::move(snapshot));
+  lock.unlock();
+
   // Update duty cycle
   gpu_executor_->SetDutyCycle(request.duty_cycle_us());
   LOG(INFO) << "Duty cycle: " << request.duty_cycle_us() << " us";
+  MarkModelsReadyDirty();
 #else
   LOG(FATAL) << "backend needs the USE_GPU flag set at compile-time.";
 #endif
 }
 
+void BackendServer::LoadModelAsync(const ModelInstanceConfig& config) {
+  for (auto const& model_sess : config.model_session()) {
+    if (loading_sessions_.count(ModelSessionToString(model_sess)) > 0) {
+      // Changes to the config are applied once the instance is loaded
+      return;
+    }
+  }
+  for (auto const& model_sess : config.model_session()) {
+    loading_sessions_.insert(ModelSessionToString(model_sess));
+  }
+  ReleaseStandbyMemory(config.memory_usage());
+  auto job = std::make_shared<ModelLoadJob>();
+  job->config.CopyFrom(config);
+  job->table_version = table_version_;
+  model_load_jobs_.push(std::move(job));
+}
+
+void BackendServer::LoadModel(const ModelLoadJob& job) {
+#ifdef USE_GPU
+  auto const& config = job.config;
+  auto beg = Clock::now();
+  auto model = std::make_shared<ModelExecutor>(gpu_id_, config,
+                                               postprocess_queue_);
+  if (FLAGS_model_warmup) {
+    model->WarmUp();
+  }
+  LOG(INFO) << "Model instance " << model->model()->model_session_id() <<
+      " is ready in " << std::chrono::duration_cast<std::chrono::milliseconds>(
+          Clock::now() - beg).count() << " ms";
+  ModelTableConfig latest_table;
+  {
+    std::lock_guard<std::mutex> lock(model_table_mu_);
+    bool requested = false;
+    for (auto const& model_sess : config.model_session()) {
+      auto session_id = ModelSessionToString(model_sess);
+      loading_sessions_.erase(session_id);
+      requested |= latest_sessions_.count(session_id) > 0;
+    }
+    if (!requested) {
+      LOG(INFO) << "Discard model instance " <<
+          model->model()->model_session_id() << " unloaded while loading";
+      return;
+    }
+    auto snapshot = std::make_shared<ModelTableSnapshot>(
+        *model_table_.Load());
+    for (auto const& model_sess : config.model_session()) {
+      snapshot->models.emplace(ModelSessionToString(model_sess), model);
+    }
+    IndexModelSessions(config, snapshot.get());
+    gpu_executor_->AddModel(model);
+    model_table_.Store(std::move(snapshot));
+    if (job.table_version != table_version_) {
+      latest_table.CopyFrom(latest_table_);
+    }
+  }
+  if (latest_table.model_instance_config_size() > 0) {
+    // Apply the model table requested while loading, e.g., a new batch size
+    UpdateModelTableAsync(latest_table);
+  }
+  MarkModelsReadyDirty();
+#else
+  LOG(FATAL) << "backend needs the USE_GPU flag set at compile-time.";
+#endif
+}
+
+void BackendServer::IndexModelSessions(const ModelInstanceConfig& config,
+                                       ModelTableSnapshot* snapshot) {
+  auto& handles = snapshot->handles;
+  for (int i = 0; i < config.model_session_handle_size() &&
+           i < config.model_session_size(); ++i) {
+    uint32_t handle = config.model_session_handle(i);
+    auto const& model_sess = config.model_session(i);
+    auto iter = snapshot->models.find(ModelSessionToString(model_sess));
+    if (handle == 0 || iter == snapshot->models.end()) {
+      continue;
+    }
+    if (handle >= handles.size()) {
+      handles.resize(handle + 1, ModelSessionEntry{"", 0, nullptr});
+    }
+    handles[handle] = ModelSessionEntry{
+      iter->first, model_sess.latency_sla(), iter->second};
+  }
+}
+
+void BackendServer::ParkModel(const std::string& model_session_id,
+                              ModelExecutorPtr model) {
+  uint64_t budget = FLAGS_standby_memory_mb * 1024 * 1024;
+  if (model->memory_usage() > budget) {
+    return;
+  }
+  standby_models_.push_front(StandbyModel{model_session_id, model});
+  standby_memory_ += model->memory_usage();
+  while (standby_memory_ > budget) {
+    auto const& victim = standby_models_.back();
+    LOG(INFO) << "Evict parked model instance " << victim.model_session_id;
+    standby_memory_ -= victim.model->memory_usage();
+    standby_models_.pop_back();
+  }
+}
+
+ModelExecutorPtr BackendServer::UnparkModel(const ModelInstanceConfig& config) {
+  auto session_id = ModelSessionToString(config.model_session(0));
+  for (auto iter = standby_models_.begin(); iter != standby_models_.end();
+       ++iter) {
+    if (iter->model_session_id != session_id) {
+      continue;
+    }
+    auto model = iter->model;
+    standby_memory_ -= model->memory_usage();
+    standby_models_.erase(iter);
+    if (model->backup() != config.backup() ||
+        model->model()->max_batch() != config.max_batch()) {
+      // Instance was built for another role or latency budget
+      return nullptr;
+    }
+    return model;
+  }
+  return nullptr;
+}
+
+void BackendServer::ReleaseStandbyMemory(uint64_t memory_usage) {
+  // Parked instances only borrow the memory that scheduler deems free
+  uint64_t released = 0;
+  while (released < memory_usage && !standby_models_.empty()) {
+    auto const& victim = standby_models_.back();
+    LOG(INFO) << "Evict parked model instance " << victim.model_session_id;
+    released += victim.model->memory_usage();
+    standby_memory_ -= victim.model->memory_usage();
+    standby_models_.pop_back();
+  }
+}
+
+void BackendServer::MarkModelsReadyDirty() {
+  {
+    std::lock_guard<std::mutex> lock(ready_mu_);
+    ready_dirty_ = true;
+  }
+  ready_cv_.notify_all();
+}
+
+bool BackendServer::ReportModelsReady() {
+  ModelsReadyRequest request;
+  request.set_node_id(node_id_);
+  auto snapshot = model_table_.Load();
+  for (auto const& iter : snapshot->models) {
+    request.add_model_session_id(iter.first);
+  }
+  {
+    std::lock_guard<std::mutex> table_lock(model_table_mu_);
+    for (auto const& standby : standby_models_) {
+      request.add_parked_session_id(standby.model_session_id);
+    }
+  }
+  grpc::ClientContext context;
+  // A slow scheduler must not hold up the beacons
+  context.set_deadline(std::chrono::system_clock::now() +
+                       std::chrono::seconds(beacon_interval_sec_));
+  RpcReply reply;
+  grpc::Status status = sch_stub_->ModelsReady(&context, request, &reply);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to connect to scheduler: " <<
+        status.error_message() << "(" << status.error_code() << ")";
+    return false;
+  }
+  if (reply.status() != CTRL_OK) {
+    LOG(ERROR) << "ModelsReady error: " << CtrlStatus_Name(reply.status());
+    return false;
+  }
+  return true;
+}
+
 ModelExecutorPtr BackendServer::GetModel(const std::string& model_session_id) {
-  std::lock_guard<std::mutex> lock(model_table_mu_);
-  auto itr = model_table_.find(model_session_id);
-  if (itr == model_table_.end()) {
+  auto snapshot = model_table_.Load();
+  auto itr = snapshot->models.find(model_session_id);
+  if (itr == snapshot->models.end()) {
     LOG(WARNING) << "Model session is not loaded: " << model_session_id;
     return nullptr;
   }
   return itr->second;
 }
 
+ModelExecutorPtr BackendServer::FindModel(const std::string& model_session_id,
+                                          uint32_t handle) {
+  auto snapshot = model_table_.Load();
+  if (handle > 0 && handle < snapshot->handles.size() &&
+      snapshot->handles[handle].model_session_id == model_session_id) {
+    return snapshot->handles[handle].model;
+  }
+  auto itr = snapshot->models.find(model_session_id);
+  if (itr == snapshot->models.end()) {
+    return nullptr;
+  }
+  return itr->second;
+}
+
+void BackendServer::ResolveModelSession(Task* task) {
+  uint32_t handle = task->query->model_session_handle();
+  if (handle == 0) {
+    return;
+  }
+  uint32_t latency_sla = 0;
+  auto snapshot = model_table_.Load();
+  if (handle < snapshot->handles.size() &&
+      snapshot->handles[handle].model != nullptr) {
+    auto const& entry = snapshot->handles[handle];
+    task->model = entry.model;
+    task->query->set_model_session_id(entry.model_session_id);
+    latency_sla = entry.latency_sla;
+  }
+  // Unknown handles are replied with MODEL_SESSION_NOT_LOADED right away
+  task->InitDeadline(latency_sla);
+}
+
+std::shared_ptr<Task> BackendServer::AcquireChainTask(
+    std::shared_ptr<Connection> conn) {
+  std::lock_guard<std::mutex> lock(chain_task_mu_);
+  return chain_task_pool_.Acquire(std::move(conn));
+}
+
+void BackendServer::EnqueueTask(std::shared_ptr<Task> task) {
+  task_queue_.push(std::move(task));
+}
+
 BackendServer::ModelTable BackendServer::GetModelTable() {
-  std::lock_guard<std::mutex> lock(model_table_mu_);
-  return model_table_;
+  return model_table_.Load()->models;
 }
 
 std::shared_ptr<BackupClient> BackendServer::GetBackupClient(
@@ -407,23 +784,42 @@ std::shared_ptr<BackupClient> BackendServer::GetBackupClient(
 }
 
 void BackendServer::Daemon() {
+  TimePoint next_beacon = Clock::now();
+  // Whether the last ready report failed, which is retried at next beacon
+  bool report_failed = false;
   while (running_) {
-    auto next_time = Clock::now() + std::chrono::seconds(beacon_interval_sec_);
-    KeepAlive();
-    ModelTable model_table;
-    {
-      std::lock_guard<std::mutex> lock(model_table_mu_);
-      model_table = model_table_;
+    if (Clock::now() >= next_beacon) {
+      next_beacon = Clock::now() + std::chrono::seconds(beacon_interval_sec_);
+      KeepAlive();
+      report_failed = false;
+      auto snapshot = model_table_.Load();
+      for (auto const& iter : snapshot->models) {
+        double rps = iter.second->GetRequestRate();
+        double drop_rate = iter.second->GetDropRate();
+        if (rps > 0.1) {
+          LOG(INFO) << iter.first << " request rate: " << rps <<
+              ", drop rate: " << drop_rate;
+        }
+      }
     }
-    for (auto iter : model_table) {
-      double rps = iter.second->GetRequestRate();
-      double drop_rate = iter.second->GetDropRate();
-      if (rps > 0.1) {
-        LOG(INFO) << iter.first << " request rate: " << rps <<
-            ", drop rate: " << drop_rate;
+    bool report = false;
+    {
+      std::lock_guard<std::mutex> lock(ready_mu_);
+      if (ready_dirty_ && !report_failed) {
+        ready_dirty_ = false;
+        report = true;
       }
     }
-    std::this_thread::sleep_until(next_time);
+    // Otherwise the scheduler keeps loaded models out of their routes
+    if (report && !ReportModelsReady()) {
+      std::lock_guard<std::mutex> lock(ready_mu_);
+      ready_dirty_ = true;
+      report_failed = true;
+    }
+    std::unique_lock<std::mutex> lock(ready_mu_);
+    ready_cv_.wait_until(lock, next_beacon, [this, report_failed]() {
+        return !running_ || (ready_dirty_ && !report_failed);
+      });
   }
 }
 
@@ -438,6 +834,39 @@ void BackendServer::ModelTableDaemon() {
   }
 }
 
+void BackendServer::ModelLoaderDaemon() {
+  auto timeout = std::chrono::milliseconds(500);
+  while (running_) {
+    auto job = model_load_jobs_.pop(timeout);
+    if (job == nullptr) {
+      continue;
+    }
+    LoadModel(*job);
+  }
+}
+
+void BackendServer::WorkerScaleDaemon() {
+  auto interval = std::chrono::milliseconds(FLAGS_worker_scale_interval_ms);
+  while (running_) {
+    std::this_thread::sleep_for(interval);
+    preprocess_pool_->Scale();
+    postprocess_pool_->Scale();
+  }
+}
+
+void BackendServer::UtilizationDaemon() {
+  auto interval = std::chrono::milliseconds(FLAGS_occupancy_valid);
+  while (running_) {
+    auto next_time = Clock::now() + interval;
+#ifdef USE_GPU
+    utilization_ = gpu_executor_->CurrentUtilization();
+#endif
+    // Only backups that were asked for while stale are queried
+    backend_pool_.RefreshUtilization(interval);
+    std::this_thread::sleep_until(next_time);
+  }
+}
+
 void BackendServer::Register() {
 #ifdef USE_GPU
   // Init node id
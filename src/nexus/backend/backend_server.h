@@ -2,11 +2,14 @@
 #define NEXUS_BACKEND_BACKEND_SERVER_H_
 
 #include <atomic>
+#include <condition_variable>
+#include <list>
 #include <memory>
 #include <random>
 #include <set>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <yaml-cpp/yaml.h>
 
@@ -20,6 +23,7 @@
 #include "nexus/common/block_queue.h"
 #include "nexus/common/model_def.h"
 #include "nexus/common/server_base.h"
+#include "nexus/common/snapshot_ptr.h"
 #include "nexus/common/spinlock.h"
 #include "nexus/proto/control.grpc.pb.h"
 
@@ -33,6 +37,35 @@ namespace backend {
 class BackendServer : public ServerBase, public MessageHandler {
  public:
   using ModelTable = std::unordered_map<std::string, ModelExecutorPtr>;
+  /*! \brief Model session loaded in the backend, indexed by its handle */
+  struct ModelSessionEntry {
+    std::string model_session_id;
+    /*! \brief Latency SLA in ms */
+    uint32_t latency_sla;
+    /*! \brief Model instance, nullptr if the handle is not loaded */
+    ModelExecutorPtr model;
+  };
+  /*! \brief Model instance to load in the background */
+  struct ModelLoadJob {
+    ModelInstanceConfig config;
+    /*! \brief Version of the model table that requested the load */
+    uint64_t table_version;
+  };
+  /*! \brief Model instance kept in the standby pool without executor slot */
+  struct StandbyModel {
+    std::string model_session_id;
+    ModelExecutorPtr model;
+  };
+  /*!
+   * \brief Immutable snapshot of the model table. Updates publish a new
+   *   snapshot, so lookups never wait for model loading.
+   */
+  struct ModelTableSnapshot {
+    /*! \brief Mapping from model session ID to model instance */
+    ModelTable models;
+    /*! \brief Model sessions indexed by handle */
+    std::vector<ModelSessionEntry> handles;
+  };
   
   /*!
    * \brief Constructs a backend server
@@ -85,6 +118,43 @@ class BackendServer : public ServerBase, public MessageHandler {
    * \return Model instance pointer
    */
   ModelExecutorPtr GetModel(const std::string& model_session_id);
+  /*!
+   * \brief Looks up the model instance like GetModel, but by handle when one
+   *   is given and without logging a miss, which is expected on hot paths
+   * \param model_session_id Model session ID
+   * \param handle Model session handle, 0 if unknown
+   * \return Model instance pointer, nullptr if not loaded
+   */
+  ModelExecutorPtr FindModel(const std::string& model_session_id,
+                             uint32_t handle = 0);
+  /*!
+   * \brief Resolves the model session handle of a task query, which sets the
+   *   model instance, the model session id and the deadline of the task.
+   *   Does nothing to queries without a handle.
+   * \param task Task just decoded
+   */
+  void ResolveModelSession(Task* task);
+  /*!
+   * \brief Gets a reusable task for a chained stage. Thread-safe, unlike
+   *   the task pool of the IO thread.
+   * \param conn Connection to frontend server
+   * \return Task pointer
+   */
+  std::shared_ptr<Task> AcquireChainTask(std::shared_ptr<Connection> conn);
+  /*!
+   * \brief Queues a task for preprocessing.
+   * \param task Task to preprocess
+   */
+  void EnqueueTask(std::shared_ptr<Task> task);
+  /*!
+   * \brief Takes the cancellation of a query that a frontend cancelled before
+   *   its task got preprocessed.
+   * \param conn Connection to frontend server
+   * \param query_id Query id of the task
+   * \return Whether the query is cancelled
+   */
+  bool TakeCancelledQuery(const std::shared_ptr<Connection>& conn,
+                          uint64_t query_id);
   /*!
    * \brief Gets all model instances loaded in the backend server
    * \return All model instances
@@ -98,17 +168,101 @@ class BackendServer : public ServerBase, public MessageHandler {
   std::shared_ptr<BackupClient> GetBackupClient(uint32_t backend_id);
 
 #ifdef USE_GPU
-  /*! \brief Returns the current server utilization. */
-  inline double CurrentUtilization() const {
-    return gpu_executor_->CurrentUtilization();
+  /*!
+   * \brief Returns the server utilization, published periodically by the
+   * utilization daemon.
+   */
+  inline double CurrentUtilization() const { return utilization_.load(); }
+  /*! \brief Returns the duty cycle of the GPU executor in us. */
+  inline double duty_cycle_us() const {
+    return gpu_executor_->duty_cycle_us();
   }
 #endif
 
  private:
+  /*!
+   * \brief Query ids cancelled by a frontend. Ids not taken by a worker
+   *   within two generations belong to tasks that were already preprocessed.
+   */
+  struct CancelledQueries {
+    std::unordered_set<uint64_t> current;
+    std::unordered_set<uint64_t> previous;
+    TimePoint rotate_time;
+  };
+  /*!
+   * \brief Records queries cancelled by a frontend, so that workers drop their
+   *   tasks still waiting for preprocessing.
+   * \param conn Connection to frontend server
+   * \param query_ids Cancelled query ids
+   */
+  void AddCancelledQueries(const std::shared_ptr<Connection>& conn,
+                           const std::unordered_set<uint64_t>& query_ids);
+  /*!
+   * \brief Starts a new generation of cancelled queries if the current one is
+   *   old enough. Must hold cancel_mu_.
+   */
+  void RotateCancelledQueries(CancelledQueries* cancelled, TimePoint now);
   /*! \brief Daemon thread that sends stats to scheduler periodically. */
   void Daemon();
 
   void ModelTableDaemon();
+  /*! \brief Loader thread that loads model instances in the background. */
+  void ModelLoaderDaemon();
+  /*!
+   * \brief Queues loading a new model instance, unless one of its model
+   *   sessions is already loading. Must hold model_table_mu_.
+   * \param config Model instance configuration
+   */
+  void LoadModelAsync(const ModelInstanceConfig& config);
+  /*!
+   * \brief Creates and warms up a model instance, then publishes it in the
+   *   model table and reports it ready to the scheduler.
+   * \param job Load job
+   */
+  void LoadModel(const ModelLoadJob& job);
+  /*!
+   * \brief Marks the ready model sessions as changed, to be reported by the
+   *   daemon thread. Never blocks on the scheduler.
+   */
+  void MarkModelsReadyDirty();
+  /*!
+   * \brief Reports all model sessions in the model table and the standby
+   *   pool to the scheduler. Only called by the daemon thread.
+   * \return Whether the scheduler accepted the report
+   */
+  bool ReportModelsReady();
+  /*!
+   * \brief Parks a model instance removed from the model table in the
+   *   standby pool, evicting the least recently parked instances beyond the
+   *   memory budget. Must hold model_table_mu_.
+   */
+  void ParkModel(const std::string& model_session_id, ModelExecutorPtr model);
+  /*!
+   * \brief Takes a parked model instance that matches config out of the
+   *   standby pool. Must hold model_table_mu_.
+   * \return Model instance, or nullptr if none is parked
+   */
+  ModelExecutorPtr UnparkModel(const ModelInstanceConfig& config);
+  /*!
+   * \brief Evicts parked model instances to free at least the memory
+   *   scheduler expects to be available for a new model. Must hold
+   *   model_table_mu_.
+   * \param memory_usage Memory needed in bytes
+   */
+  void ReleaseStandbyMemory(uint64_t memory_usage);
+  /*!
+   * \brief Indexes the model sessions of config that are in the snapshot by
+   *   their handles.
+   */
+  static void IndexModelSessions(const ModelInstanceConfig& config,
+                                 ModelTableSnapshot* snapshot);
+  /*! \brief Daemon thread that scales worker pools periodically. */
+  void WorkerScaleDaemon();
+  /*!
+   * \brief Daemon thread that publishes server utilization and refreshes
+   * stale utilization of backup servers periodically.
+   */
+  void UtilizationDaemon();
   /*! \brief Register this backend server to global scheduler. */
   void Register();
   /*! \brief Unregister this backend server to global scheduler. */
@@ -126,6 +280,8 @@ class BackendServer : public ServerBase, public MessageHandler {
   uint32_t beacon_interval_sec_;
   /*! \brief Flag for whether backend and daemon thread is running */
   std::atomic_bool running_;
+  /*! \brief Server utilization, updated by utilization daemon */
+  std::atomic<double> utilization_;
   /*! \brief Backend node id */
   uint32_t node_id_;
   /*! \brief Backend RPC service */
@@ -136,27 +292,79 @@ class BackendServer : public ServerBase, public MessageHandler {
   std::thread daemon_thread_;
 
   std::thread model_table_thread_;
+  /*! \brief Threads loading model instances */
+  std::vector<std::thread> loader_threads_;
+  /*! \brief Worker pool scaling thread */
+  std::thread worker_scale_thread_;
+  /*! \brief Utilization publishing thread */
+  std::thread utilization_thread_;
   /*! \brief Frontend connection pool. Guraded by frontend_mutex_. */
   std::set<std::shared_ptr<Connection> > frontend_connections_;
   /*! \brief Mutex for frontend_connections_ */
   std::mutex frontend_mutex_;
-  /*! \brief Task queue for workers to work on */
+  /*!
+   * \brief Queries cancelled by each frontend connection. Guarded by
+   *   cancel_mu_.
+   */
+  std::unordered_map<Connection*, CancelledQueries> cancelled_queries_;
+  /*! \brief Number of ids in cancelled_queries_, checked without the lock */
+  std::atomic<int> num_cancelled_;
+  /*! \brief Mutex for cancelled_queries_ */
+  std::mutex cancel_mu_;
+  /*! \brief Pool of reusable tasks, only accessed by the IO thread */
+  TaskPool task_pool_;
+  /*! \brief Pool of reusable tasks for chained stages */
+  TaskPool chain_task_pool_;
+  /*! \brief Mutex for chain_task_pool_ */
+  std::mutex chain_task_mu_;
+  /*! \brief Queue of tasks to preprocess */
   BlockPriorityQueue<Task> task_queue_;
-  /*! \brief Worker thread pool */
-  std::vector<std::unique_ptr<Worker> > workers_;
+  /*! \brief Queue of tasks to postprocess, filled by model executors */
+  BlockPriorityQueue<Task> postprocess_queue_;
+  /*! \brief Workers that preprocess tasks */
+  std::unique_ptr<WorkerPool> preprocess_pool_;
+  /*! \brief Workers that postprocess tasks */
+  std::unique_ptr<WorkerPool> postprocess_pool_;
 #ifdef USE_GPU
   /*! \brief GPU executor */
   std::unique_ptr<GpuExecutor> gpu_executor_;
 #endif
   /*!
-   * \brief Mapping from model session ID to model instance.
-   * Guarded by model_table_mu_.p
+   * \brief Current model table snapshot, read without locks. Executors
+   *   removed from the table are released when the last reader drops its
+   *   snapshot.
    */
-  ModelTable model_table_;
+  SnapshotPtr<ModelTableSnapshot> model_table_;
 
   BlockQueue<ModelTableConfig> model_table_requests_;
-  /*! \brief Mutex for accessing model_table_ */
+  /*! \brief Queue of model instances to load */
+  BlockQueue<ModelLoadJob> model_load_jobs_;
+  /*! \brief Model sessions being loaded. Guarded by model_table_mu_. */
+  std::unordered_set<std::string> loading_sessions_;
+  /*! \brief Latest model table requested. Guarded by model_table_mu_. */
+  ModelTableConfig latest_table_;
+  /*! \brief Model sessions in latest_table_. Guarded by model_table_mu_. */
+  std::unordered_set<std::string> latest_sessions_;
+  /*! \brief Number of model table requests. Guarded by model_table_mu_. */
+  uint64_t table_version_;
+  /*!
+   * \brief Parked model instances, most recently parked first.
+   * Guarded by model_table_mu_.
+   */
+  std::list<StandbyModel> standby_models_;
+  /*! \brief Memory used by parked models. Guarded by model_table_mu_. */
+  uint64_t standby_memory_;
+  /*! \brief Mutex serializing model table updates, readers don't take it */
   std::mutex model_table_mu_;
+  /*!
+   * \brief Whether ready model sessions changed since the last successful
+   *   report. Guarded by ready_mu_.
+   */
+  bool ready_dirty_;
+  /*! \brief Mutex for ready_dirty_ */
+  std::mutex ready_mu_;
+  /*! \brief Wakes up the daemon thread to report ready model sessions */
+  std::condition_variable ready_cv_;
   /*! \brief Backend pool for backup servers. */
   BackendPool backend_pool_;
   /*! \brief Random number genertor */
@@ -1,48 +1,109 @@
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include "nexus/backend/backup_client.h"
 
+DEFINE_int32(relay_slots, 4096, "Max number of pending relayed requests to "
+             "each backup backend");
+
 namespace nexus {
 namespace backend {
 
 BackupClient::BackupClient(const BackendInfo& info,
                            boost::asio::io_service& io_context,
                            MessageHandler* handler) :
-    BackendSession(info, io_context, handler) {}
-
-void BackupClient::Forward(std::shared_ptr<Task> task) {
-  uint64_t qid = task->query.query_id();
-  task->query.set_query_id(task->task_id);
-  auto msg = std::make_shared<Message>(kBackendRelay,
-                                       task->query.ByteSizeLong());
-  msg->EncodeBody(task->query);
-  Write(std::move(msg));
-  std::lock_guard<std::mutex> lock(relay_mu_);
-  qid_lookup_.emplace(task->task_id, qid);
-  conns_.emplace(task->task_id, task->connection);
+    BackendSession(info, io_context, handler),
+    slots_(FLAGS_relay_slots),
+    next_relay_id_(1) {}
+
+void BackupClient::Stop() {
+  BackendSession::Stop();
+  // Replies of pending relays can no longer arrive on this connection
+  for (auto& slot : slots_) {
+    uint64_t relay_id = slot.relay_id.load(std::memory_order_acquire);
+    if (relay_id != kFreeSlot && relay_id != kClaimedSlot &&
+        TakeSlot(&slot, relay_id)) {
+      slot.conn.reset();
+      slot.relay_id.store(kFreeSlot, std::memory_order_release);
+    }
+  }
+}
+
+bool BackupClient::ClaimSlot(RelaySlot* slot, int64_t now) {
+  uint64_t expected = kFreeSlot;
+  if (slot->relay_id.compare_exchange_strong(expected, kClaimedSlot)) {
+    return true;
+  }
+  if (expected == kClaimedSlot ||
+      slot->deadline.load(std::memory_order_relaxed) >= now) {
+    return false;
+  }
+  // The backup dropped or timed out the relay, so reclaim its slot
+  if (!TakeSlot(slot, expected)) {
+    return false;
+  }
+  VLOG(1) << "Reclaim expired relayed request " << expected;
+  slot->conn.reset();
+  return true;
+}
+
+bool BackupClient::TakeSlot(RelaySlot* slot, uint64_t relay_id) {
+  return slot->relay_id.compare_exchange_strong(relay_id, kClaimedSlot);
+}
+
+bool BackupClient::Forward(std::shared_ptr<Task> task) {
+  int64_t now = Clock::now().time_since_epoch().count();
+  // Probe a few slots in case earlier relays are still pending
+  const int kMaxProbes = 8;
+  for (int i = 0; i < kMaxProbes; ++i) {
+    uint64_t relay_id = next_relay_id_.fetch_add(1, std::memory_order_relaxed);
+    if (relay_id == kFreeSlot || relay_id == kClaimedSlot) {
+      continue;
+    }
+    auto& slot = slots_[relay_id % slots_.size()];
+    if (!ClaimSlot(&slot, now)) {
+      continue;
+    }
+    slot.conn = std::move(task->connection);
+    slot.deadline.store(task->deadline().time_since_epoch().count(),
+                        std::memory_order_relaxed);
+    slot.relay_id.store(relay_id, std::memory_order_release);
+    RelayHeader header;
+    header.relay_id = relay_id;
+    header.utilization = 0.;
+    header.valid_ms = 0;
+    std::shared_ptr<Message> msg;
+    if (task->message != nullptr) {
+      msg = std::move(task->message);
+      msg->PushRelayHeader(kBackendRelay, header);
+    } else {
+      // Query came in a request batch, so it has to be encoded on its own
+      msg = std::make_shared<Message>(
+          kBackendRelay, RELAY_HEADER_SIZE + task->query->ByteSizeLong());
+      msg->EncodeRelayHeader(header);
+      msg->EncodeBody(*task->query, RELAY_HEADER_SIZE);
+    }
+    Write(std::move(msg));
+    task->ReleaseResources();
+    return true;
+  }
+  return false;
 }
 
 void BackupClient::Reply(std::shared_ptr<Message> message) {
-  QueryResultProto result;
-  message->DecodeBody(&result);
-  uint64_t tid = result.query_id();
-  std::lock_guard<std::mutex> lock(relay_mu_);
-  auto qid_iter = qid_lookup_.find(tid);
-  if (qid_iter == qid_lookup_.end()) {
-    LOG(ERROR) << "Cannot find query ID for task " << tid;
+  RelayHeader header;
+  message->PopRelayHeader(kBackendReply, &header);
+  UpdateUtilization(header.utilization, header.valid_ms);
+  auto& slot = slots_[header.relay_id % slots_.size()];
+  if (!TakeSlot(&slot, header.relay_id)) {
+    // Either unknown or reclaimed after its deadline passed
+    LOG(ERROR) << "Cannot find relayed request " << header.relay_id;
     return;
   }
-  uint64_t qid = qid_iter->second;
-  result.set_query_id(qid);
-  // LOG(INFO) << "Convert " << result.model_session_id() << " tid " << tid <<
-  //     " to qid " << qid;
-  auto reply_msg = std::make_shared<Message>(kBackendReply,
-                                             result.ByteSizeLong());
-  reply_msg->EncodeBody(result);
-  auto conn_iter = conns_.find(tid);
-  conn_iter->second->Write(std::move(reply_msg));
-  qid_lookup_.erase(qid_iter);
-  conns_.erase(conn_iter);
+  auto conn = std::move(slot.conn);
+  slot.relay_id.store(kFreeSlot, std::memory_order_release);
+  // The reply carries the query id of the original request
+  conn->Write(std::move(message));
 }
 
 } // namespace backend
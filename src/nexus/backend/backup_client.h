@@ -15,17 +15,54 @@ class BackupClient : public BackendSession {
   explicit BackupClient(const BackendInfo& info,
                         boost::asio::io_service& io_context,
                         MessageHandler* handler);
-
-  void Forward(std::shared_ptr<Task> task);
-
+  /*!
+   * \brief Relays the request message of task to the backup backend. The
+   *   message is forwarded as is behind a relay header.
+   * \param task Task to relay
+   * \return false if too many relayed requests are pending
+   */
+  bool Forward(std::shared_ptr<Task> task);
+  /*!
+   * \brief Forwards a relay reply to the frontend of the relayed request.
+   * \param message Relay reply message
+   */
   void Reply(std::shared_ptr<Message> message);
+  /*! \brief Stops the connection and frees all pending relay slots. */
+  void Stop() override;
 
  private:
-  /*! \brief Map from task id to frontend connection. Guarded by relay_mu_. */
-  std::unordered_map<uint64_t, std::shared_ptr<Connection> > conns_;
-  /*! \brief Map from task id to query id. Guarded by relay_mu_. */
-  std::unordered_map<uint64_t, uint64_t> qid_lookup_;
-  std::mutex relay_mu_;
+  /*! \brief Pending relayed request */
+  struct RelaySlot {
+    RelaySlot() : relay_id(kFreeSlot), deadline(0) {}
+    /*!
+     * \brief Relay id of the pending request, kFreeSlot if the slot is free.
+     * The owner of a slot publishes conn and deadline before setting
+     * relay_id, and takes the slot by swapping relay_id to kClaimedSlot.
+     */
+    std::atomic<uint64_t> relay_id;
+    /*! \brief Deadline of the relayed task in clock ticks */
+    std::atomic<int64_t> deadline;
+    /*! \brief Connection to the frontend */
+    std::shared_ptr<Connection> conn;
+  };
+  /*!
+   * \brief Claims the slot for a new relay if it is free or its pending relay
+   *   is past the deadline.
+   */
+  bool ClaimSlot(RelaySlot* slot, int64_t now);
+  /*!
+   * \brief Takes the slot from its pending relay.
+   * \return false if the slot no longer holds relay_id
+   */
+  bool TakeSlot(RelaySlot* slot, uint64_t relay_id);
+
+  static const uint64_t kFreeSlot = 0;
+  static const uint64_t kClaimedSlot = ~0ULL;
+
+  /*! \brief Slot table indexed by relay id modulo its size */
+  std::vector<RelaySlot> slots_;
+  /*! \brief Next relay id to assign */
+  std::atomic<uint64_t> next_relay_id_;
 };
 
 } // namespace backend
@@ -11,7 +11,6 @@
 #include "nexus/common/util.h"
 // Caffe headers
 #include "caffe/layers/slice_layer.hpp"
-#include "caffe/util/nms.hpp"
 
 namespace nexus {
 namespace backend {
@@ -33,8 +32,12 @@ CaffeDenseCapModel::CaffeDenseCapModel(int gpu_id,
   // load config
   max_boxes_ = model_info_["max_boxes"].as<int>();
   max_timestep_ = model_info_["max_timestep"].as<int>();
-  nms_threshold_ = model_info_["nms_threshold"].as<float>();
-  score_threshold_ = model_info_["score_threshold"].as<float>();
+  // densecap predicts a single class, so NMS is always class agnostic
+  detection_config_ = DetectionConfig(
+      model_info_["score_threshold"].as<float>(),
+      model_info_["nms_threshold"].as<float>());
+  detection_config_.Load(model_info_);
+  detection_config_.class_agnostic = true;
   for (uint i = 0; i < model_info_["mean_value"].size(); ++i) {
     mean_values_.push_back(model_info_["mean_value"][i].as<float>());
   }
@@ -44,6 +47,8 @@ CaffeDenseCapModel::CaffeDenseCapModel(int gpu_id,
   for (uint i = 0; i < model_info_["bbox_stds"].size(); ++i) {
     bbox_stds_.push_back(model_info_["bbox_stds"][i].as<float>());
   }
+  CHECK_EQ(bbox_mean_.size(), 4) << "bbox_mean must have 4 values";
+  CHECK_EQ(bbox_stds_.size(), 4) << "bbox_stds must have 4 values";
   // init gpu device
   caffe::Caffe::SetDevice(gpu_id);
   caffe::Caffe::set_mode(caffe::Caffe::GPU);
@@ -137,11 +142,11 @@ std::unordered_map<std::string, ArrayPtr> CaffeDenseCapModel::GetOutputGpuArrays
 }
 
 void CaffeDenseCapModel::Preprocess(std::shared_ptr<Task> task) {
-  const auto& query = task->query;
+  const auto& query = *task->query;
   const auto& input_data = query.input();
   if (input_data.data_type() != DT_IMAGE) {
-    task->result.set_status(INPUT_TYPE_INCORRECT);
-    task->result.set_error_message("Input type incorrect: " +
+    task->result->set_status(INPUT_TYPE_INCORRECT);
+    task->result->set_error_message("Input type incorrect: " +
                                    DataType_Name(input_data.data_type()));
     return;
   }
@@ -160,10 +165,10 @@ void CaffeDenseCapModel::Preprocess(std::shared_ptr<Task> task) {
   float scale_h = float(image_height_) / origin_height;
   float scale_w = float(image_width_) / origin_width;
   // set the attributes
-  task->attrs["im_height"] = origin_height;
-  task->attrs["im_width"] = origin_width;
-  task->attrs["scale_h"] = scale_h;
-  task->attrs["scale_w"] = scale_w;
+  task->attrs.im_height = origin_height;
+  task->attrs.im_width = origin_width;
+  task->attrs.scale_h = scale_h;
+  task->attrs.scale_w = scale_w;
   // transpose the image
   const float* im_data = (const float*) resized.data;
   auto in_arr = std::make_shared<Array>(DT_FLOAT, input_size_, cpu_device_);
@@ -200,7 +205,7 @@ void CaffeDenseCapModel::Forward(std::shared_ptr<BatchTask> batch_task) {
   float* im_info = im_info_blob->mutable_cpu_data();
   im_info[0] = image_height_;  // input image height
   im_info[1] = image_width_;  // input image width
-  im_info[2] = batch_task->inputs()[0]->task->attrs["scale_h"].as<float>();
+  im_info[2] = batch_task->inputs()[0]->task->attrs.scale_h;
   
   // set the slice points
   auto split_fc7_layer = dynamic_cast<caffe::SliceLayer<float>*>(
@@ -349,87 +354,51 @@ void CaffeDenseCapModel::Forward(std::shared_ptr<BatchTask> batch_task) {
 }
 
 void CaffeDenseCapModel::Postprocess(std::shared_ptr<Task> task) {
-  const QueryProto& query = task->query;
-  QueryResultProto* result = &task->result;
-  std::vector<std::string> output_fields(query.output_field().begin(),
-                                         query.output_field().end());
-  if (output_fields.size() == 0) {
-    output_fields.push_back("rect");
-    output_fields.push_back("caption");
-  }
+  const QueryProto& query = *task->query;
+  QueryResultProto* result = task->result;
   
   auto& output = task->outputs[0];
   int nboxes = output->arrays.at("rois")->num_elements() / 5;
   float* rois = output->arrays.at("rois")->Data<float>();
-  float* boxes = rois;
   float* bbox_offsets = output->arrays.at("bbox_offsets")->Data<float>();
   float* captions = output->arrays.at("captions")->Data<float>();
   float* scores = output->arrays.at("scores")->Data<float>();
   // get attributes
-  int im_height = task->attrs["im_height"].as<int>();
-  int im_width = task->attrs["im_width"].as<int>();
-  float scale = task->attrs["scale_h"].as<float>();
-  int* order = new int[nboxes];
+  int im_height = task->attrs.im_height;
+  int im_width = task->attrs.im_width;
+  float scale = task->attrs.scale_h;
+  std::vector<float> boxes(nboxes * 4);
+  DecodeDeltaBoxes(rois, bbox_offsets, bbox_mean_.data(), bbox_stds_.data(),
+                   scale, nboxes, im_height, im_width, boxes.data());
+  std::vector<DetectionBox> dets;
+  dets.reserve(nboxes);
   for (int i = 0; i < nboxes; ++i) {
-    order[i] = i;
-    // transform bbox offsets
-    for (int j = 0; j < 4; ++j) {
-      bbox_offsets[i * 4 + j] = bbox_offsets[i * 4 + j] * bbox_stds_[j] +
-                                bbox_mean_[j];
-    }
+    const float* box = &boxes[i * 4];
+    dets.push_back({box[0], box[1], box[2], box[3], scores[i * 2 + 1], 0, i});
   }
-  TransformBbox(im_height, im_width, scale, nboxes, rois, bbox_offsets, boxes);
-  std::sort(order, order + nboxes, [&](int a, int b) {
-      return scores[b * 2 + 1] < scores[a * 2 + 1];
-    });
-  int num_out;
-  int* keep_out = new int[nboxes];
-  caffe::nms_cpu(boxes, order, nboxes, nms_threshold_, keep_out, &num_out);
+  NonMaxSuppression(detection_config_, &dets);
 
-  int total_boxes = 0;
-  for (int i = 0; i < num_out; ++i) {
-    int idx = keep_out[i];
-    if (scores[idx * 2 + 1] <= score_threshold_) {
-      continue;
-    }
-    std::string sentence;
-    for (int step = 0; step < max_timestep_; ++step) {
-      int word = (int) captions[idx * max_timestep_ + step];
-      if (word == 0) {
-        break;
-      }
-      sentence += vocabulary_[word] + " ";
-    }
-    float* box = boxes + idx * 4;
-    // Add caption result
-    auto record = result->add_output();
-    for (auto field : output_fields) {
-      if (field == "rect") {
-        auto value = record->add_named_value();
-        value->set_name("rect");
-        value->set_data_type(DT_RECT);
-        auto rect = value->mutable_rect();
-        rect->set_left(int(round(box[0])));
-        rect->set_top(int(round(box[1])));
-        rect->set_right(int(round(box[2])));
-        rect->set_bottom(int(round(box[3])));
-      } else if (field == "caption") {
-        auto value = record->add_named_value();
+  MarshalDetections(
+      query, dets, {"rect", "caption"}, nullptr,
+      [&](const DetectionBox& box, const std::string& field,
+          ValueProto* value) {
+        if (field != "caption") {
+          return false;
+        }
+        std::string sentence;
+        for (int step = 0; step < max_timestep_; ++step) {
+          int word = (int) captions[box.index * max_timestep_ + step];
+          if (word == 0) {
+            break;
+          }
+          sentence += vocabulary_[word] + " ";
+        }
         value->set_name("caption");
         value->set_data_type(DT_STRING);
         value->set_s(sentence);
-      } else if (field == "score") {
-        auto value = record->add_named_value();
-        value->set_name("score");
-        value->set_data_type(DT_FLOAT);
-        value->set_f(scores[idx * 2 + 1]);
-      }
-    }
-    ++total_boxes;
-  }
-  //LOG(INFO) << "total boxes: " << total_boxes;
-  delete[] order;
-  delete[] keep_out;
+        return true;
+      },
+      result);
 }
 
 void CaffeDenseCapModel::LoadVocabulary(const std::string& filename) {
@@ -443,35 +412,6 @@ void CaffeDenseCapModel::LoadVocabulary(const std::string& filename) {
   LOG(INFO) << "Load " << vocabulary_.size() << " vocabs from " << filename;
 }
 
-void CaffeDenseCapModel::TransformBbox(
-    int im_height, int im_width, float scale, int nboxes, const float* rois,
-    const float* bbox_deltas, float* out) {
-  for (int i = 0; i < nboxes; ++i) {
-    float x1 = rois[i * 5 + 1] / scale;
-    float y1 = rois[i * 5 + 2] / scale;
-    float x2 = rois[i * 5 + 3] / scale;
-    float y2 = rois[i * 5 + 4] / scale;
-    float width = x2 - x1 + 1;
-    float height = y2 - y1 + 1;
-    float ctr_x = x1 + 0.5 * width;
-    float ctr_y = y1 + 0.5 * height;
-    float dx = bbox_deltas[i * 4];
-    float dy = bbox_deltas[i * 4 + 1];
-    float dw = bbox_deltas[i * 4 + 2];
-    float dh = bbox_deltas[i * 4 + 3];
-    ctr_x += dx * width;
-    ctr_y += dy * height;
-    width *= exp(dw);
-    height *= exp(dh);
-    out[i * 4] = std::max(std::min(ctr_x - 0.5 * width, im_width - 1.), 0.);
-    out[i * 4 + 1] = std::max(std::min(ctr_y - 0.5 * height, im_height - 1.),
-                              0.);
-    out[i * 4 + 2] = std::max(std::min(ctr_x + 0.5 * width, im_width - 1.), 0.);
-    out[i * 4 + 3] = std::max(std::min(ctr_y + 0.5 * height, im_height - 1.),
-                              0.);
-  }
-}
-
 } // namespace backend
 } // namespace nexus
 
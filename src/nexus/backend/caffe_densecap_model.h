@@ -5,6 +5,7 @@
 
 #include <boost/shared_ptr.hpp>
 
+#include "nexus/backend/detection.h"
 #include "nexus/backend/model_ins.h"
 
 // Caffe headers
@@ -41,14 +42,10 @@ class CaffeDenseCapModel : public ModelInstance {
  private:
   void LoadVocabulary(const std::string& filename);
 
-  void TransformBbox(int im_height, int im_width, float scale, int nboxes,
-                     const float* rois, const float* bbox_deltas, float* out);
-
   // parameters
   int max_timestep_;
   int max_boxes_;
-  float nms_threshold_;
-  float score_threshold_;
+  DetectionConfig detection_config_;
   std::vector<float> mean_values_;
   std::vector<float> bbox_mean_;
   std::vector<float> bbox_stds_;
@@ -146,7 +146,7 @@ void CaffeModel::Preprocess(std::shared_ptr<Task> task) {
     task->AppendInput(in_arr);
   };
 
-  const auto& query = task->query;
+  const auto& query = *task->query;
   const auto& input_data = query.input();
   switch (input_data.data_type()) {
     case DT_IMAGE: {
@@ -165,8 +165,8 @@ void CaffeModel::Preprocess(std::shared_ptr<Task> task) {
       break;
     }
     default:
-      task->result.set_status(INPUT_TYPE_INCORRECT);
-      task->result.set_error_message("Input type incorrect: " +
+      task->result->set_status(INPUT_TYPE_INCORRECT);
+      task->result->set_error_message("Input type incorrect: " +
                                      DataType_Name(input_data.data_type()));
       break;
   }
@@ -193,8 +193,8 @@ void CaffeModel::Forward(std::shared_ptr<BatchTask> batch_task) {
 }
 
 void CaffeModel::Postprocess(std::shared_ptr<Task> task) {
-  const QueryProto& query = task->query;
-  QueryResultProto* result = &task->result;
+  const QueryProto& query = *task->query;
+  QueryResultProto* result = task->result;
   result->set_status(CTRL_OK);
   for (auto& output : task->outputs) {
     auto out_arr = output->arrays.at(output_blob_name_);
@@ -99,6 +99,8 @@ DarknetModel::DarknetModel(int gpu_id, const ModelInstanceConfig& config) :
                         as<std::string>();
     LoadClassnames(cns_path.string(), &classnames_);
   }
+  detection_config_ = DetectionConfig(0.24, 0.3);
+  detection_config_.Load(model_info_);
 }
 
 DarknetModel::~DarknetModel() {
@@ -158,13 +160,13 @@ void DarknetModel::Preprocess(std::shared_ptr<Task> task) {
     task->AppendInput(in_arr);
   };
 
-  const auto& query = task->query;
+  const auto& query = *task->query;
   const auto& input_data = query.input();
   switch (input_data.data_type()) {
     case DT_IMAGE: {
       cv::Mat cv_img_rgb = DecodeImage(input_data.image(), CO_RGB);
-      task->attrs["im_height"] = cv_img_rgb.rows;
-      task->attrs["im_width"] = cv_img_rgb.cols;
+      task->attrs.im_height = cv_img_rgb.rows;
+      task->attrs.im_width = cv_img_rgb.cols;
       if (query.window_size() > 0) {
         for (int i = 0; i < query.window_size(); ++i) {
           auto rect = query.window(i);
@@ -179,8 +181,8 @@ void DarknetModel::Preprocess(std::shared_ptr<Task> task) {
       break;
     }
     default:
-      task->result.set_status(INPUT_TYPE_INCORRECT);
-      task->result.set_error_message("Input type incorrect: " +
+      task->result->set_status(INPUT_TYPE_INCORRECT);
+      task->result->set_error_message("Input type incorrect: " +
                                      DataType_Name(input_data.data_type()));
       break;
   }
@@ -200,8 +202,8 @@ void DarknetModel::Forward(std::shared_ptr<BatchTask> batch_task) {
 }
 
 void DarknetModel::Postprocess(std::shared_ptr<Task> task) {
-  const auto& query = task->query;
-  auto* result = &task->result;
+  const auto& query = *task->query;
+  auto* result = task->result;
   result->set_status(CTRL_OK);
   for (auto& output : task->outputs) {
     auto out_arr = output->arrays.at(output_name_);
@@ -211,22 +213,21 @@ void DarknetModel::Postprocess(std::shared_ptr<Task> task) {
       layer l = net_->layers[net_->n - 1];
       size_t nboxes = l.w * l.h * l.n;
       size_t nprobs = nboxes * (l.classes + 1);
-      int* boxes = new int[nboxes * 4];
-      float* probs = new float[nprobs];
+      std::vector<int> boxes(nboxes * 4);
+      std::vector<float> probs(nprobs);
       int only_objectness = 0;
       float tree_threshold = 0.5;
       int relative = 1;
-      float nms = 0.3;
-      float threshold = 0.24;
-      int im_height = task->attrs["im_height"].as<int>();
-      int im_width = task->attrs["im_width"].as<int>();
+      int im_height = task->attrs.im_height;
+      int im_width = task->attrs.im_width;
+      // NMS is done by MarshalDetectionResult instead of darknet
       output_detection_results(
-          out_data, l, im_width, im_height, net_->w, net_->h, threshold, probs,
-          nprobs, boxes, nboxes * 4, only_objectness, nullptr, tree_threshold,
-          relative, nms);
-      MarshalDetectionResult(query, probs, nprobs, boxes, nboxes, result);
-      delete[] boxes;
-      delete[] probs;
+          out_data, l, im_width, im_height, net_->w, net_->h,
+          detection_config_.MinScoreThreshold(), probs.data(), nprobs,
+          boxes.data(), nboxes * 4, only_objectness, nullptr, tree_threshold,
+          relative, 0.);
+      MarshalDetectionResult(query, probs.data(), nprobs, boxes.data(), nboxes,
+                             result);
     } else if (type() == "classification") {
       if (classnames_.empty()) {
         PostprocessClassification(query, out_data, output_size_, result);
@@ -247,74 +248,43 @@ void DarknetModel::Postprocess(std::shared_ptr<Task> task) {
 void DarknetModel::MarshalDetectionResult(
     const QueryProto& query, const float* probs, size_t nprobs,
     const int* boxes, size_t nboxes, QueryResultProto* result) {
-  std::vector<std::string> output_fields(query.output_field().begin(),
-                                         query.output_field().end());
-  if (output_fields.size() == 0) {
-    output_fields.push_back("rect");
-    output_fields.push_back("class_name");
-  }
   size_t nclasses_plus_1 = nprobs / nboxes;
+  std::vector<DetectionBox> dets;
   for (size_t i = 0; i < nboxes; ++i) {
     const float* ps = &probs[i * nclasses_plus_1];
     const int* bs = &boxes[i * 4];
-    bool allzero = true;
-    for (size_t j = 0; j < 4; ++j) {
-      if (bs[j] != 0) {
-        allzero = false;
-        break;
-      }
-    }
-    if (allzero) {
+    if (bs[0] == 0 && bs[1] == 0 && bs[2] == 0 && bs[3] == 0) {
       continue;
     }
     float max_prob = 0.;
     int max_idx = -1;
     for (size_t j = 0; j < nclasses_plus_1 - 1; ++j) {
-      float p = float(ps[j]);
-      if (p > 0) {
-        if (p > max_prob) {
-          max_prob = p;
-          max_idx = j;
-        }
+      if (ps[j] > max_prob) {
+        max_prob = ps[j];
+        max_idx = j;
       }
     }
-    // fill in detection result
-    auto record = result->add_output();
-    for (auto field : output_fields) {
-      if (field == "rect") {
-        auto value = record->add_named_value();
-        value->set_name("rect");
-        value->set_data_type(DT_RECT);
-        auto rect = value->mutable_rect();
-        rect->set_left(bs[0]);
-        rect->set_right(bs[1]);
-        rect->set_top(bs[2]);
-        rect->set_bottom(bs[3]);
-      } else if (field == "objectness") {
-        auto value = record->add_named_value();
-        value->set_name("objectness");
-        value->set_data_type(DT_FLOAT);
-        value->set_f(ps[nclasses_plus_1 - 1]);
-      } else if (field == "class_id") {
-        auto value = record->add_named_value();
-        value->set_name("class_id");
-        value->set_data_type(DT_INT32);
-        value->set_i(max_idx);
-      } else if (field == "class_prob") {
-        auto value = record->add_named_value();
-        value->set_name("class_prob");
-        value->set_data_type(DT_FLOAT);
-        value->set_f(max_prob);
-      } else if (field == "class_name") {
-        auto value = record->add_named_value();
-        value->set_name("class_name");
-        value->set_data_type(DT_STRING);
-        if (classnames_.size() > max_idx) {
-          value->set_s(classnames_.at(max_idx));
-        }
-      }
+    if (max_idx < 0) {
+      continue;
     }
+    // darknet boxes are in [left, right, top, bottom] layout
+    dets.push_back({float(bs[0]), float(bs[2]), float(bs[1]), float(bs[3]),
+                    max_prob, max_idx, int(i)});
   }
+  NonMaxSuppression(detection_config_, &dets);
+  MarshalDetections(
+      query, dets, {"rect", "class_name"}, &classnames_,
+      [&](const DetectionBox& box, const std::string& field,
+          ValueProto* value) {
+        if (field != "objectness") {
+          return false;
+        }
+        value->set_name("objectness");
+        value->set_data_type(DT_FLOAT);
+        value->set_f(probs[box.index * nclasses_plus_1 + nclasses_plus_1 - 1]);
+        return true;
+      },
+      result);
 }
 
 } // namespace backend
@@ -6,6 +6,7 @@
 #include <memory>
 #include <string>
 
+#include "nexus/backend/detection.h"
 #include "nexus/backend/model_ins.h"
 // Darknet headers
 extern "C" {
@@ -50,6 +51,7 @@ class DarknetModel : public ModelInstance {
   size_t output_layer_id_;
   std::string output_name_;
   std::unordered_map<int, std::string> classnames_;
+  DetectionConfig detection_config_;
   bool first_input_array_;
 };
 
@@ -0,0 +1,439 @@
+#include <algorithm>
+#include <cmath>
+#include <glog/logging.h>
+#include <limits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "nexus/backend/detection.h"
+
+namespace nexus {
+namespace backend {
+
+namespace {
+
+/*! \brief Number of buckets used to order boxes by score. */
+const int kNumScoreBuckets = 512;
+
+/*! \brief Boxes kept by NMS stored in SoA layout for vectorized IoU. */
+struct KeptBoxes {
+  std::vector<float> x1;
+  std::vector<float> y1;
+  std::vector<float> x2;
+  std::vector<float> y2;
+  std::vector<float> area;
+
+  void Add(const DetectionBox& box) {
+    x1.push_back(box.x1);
+    y1.push_back(box.y1);
+    x2.push_back(box.x2);
+    y2.push_back(box.y2);
+    area.push_back(BoxArea(box));
+  }
+
+  static float BoxArea(const DetectionBox& box) {
+    return std::max(box.x2 - box.x1, 0.f) * std::max(box.y2 - box.y1, 0.f);
+  }
+};
+
+float IoU(const DetectionBox& a, const DetectionBox& b) {
+  float w = std::min(a.x2, b.x2) - std::max(a.x1, b.x1);
+  float h = std::min(a.y2, b.y2) - std::max(a.y1, b.y1);
+  if (w <= 0 || h <= 0) {
+    return 0.;
+  }
+  float inter = w * h;
+  float uni = KeptBoxes::BoxArea(a) + KeptBoxes::BoxArea(b) - inter;
+  return uni > 0 ? inter / uni : 0.;
+}
+
+/*!
+ * \brief Checks whether box overlaps any kept box by more than threshold.
+ * Compares inter > threshold * union to avoid divisions.
+ */
+bool Overlaps(const DetectionBox& box, const KeptBoxes& kept,
+              float threshold) {
+  const size_t n = kept.area.size();
+  const float area = KeptBoxes::BoxArea(box);
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128 bx1 = _mm_set1_ps(box.x1);
+  const __m128 by1 = _mm_set1_ps(box.y1);
+  const __m128 bx2 = _mm_set1_ps(box.x2);
+  const __m128 by2 = _mm_set1_ps(box.y2);
+  const __m128 barea = _mm_set1_ps(area);
+  const __m128 thresh = _mm_set1_ps(threshold);
+  const __m128 zero = _mm_setzero_ps();
+  for (; i + 4 <= n; i += 4) {
+    __m128 ix1 = _mm_max_ps(bx1, _mm_loadu_ps(&kept.x1[i]));
+    __m128 iy1 = _mm_max_ps(by1, _mm_loadu_ps(&kept.y1[i]));
+    __m128 ix2 = _mm_min_ps(bx2, _mm_loadu_ps(&kept.x2[i]));
+    __m128 iy2 = _mm_min_ps(by2, _mm_loadu_ps(&kept.y2[i]));
+    __m128 w = _mm_max_ps(_mm_sub_ps(ix2, ix1), zero);
+    __m128 h = _mm_max_ps(_mm_sub_ps(iy2, iy1), zero);
+    __m128 inter = _mm_mul_ps(w, h);
+    __m128 uni = _mm_sub_ps(_mm_add_ps(barea, _mm_loadu_ps(&kept.area[i])),
+                            inter);
+    if (_mm_movemask_ps(_mm_cmpgt_ps(inter, _mm_mul_ps(thresh, uni)))) {
+      return true;
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    float w = std::min(box.x2, kept.x2[i]) - std::max(box.x1, kept.x1[i]);
+    float h = std::min(box.y2, kept.y2[i]) - std::max(box.y1, kept.y1[i]);
+    if (w <= 0 || h <= 0) {
+      continue;
+    }
+    float inter = w * h;
+    if (inter > threshold * (area + kept.area[i] - inter)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void FilterByThreshold(const DetectionConfig& config,
+                       std::vector<DetectionBox>* boxes) {
+  auto end = std::remove_if(
+      boxes->begin(), boxes->end(), [&](const DetectionBox& box) {
+        // Also drops NaN scores
+        return !(box.score > config.ScoreThreshold(box.class_id));
+      });
+  boxes->erase(end, boxes->end());
+}
+
+void GreedyNms(const DetectionConfig& config,
+               std::vector<DetectionBox>* boxes) {
+  SortByScore(boxes);
+  std::unordered_map<int, KeptBoxes> kept;
+  size_t nkeep = 0;
+  for (size_t i = 0; i < boxes->size(); ++i) {
+    const DetectionBox& box = (*boxes)[i];
+    auto& kept_boxes = kept[config.class_agnostic ? 0 : box.class_id];
+    if (Overlaps(box, kept_boxes, config.nms_threshold)) {
+      continue;
+    }
+    kept_boxes.Add(box);
+    (*boxes)[nkeep++] = box;
+  }
+  boxes->resize(nkeep);
+}
+
+void SoftNms(const DetectionConfig& config, std::vector<DetectionBox>* boxes) {
+  std::vector<DetectionBox> pending;
+  pending.swap(*boxes);
+  boxes->reserve(pending.size());
+  while (!pending.empty()) {
+    auto best_iter = std::max_element(
+        pending.begin(), pending.end(),
+        [](const DetectionBox& a, const DetectionBox& b) {
+          return a.score < b.score;
+        });
+    DetectionBox best = *best_iter;
+    *best_iter = pending.back();
+    pending.pop_back();
+    boxes->push_back(best);
+    size_t nkeep = 0;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      DetectionBox& box = pending[i];
+      if (config.class_agnostic || box.class_id == best.class_id) {
+        float iou = IoU(best, box);
+        box.score *= std::exp(-iou * iou / config.soft_nms_sigma);
+        if (!(box.score > config.ScoreThreshold(box.class_id))) {
+          continue;
+        }
+      }
+      pending[nkeep++] = box;
+    }
+    pending.resize(nkeep);
+  }
+}
+
+inline uint32_t ToPixel(float v) {
+  return static_cast<uint32_t>(std::max(0.f, std::round(v)));
+}
+
+} // namespace
+
+DetectionConfig::DetectionConfig(float score_thresh, float nms_thresh) :
+    score_threshold(score_thresh),
+    nms_threshold(nms_thresh),
+    soft_nms(false),
+    soft_nms_sigma(0.5),
+    class_agnostic(false) {}
+
+void DetectionConfig::Load(const YAML::Node& model_info) {
+  if (model_info["score_threshold"]) {
+    score_threshold = model_info["score_threshold"].as<float>();
+  }
+  if (model_info["nms_threshold"]) {
+    nms_threshold = model_info["nms_threshold"].as<float>();
+  }
+  if (model_info["soft_nms"]) {
+    soft_nms = model_info["soft_nms"].as<bool>();
+  }
+  if (model_info["soft_nms_sigma"]) {
+    soft_nms_sigma = model_info["soft_nms_sigma"].as<float>();
+    CHECK_GT(soft_nms_sigma, 0) << "soft_nms_sigma must be positive";
+  }
+  if (model_info["class_agnostic_nms"]) {
+    class_agnostic = model_info["class_agnostic_nms"].as<bool>();
+  }
+  if (model_info["class_thresholds"]) {
+    for (auto it : model_info["class_thresholds"]) {
+      class_thresholds[it.first.as<int>()] = it.second.as<float>();
+    }
+  }
+}
+
+float DetectionConfig::ScoreThreshold(int class_id) const {
+  if (class_thresholds.empty()) {
+    return score_threshold;
+  }
+  auto iter = class_thresholds.find(class_id);
+  if (iter == class_thresholds.end()) {
+    return score_threshold;
+  }
+  return iter->second;
+}
+
+float DetectionConfig::MinScoreThreshold() const {
+  float min_thresh = score_threshold;
+  for (auto iter : class_thresholds) {
+    min_thresh = std::min(min_thresh, iter.second);
+  }
+  return min_thresh;
+}
+
+void DecodeNormalizedBoxes(const float* boxes, size_t nboxes, int im_height,
+                           int im_width, float* out) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128 scale = _mm_setr_ps(im_height, im_width, im_height, im_width);
+  for (; i < nboxes; ++i) {
+    __m128 v = _mm_mul_ps(_mm_loadu_ps(boxes + i * 4), scale);
+    // [ymin, xmin, ymax, xmax] -> [xmin, ymin, xmax, ymax]
+    _mm_storeu_ps(out + i * 4, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+  }
+#endif
+  for (; i < nboxes; ++i) {
+    float ymin = boxes[i * 4] * im_height;
+    float xmin = boxes[i * 4 + 1] * im_width;
+    float ymax = boxes[i * 4 + 2] * im_height;
+    float xmax = boxes[i * 4 + 3] * im_width;
+    out[i * 4] = xmin;
+    out[i * 4 + 1] = ymin;
+    out[i * 4 + 2] = xmax;
+    out[i * 4 + 3] = ymax;
+  }
+}
+
+void DecodeDeltaBoxes(const float* rois, const float* deltas,
+                      const float* means, const float* stds, float scale,
+                      size_t nboxes, int im_height, int im_width, float* out) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128 vmeans = _mm_loadu_ps(means);
+  const __m128 vstds = _mm_loadu_ps(stds);
+  const __m128 inv_scale = _mm_set1_ps(1.f / scale);
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 sign = _mm_setr_ps(-0.5f, -0.5f, 0.5f, 0.5f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 upper = _mm_setr_ps(im_width - 1, im_height - 1, im_width - 1,
+                                   im_height - 1);
+  for (; i < nboxes; ++i) {
+    __m128 r = _mm_mul_ps(_mm_loadu_ps(rois + i * 5 + 1), inv_scale);
+    __m128 d = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(deltas + i * 4), vstds),
+                          vmeans);
+    // lo = [x1, y1, x1, y1], hi = [x2, y2, x2, y2]
+    __m128 lo = _mm_shuffle_ps(r, r, _MM_SHUFFLE(1, 0, 1, 0));
+    __m128 hi = _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 2, 3, 2));
+    __m128 size = _mm_add_ps(_mm_sub_ps(hi, lo), one);
+    __m128 ctr = _mm_add_ps(lo, _mm_mul_ps(half, size));
+    ctr = _mm_add_ps(ctr, _mm_mul_ps(
+        _mm_shuffle_ps(d, d, _MM_SHUFFLE(1, 0, 1, 0)), size));
+    float dwh[4];
+    _mm_storeu_ps(dwh, d);
+    float ew = std::exp(dwh[2]);
+    float eh = std::exp(dwh[3]);
+    size = _mm_mul_ps(size, _mm_setr_ps(ew, eh, ew, eh));
+    __m128 v = _mm_add_ps(ctr, _mm_mul_ps(sign, size));
+    v = _mm_min_ps(_mm_max_ps(v, zero), upper);
+    _mm_storeu_ps(out + i * 4, v);
+  }
+#endif
+  for (; i < nboxes; ++i) {
+    float x1 = rois[i * 5 + 1] / scale;
+    float y1 = rois[i * 5 + 2] / scale;
+    float x2 = rois[i * 5 + 3] / scale;
+    float y2 = rois[i * 5 + 4] / scale;
+    float width = x2 - x1 + 1;
+    float height = y2 - y1 + 1;
+    float ctr_x = x1 + 0.5f * width;
+    float ctr_y = y1 + 0.5f * height;
+    float dx = deltas[i * 4] * stds[0] + means[0];
+    float dy = deltas[i * 4 + 1] * stds[1] + means[1];
+    float dw = deltas[i * 4 + 2] * stds[2] + means[2];
+    float dh = deltas[i * 4 + 3] * stds[3] + means[3];
+    ctr_x += dx * width;
+    ctr_y += dy * height;
+    width *= std::exp(dw);
+    height *= std::exp(dh);
+    out[i * 4] = std::max(std::min(ctr_x - 0.5f * width, im_width - 1.f), 0.f);
+    out[i * 4 + 1] = std::max(std::min(ctr_y - 0.5f * height,
+                                       im_height - 1.f), 0.f);
+    out[i * 4 + 2] = std::max(std::min(ctr_x + 0.5f * width,
+                                       im_width - 1.f), 0.f);
+    out[i * 4 + 3] = std::max(std::min(ctr_y + 0.5f * height,
+                                       im_height - 1.f), 0.f);
+  }
+}
+
+void SortByScore(std::vector<DetectionBox>* boxes) {
+  const size_t n = boxes->size();
+  if (n < 2) {
+    return;
+  }
+  // Score range over finite scores only, so that infinities and NaNs don't
+  // break the bucket scale
+  float min_score = std::numeric_limits<float>::infinity();
+  float max_score = -min_score;
+  for (const auto& box : *boxes) {
+    if (std::isfinite(box.score)) {
+      min_score = std::min(min_score, box.score);
+      max_score = std::max(max_score, box.score);
+    }
+  }
+  // Counting sort into buckets of descending score, then insertion sort
+  // within each bucket which only holds a handful of boxes.
+  const float bucket_scale = (max_score > min_score) ?
+                             (kNumScoreBuckets - 1) / (max_score - min_score) :
+                             0.f;
+  std::vector<uint16_t> bucket_of(n);
+  std::vector<uint32_t> offsets(kNumScoreBuckets + 1, 0);
+  for (size_t i = 0; i < n; ++i) {
+    float score = (*boxes)[i].score;
+    int b;
+    if (score >= max_score) {
+      b = 0;
+    } else if (!(score > min_score)) {
+      // Lowest scores, -inf and NaN go last
+      b = kNumScoreBuckets - 1;
+    } else {
+      b = kNumScoreBuckets - 1 -
+          static_cast<int>((score - min_score) * bucket_scale);
+      b = std::min(std::max(b, 0), kNumScoreBuckets - 1);
+    }
+    bucket_of[i] = static_cast<uint16_t>(b);
+    ++offsets[b + 1];
+  }
+  for (int b = 0; b < kNumScoreBuckets; ++b) {
+    offsets[b + 1] += offsets[b];
+  }
+  std::vector<DetectionBox> sorted(n);
+  std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+  for (size_t i = 0; i < n; ++i) {
+    sorted[cursor[bucket_of[i]]++] = (*boxes)[i];
+  }
+  for (int b = 0; b < kNumScoreBuckets; ++b) {
+    for (uint32_t i = offsets[b] + 1; i < offsets[b + 1]; ++i) {
+      DetectionBox box = sorted[i];
+      uint32_t j = i;
+      for (; j > offsets[b] && sorted[j - 1].score < box.score; --j) {
+        sorted[j] = sorted[j - 1];
+      }
+      sorted[j] = box;
+    }
+  }
+  boxes->swap(sorted);
+}
+
+void NonMaxSuppression(const DetectionConfig& config,
+                       std::vector<DetectionBox>* boxes) {
+  FilterByThreshold(config, boxes);
+  if (config.nms_threshold >= 1.) {
+    SortByScore(boxes);
+  } else if (config.soft_nms) {
+    SoftNms(config, boxes);
+  } else {
+    GreedyNms(config, boxes);
+  }
+}
+
+void MarshalDetections(
+    const QueryProto& query, const std::vector<DetectionBox>& boxes,
+    const std::vector<std::string>& default_fields,
+    const std::unordered_map<int, std::string>* classnames,
+    const DetectionFieldFn& extra_field, QueryResultProto* result) {
+  std::vector<std::string> output_fields(query.output_field().begin(),
+                                         query.output_field().end());
+  if (output_fields.empty()) {
+    output_fields = default_fields;
+  }
+  if (std::find(output_fields.begin(), output_fields.end(), "packed") !=
+      output_fields.end()) {
+    auto value = result->add_output()->add_named_value();
+    value->set_name("detections");
+    value->set_data_type(DT_TENSOR);
+    auto tensor = value->mutable_tensor();
+    tensor->set_data_type(DT_FLOAT);
+    tensor->add_shape(boxes.size());
+    tensor->add_shape(6);
+    auto floats = tensor->mutable_floats();
+    floats->Resize(boxes.size() * 6, 0.);
+    float* data = floats->mutable_data();
+    for (const auto& box : boxes) {
+      *data++ = box.x1;
+      *data++ = box.y1;
+      *data++ = box.x2;
+      *data++ = box.y2;
+      *data++ = box.score;
+      *data++ = static_cast<float>(box.class_id);
+    }
+    return;
+  }
+  result->mutable_output()->Reserve(result->output_size() + boxes.size());
+  for (const auto& box : boxes) {
+    auto record = result->add_output();
+    for (const auto& field : output_fields) {
+      auto value = record->add_named_value();
+      if (field == "rect") {
+        value->set_name("rect");
+        value->set_data_type(DT_RECT);
+        auto rect = value->mutable_rect();
+        rect->set_left(ToPixel(box.x1));
+        rect->set_top(ToPixel(box.y1));
+        rect->set_right(ToPixel(box.x2));
+        rect->set_bottom(ToPixel(box.y2));
+      } else if (field == "score" || field == "class_prob") {
+        value->set_name(field);
+        value->set_data_type(DT_FLOAT);
+        value->set_f(box.score);
+      } else if (field == "class_id") {
+        value->set_name("class_id");
+        value->set_data_type(DT_INT32);
+        value->set_i(box.class_id);
+      } else if (field == "class_name") {
+        value->set_name("class_name");
+        value->set_data_type(DT_STRING);
+        if (classnames != nullptr) {
+          auto iter = classnames->find(box.class_id);
+          if (iter == classnames->end()) {
+            LOG(ERROR) << "Cannot find class name for class id " <<
+                box.class_id;
+          } else {
+            value->set_s(iter->second);
+          }
+        }
+      } else if (!extra_field || !extra_field(box, field, value)) {
+        record->mutable_named_value()->RemoveLast();
+      }
+    }
+  }
+}
+
+} // namespace backend
+} // namespace nexus
@@ -0,0 +1,122 @@
+#ifndef NEXUS_BACKEND_DETECTION_H_
+#define NEXUS_BACKEND_DETECTION_H_
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+
+#include "nexus/proto/nnquery.pb.h"
+
+namespace nexus {
+namespace backend {
+
+/*!
+ * \brief A candidate detection box in pixel coordinates of the original image.
+ */
+struct DetectionBox {
+  float x1;
+  float y1;
+  float x2;
+  float y2;
+  float score;
+  int class_id;
+  /*! \brief Index of the box in the raw model output */
+  int index;
+};
+
+/*!
+ * \brief Detection postprocessing configuration, loaded from the model info.
+ *
+ * Recognized keys are score_threshold, nms_threshold, soft_nms,
+ * soft_nms_sigma, class_agnostic_nms and class_thresholds (a map from class
+ * id to score threshold).
+ */
+struct DetectionConfig {
+  DetectionConfig(float score_thresh = 0., float nms_thresh = 1.);
+  /*! \brief Overrides defaults with the values present in model info. */
+  void Load(const YAML::Node& model_info);
+  /*! \brief Score threshold for a class. */
+  float ScoreThreshold(int class_id) const;
+  /*! \brief Minimum score threshold over all classes. */
+  float MinScoreThreshold() const;
+
+  float score_threshold;
+  /*! \brief IoU threshold; NMS is skipped when it is not less than 1 */
+  float nms_threshold;
+  bool soft_nms;
+  float soft_nms_sigma;
+  bool class_agnostic;
+  std::unordered_map<int, float> class_thresholds;
+};
+
+/*!
+ * \brief Decodes boxes in normalized [ymin, xmin, ymax, xmax] layout into
+ * pixel [x1, y1, x2, y2] layout.
+ * \param boxes Input boxes, 4 floats per box
+ * \param nboxes Number of boxes
+ * \param im_height Image height
+ * \param im_width Image width
+ * \param out Output boxes, 4 floats per box. Can alias boxes.
+ */
+void DecodeNormalizedBoxes(const float* boxes, size_t nboxes, int im_height,
+                           int im_width, float* out);
+
+/*!
+ * \brief Applies regression deltas to region proposals and clips the results
+ * to the image, output in pixel [x1, y1, x2, y2] layout.
+ * \param rois Proposals, [batch_idx, x1, y1, x2, y2] per box
+ * \param deltas Regression deltas [dx, dy, dw, dh] per box, unnormalized
+ * \param means Delta means, 4 floats
+ * \param stds Delta standard deviations, 4 floats
+ * \param scale Scale factor between rois and the original image
+ * \param nboxes Number of boxes
+ * \param im_height Image height
+ * \param im_width Image width
+ * \param out Output boxes, 4 floats per box
+ */
+void DecodeDeltaBoxes(const float* rois, const float* deltas,
+                      const float* means, const float* stds, float scale,
+                      size_t nboxes, int im_height, int im_width, float* out);
+
+/*!
+ * \brief Sorts boxes by descending score using bucketed counting sort.
+ */
+void SortByScore(std::vector<DetectionBox>* boxes);
+
+/*!
+ * \brief Filters boxes by per-class thresholds and runs NMS or soft-NMS as
+ * configured. Boxes are left in descending score order.
+ */
+void NonMaxSuppression(const DetectionConfig& config,
+                       std::vector<DetectionBox>* boxes);
+
+/*! \brief Callback that fills a model-specific field into a record. */
+using DetectionFieldFn = std::function<bool(
+    const DetectionBox& box, const std::string& field, ValueProto* value)>;
+
+/*!
+ * \brief Marshals detections into the query result.
+ *
+ * Supported fields are rect, score, class_prob, class_id and class_name,
+ * other fields are delegated to extra_field. If the query asks for the
+ * "packed" field, a single record with a "detections" float tensor of shape
+ * [n, 6] holding x1, y1, x2, y2, score, class_id is emitted instead.
+ * \param query Query
+ * \param boxes Detections
+ * \param default_fields Fields used when query doesn't specify any
+ * \param classnames Map from class id to class name, can be nullptr
+ * \param extra_field Callback for model-specific fields, can be nullptr
+ * \param result Query result
+ */
+void MarshalDetections(
+    const QueryProto& query, const std::vector<DetectionBox>& boxes,
+    const std::vector<std::string>& default_fields,
+    const std::unordered_map<int, std::string>* classnames,
+    const DetectionFieldFn& extra_field, QueryResultProto* result);
+
+} // namespace backend
+} // namespace nexus
+
+#endif // NEXUS_BACKEND_DETECTION_H_
@@ -95,7 +95,7 @@ double GpuExecutorMultiBatching::CurrentUtilization() {
           now - last_exec_time).count();
     int est_queue_len = (int) std::min(elapse / duty_cycle_us_ * curr_queue_len,
                                        (double) model->model()->max_batch());
-    LOG(INFO) << model->model()->model_session_id() <<
+    VLOG(2) << model->model()->model_session_id() <<
         " estimate batch size: " << est_queue_len;
     if (est_queue_len > 0) {
       exec_cycle += model->profile()->GetForwardLatency(est_queue_len);
@@ -111,7 +111,7 @@ double GpuExecutorMultiBatching::CurrentUtilization() {
   // LOG(INFO) << "Utilization: " << utilization_ << " (exec/duty: " <<
   //     exec_cycle << " / " << duty_cycle_us_ << " us)";
   double utilization = exec_cycle / duty_cycle_us_;
-  LOG(INFO) << "Utilization: " << utilization << " (exec/duty: " <<
+  VLOG(1) << "Utilization: " << utilization << " (exec/duty: " <<
       exec_cycle << " / " << duty_cycle_us_ << " us)";
   return utilization;
 }
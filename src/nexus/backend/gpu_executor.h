@@ -23,6 +23,8 @@ class GpuExecutor {
   void SetDutyCycle(double duty_cycle_us) {
     duty_cycle_us_.store(duty_cycle_us);
   }
+
+  double duty_cycle_us() const { return duty_cycle_us_.load(); }
   
   virtual void Start(int core = -1) = 0;
   virtual void Stop() = 0;
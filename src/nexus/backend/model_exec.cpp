@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <sstream>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -15,9 +18,41 @@ DEFINE_int32(backend_count_interval, 1, "Interval to count number of requests in
 DEFINE_int32(backend_avg_interval, 5, "Moving average interval in sec");
 DEFINE_int32(backend_batch_policy, 0, "0: Sliding window; 1: Earliest first;");
 
+namespace {
+
+/*! \brief Inputs of a batch grouped by model session, in first-seen order */
+using ModelInputGroups = std::vector<
+  std::pair<const QueryProto*, std::vector<std::shared_ptr<Input> > > >;
+
+/*!
+ * \brief Adds an input to the group of its model session. Sessions are
+ *   compared by handle when the query has one, batches have few sessions so
+ *   a linear scan beats hashing the session id.
+ */
+void AddModelInput(const QueryProto& query, std::shared_ptr<Input> input,
+                   ModelInputGroups* groups) {
+  uint32_t handle = query.model_session_handle();
+  for (auto& group : *groups) {
+    bool same = (handle > 0) ?
+                handle == group.first->model_session_handle() :
+                query.model_session_id() == group.first->model_session_id();
+    if (same) {
+      group.second.push_back(std::move(input));
+      return;
+    }
+  }
+  groups->emplace_back(&query,
+                       std::vector<std::shared_ptr<Input> >{std::move(input)});
+}
+
+} // namespace
+
+const uint32_t ModelExecutor::kNumQueuedClasses;
+
 ModelExecutor::ModelExecutor(int gpu_id, const ModelInstanceConfig& config,
                              BlockPriorityQueue<Task>& task_queue) :
     backup_(config.backup()),
+    memory_usage_(config.memory_usage()),
     task_queue_(task_queue),
     batch_id_(0),
     open_requests_(0),
@@ -35,6 +70,9 @@ ModelExecutor::ModelExecutor(int gpu_id, const ModelInstanceConfig& config,
   drop_counter_ = MetricRegistry::Singleton().CreateIntervalCounter(
       FLAGS_backend_count_interval);
   input_array_ = model_->CreateInputGpuArray();
+  for (auto& cnt : queued_inputs_) {
+    cnt.store(0, std::memory_order_relaxed);
+  }
   for (auto const& info : config.backup_backend()) {
     backup_backends_.push_back(info.node_id());
   }
@@ -73,6 +111,38 @@ bool ModelExecutor::IsTFShareModel() const {
   return (dynamic_cast<TFShareModel*>(model_.get()) != nullptr);
 }
 
+void ModelExecutor::WarmUp() {
+  if (IsSharePrefixModel() || IsTFShareModel()) {
+    return;
+  }
+  auto cpu_device = DeviceManager::Singleton().GetCPUDevice();
+  size_t input_elements = model_->InputShape().NumElements(1);
+  auto input = std::make_shared<Array>(input_array_->data_type(),
+                                       input_elements, cpu_device);
+  memset(input->Data<char>(), 0,
+         input_elements * type_size(input->data_type()));
+  std::unordered_map<std::string, size_t> output_sizes;
+  for (auto iter : model_->OutputShapes()) {
+    output_sizes.emplace(iter.first, iter.second.NumElements(1));
+  }
+  auto task = std::make_shared<Task>();
+  auto beg = Clock::now();
+  for (uint32_t batch = 1; batch <= model_->max_batch(); ++batch) {
+    auto batch_task = std::make_shared<BatchTask>(model_->max_batch());
+    batch_task->SetInputArray(input_array_);
+    for (uint32_t i = 0; i < batch; ++i) {
+      batch_task->AppendInput(
+          std::make_shared<Input>(beg, task->task_id, i, input), task);
+    }
+    batch_task->CreateOutputArrays(output_sizes, cpu_device);
+    model_->Forward(batch_task);
+  }
+  LOG(INFO) << model_->model_session_id() << " warmed up batch 1 to " <<
+      model_->max_batch() << " in " <<
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          Clock::now() - beg).count() << " ms";
+}
+
 bool ModelExecutor::HasBackup() {
   std::lock_guard<std::mutex> lock(backup_mu_);
   return (backup_backends_.size() > 0);
@@ -91,24 +161,80 @@ void ModelExecutor::UpdateBackupBackends(const ModelInstanceConfig& config) {
   }
 }
 
+bool ModelExecutor::CanMeetDeadline(std::shared_ptr<Task> task,
+                                    double duty_cycle_us) {
+  if (profile_ == nullptr) {
+    return true;
+  }
+  uint32_t batch = model_->batch();
+  if (batch == 0) {
+    return true;
+  }
+  double fwd_lat = profile_->GetForwardLatency(batch);
+  double cycle_us = (duty_cycle_us > 0) ? duty_cycle_us : fwd_lat;
+  TimePoint now = Clock::now();
+  TimePoint ready = now + std::chrono::microseconds(
+      int(profile_->GetPreprocessLatency()));
+  // The next batch starts one cycle after the last one started
+  TimePoint next_exec = LastExecuteFinishTime() + std::chrono::microseconds(
+      int(cycle_us - fwd_lat));
+  TimePoint exec = std::max(ready, next_exec);
+  // Inputs queued ahead of this task take whole batch cycles to drain. Inputs
+  // of lower classes are not ahead of it.
+  int queued = std::max(NumberOfQueuedInputs(task->priority()), 0);
+  double cycles = std::ceil(double(queued) / batch);
+  exec += std::chrono::microseconds(int(cycles * cycle_us));
+  TimePoint finish = exec + std::chrono::microseconds(
+      int(fwd_lat + profile_->GetPostprocessLatency()));
+  return finish <= task->deadline();
+}
+
+void ModelExecutor::RecordRejectedTask(std::shared_ptr<Task> task) {
+  int cnt = std::max(task->query->window_size(), 1);
+  req_counter_->Increase(cnt);
+  drop_counter_->Increase(cnt);
+}
+
+std::vector<uint64_t> ModelExecutor::CancelTasks(
+    const std::shared_ptr<Connection>& conn,
+    const std::unordered_set<uint64_t>& query_ids) {
+  std::vector<uint64_t> cancelled;
+  std::lock_guard<std::mutex> lock(task_mu_);
+  for (auto qid : query_ids) {
+    auto range = query_tasks_.equal_range(qid);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+      auto& task = processing_tasks_.at(iter->second);
+      if (task->connection != conn || task->result->status() != CTRL_OK) {
+        continue;
+      }
+      task->result->set_status(CANCELLED);
+      cancelled.push_back(qid);
+    }
+  }
+  return cancelled;
+}
+
 bool ModelExecutor::Preprocess(std::shared_ptr<Task> task, bool force) {
   int cnt = 1;
-  if (task->query.window_size() > 0) {
-    cnt = task->query.window_size();
+  if (task->query->window_size() > 0) {
+    cnt = task->query->window_size();
   }
   bool limit = !force && HasBackup();
   if (!IncreaseOpenRequests(cnt, limit)) {
     return false;
   }
   req_counter_->Increase(cnt);
+  // Task won't be relayed any more, free the request message early
+  task->message = nullptr;
   model_->Preprocess(task);
-  if (task->result.status() != CTRL_OK) {
+  if (task->result->status() != CTRL_OK) {
     return false;
   }
   std::lock_guard<std::mutex> lock(task_mu_);
   processing_tasks_.emplace(task->task_id, task);
+  query_tasks_.emplace(task->query->query_id(), task->task_id);
   for (auto input : task->inputs) {
-    input_queue_.push(input);
+    PushInput(input);
   }
   return true;
 }
@@ -123,8 +249,9 @@ bool ModelExecutor::AddPreprocessedTask(std::shared_ptr<Task> task,
   req_counter_->Increase(cnt);
   std::lock_guard<std::mutex> lock(task_mu_);
   processing_tasks_.emplace(task->task_id, task);
+  query_tasks_.emplace(task->query->query_id(), task->task_id);
   for (auto input : task->inputs) {
-    input_queue_.push(input);
+    PushInput(input);
   }
   return true;
 }
@@ -223,6 +350,29 @@ void ModelExecutor::DecreaseOpenRequests(int cnt) {
   //CHECK_GE(prev, cnt) << "Negative value in open requests";
 }
 
+int ModelExecutor::NumberOfQueuedInputs(uint32_t priority) const {
+  uint32_t last = std::min(priority, kNumQueuedClasses - 1);
+  int cnt = 0;
+  for (uint32_t i = 0; i <= last; ++i) {
+    cnt += queued_inputs_[i].load(std::memory_order_relaxed);
+  }
+  return cnt;
+}
+
+void ModelExecutor::PushInput(std::shared_ptr<Input> input) {
+  uint32_t cls = std::min(input->priority(), kNumQueuedClasses - 1);
+  queued_inputs_[cls].fetch_add(1, std::memory_order_relaxed);
+  input_queue_.push(std::move(input));
+}
+
+std::shared_ptr<Input> ModelExecutor::PopInput() {
+  auto input = input_queue_.top();
+  input_queue_.pop();
+  uint32_t cls = std::min(input->priority(), kNumQueuedClasses - 1);
+  queued_inputs_[cls].fetch_sub(1, std::memory_order_relaxed);
+  return input;
+}
+
 std::pair<std::shared_ptr<BatchTask>, int> ModelExecutor::GetBatchTaskSlidingWindow(
     uint32_t expect_batch_size) {
   auto batch_task = std::make_shared<BatchTask>(model_->max_batch());
@@ -246,14 +396,13 @@ std::pair<std::shared_ptr<BatchTask>, int> ModelExecutor::GetBatchTaskSlidingWin
   }
   int dequeue_cnt = 0;
   int current_batch = 0;
-  std::unordered_map<std::string, std::vector<std::shared_ptr<Input> > > model_inputs;
+  ModelInputGroups model_inputs;
   while (current_batch < expect_batch_size && !input_queue_.empty()) {
-    auto input = std::move(input_queue_.top());
-    input_queue_.pop();
+    auto input = PopInput();
     ++dequeue_cnt;
     auto task = processing_tasks_.at(input->task_id);
     task->timer.Record("exec");
-    if (task->result.status() != CTRL_OK ||
+    if (task->result->status() != CTRL_OK ||
         (profile_ != nullptr && input->deadline() < finish)) {
       VLOG(1) << model_->model_session_id() << " drops task " <<
           task->task_id << "/" << input->index << ", waiting time " <<
@@ -262,12 +411,7 @@ std::pair<std::shared_ptr<BatchTask>, int> ModelExecutor::GetBatchTaskSlidingWin
         RemoveTask(task);
       }
     } else {
-      auto& model_sess_id = task->query.model_session_id();
-      if (model_inputs.find(model_sess_id) == model_inputs.end()) {
-        model_inputs.emplace(model_sess_id,
-                             std::vector<std::shared_ptr<Input> >{});
-      }
-      model_inputs.at(model_sess_id).push_back(input);
+      AddModelInput(*task->query, input, &model_inputs);
       ++current_batch;
     }
     // Check whether there is enough requests left to fill the batch size
@@ -311,55 +455,45 @@ std::pair<std::shared_ptr<BatchTask>, int> ModelExecutor::GetBatchTaskEarliest(
   CHECK(profile_ != nullptr);
   int dequeue_cnt = 0;
 
-  // find the earliest deadline
+  // Inputs are ordered by class before deadline, so an input behind the head
+  // can expire earlier than the head. Drop inputs that cannot finish even in
+  // a batch of one, and stop gathering once the batch could no longer finish
+  // before the earliest deadline among the gathered inputs.
   TimePoint now = Clock::now();
-  TimePoint finish = now;
-  finish += std::chrono::microseconds(static_cast<int>(profile_->GetForwardLatency(1)));
-  finish += std::chrono::microseconds(static_cast<int>(profile_->GetPostprocessLatency()));
-  while (!input_queue_.empty()) {
-    auto &input = input_queue_.top();
-    auto &task = processing_tasks_.at(input->task_id);
-    if (task->result.status() != CTRL_OK || input->deadline() < finish) {
+  int postprocess_us = static_cast<int>(profile_->GetPostprocessLatency());
+  TimePoint finish = now + std::chrono::microseconds(
+      static_cast<int>(profile_->GetForwardLatency(1)) + postprocess_us);
+  TimePoint earliest = TimePoint::max();
+  uint32_t current_batch = 0;
+  ModelInputGroups model_inputs;
+  while (current_batch < expect_batch_size && !input_queue_.empty()) {
+    auto input = input_queue_.top();
+    auto task = processing_tasks_.at(input->task_id);
+    if (task->result->status() != CTRL_OK || input->deadline() < finish) {
+      PopInput();
+      ++dequeue_cnt;
       task->timer.Record("exec");
       VLOG(1) << model_->model_session_id() << " drops task " <<
-              task->task_id << "/" << input->index << ", waiting time " <<
-              task->timer.GetLatencyMicros("begin", "exec") << " us";
+          task->task_id << "/" << input->index << ", waiting time " <<
+          task->timer.GetLatencyMicros("begin", "exec") << " us";
       if (task->AddVirtualOutput(input->index)) {
         RemoveTask(task);
       }
-      ++dequeue_cnt;
-      input_queue_.pop();
-    } else {
-      finish = input->deadline();
+      continue;
+    }
+    TimePoint deadline = std::min(earliest, input->deadline());
+    TimePoint batch_finish = now + std::chrono::microseconds(
+        static_cast<int>(profile_->GetForwardLatency(current_batch + 1)) +
+        postprocess_us);
+    if (current_batch > 0 && batch_finish > deadline) {
       break;
     }
-  }
-
-  // calculate max batch size
-  int budget = std::chrono::duration_cast<std::chrono::microseconds>(finish - now).count();
-  budget -= static_cast<int>(profile_->GetPostprocessLatency());
-  uint32_t batch_size = 2;
-  while (batch_size <= expect_batch_size && profile_->GetForwardLatency(batch_size) < budget)
-    ++batch_size;
-  --batch_size;
-
-  // gather inputs
-  uint32_t current_batch = 0;
-  std::unordered_map<std::string, std::vector<std::shared_ptr<Input> > > model_inputs;
-  while (current_batch < batch_size && !input_queue_.empty()) {
-    auto input = input_queue_.top();
-    input_queue_.pop();
+    PopInput();
     ++dequeue_cnt;
-
-    auto task = processing_tasks_.at(input->task_id);
     task->timer.Record("exec");
-    auto& model_sess_id = task->query.model_session_id();
-    if (model_inputs.find(model_sess_id) == model_inputs.end()) {
-      model_inputs.emplace(model_sess_id,
-                           std::vector<std::shared_ptr<Input> >{});
-    }
-    model_inputs.at(model_sess_id).push_back(input);
+    AddModelInput(*task->query, input, &model_inputs);
     ++current_batch;
+    earliest = deadline;
   }
 
   std::stringstream ss;
@@ -386,8 +520,16 @@ std::pair<std::shared_ptr<BatchTask>, int> ModelExecutor::GetBatchTask(
 
 void ModelExecutor::RemoveTask(std::shared_ptr<Task> task) {
   task->stage = kPostprocess;
+  task->enqueue_time = Clock::now();
   task_queue_.push(task);
   processing_tasks_.erase(task->task_id);
+  auto range = query_tasks_.equal_range(task->query->query_id());
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    if (iter->second == task->task_id) {
+      query_tasks_.erase(iter);
+      break;
+    }
+  }
 }
 
 } // namespace backend
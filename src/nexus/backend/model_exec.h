@@ -4,6 +4,8 @@
 #include <atomic>
 #include <memory>
 #include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "nexus/backend/model_ins.h"
 #include "nexus/common/block_queue.h"
@@ -25,6 +27,8 @@ class ModelExecutor {
   const ModelInstance* model() const { return model_.get(); }
   /*! \brief Return whether this model is a backup model. */
   bool backup() const { return backup_; }
+  /*! \brief Return the GPU memory usage estimated by scheduler in bytes. */
+  uint64_t memory_usage() const { return memory_usage_; }
 
   const ModelProfile* profile() const { return profile_; }
 
@@ -43,6 +47,42 @@ class ModelExecutor {
 
   void UpdateBackupBackends(const ModelInstanceConfig& config);
 
+  /*!
+   * \brief Estimates whether the task can finish before its deadline if it
+   *   is admitted now. The estimate adds up profiled preprocess, forward and
+   *   postprocess latencies, the wait for the next batch slot and the batch
+   *   cycles needed to drain the inputs already queued.
+   * \param task Task to admit
+   * \param duty_cycle_us Duty cycle of the GPU executor, 0 if unknown
+   * \return Whether the task is expected to meet its deadline
+   */
+  bool CanMeetDeadline(std::shared_ptr<Task> task, double duty_cycle_us);
+  /*!
+   * \brief Counts a task rejected by admission control as a dropped request.
+   * \param task Rejected task
+   */
+  void RecordRejectedTask(std::shared_ptr<Task> task);
+
+  /*!
+   * \brief Cancels tasks of the given queries from a frontend. Inputs of
+   *   cancelled tasks are skipped when forming batches, and cancelled tasks
+   *   are dropped without reply.
+   * \param conn Connection to the frontend
+   * \param query_ids Query ids to cancel
+   * \return Query ids of the cancelled tasks
+   */
+  std::vector<uint64_t> CancelTasks(
+      const std::shared_ptr<Connection>& conn,
+      const std::unordered_set<uint64_t>& query_ids);
+
+  /*!
+   * \brief Forwards dummy batches of every size up to max batch, so that the
+   *   lazy initialization in frameworks is done before serving traffic. Must
+   *   be called before the model is added to the GPU executor. Models sharing
+   *   a prefix or a TF session dispatch batches by query and are skipped.
+   */
+  void WarmUp();
+
   bool Preprocess(std::shared_ptr<Task> task, bool force=false);
 
   bool AddPreprocessedTask(std::shared_ptr<Task> task, bool force=false);
@@ -62,6 +102,15 @@ class ModelExecutor {
   bool IncreaseOpenRequests(int cnt, bool limit_max_batch);
 
   void DecreaseOpenRequests(int cnt);
+  /*!
+   * \brief Returns the number of queued inputs of priority class up to
+   *   priority, i.e., the inputs served no later than one of that class.
+   */
+  int NumberOfQueuedInputs(uint32_t priority) const;
+  /*! \brief Pushes an input to input_queue_. Must hold task_mu_. */
+  void PushInput(std::shared_ptr<Input> input);
+  /*! \brief Pops the top input of input_queue_. Must hold task_mu_. */
+  std::shared_ptr<Input> PopInput();
   /*!
    * \brief Get batch task from the task queue.
    * \param batch_size Expected batch size in the batch task.
@@ -73,6 +122,7 @@ class ModelExecutor {
 
   std::unique_ptr<ModelInstance> model_;
   bool backup_;
+  uint64_t memory_usage_;
   const ModelProfile* profile_;
   BlockPriorityQueue<Task>& task_queue_;
   /*!
@@ -80,6 +130,11 @@ class ModelExecutor {
    * Guarded by task_mu_.
    */
   std::unordered_map<uint64_t, std::shared_ptr<Task> > processing_tasks_;
+  /*!
+   * \brief Map from query id to the ids of processing tasks of that query.
+   * Guarded by task_mu_.
+   */
+  std::unordered_multimap<uint64_t, uint64_t> query_tasks_;
   /*! \brief Priority queue of inputs based on deadline. Guarded by task_mu_. */
   std::priority_queue<std::shared_ptr<Input>,
                       std::vector<std::shared_ptr<Input> >,
@@ -90,6 +145,12 @@ class ModelExecutor {
   std::atomic<uint64_t> batch_id_;
   /*! \brief Number of open requests. */
   std::atomic<int> open_requests_;
+  /*!
+   * \brief Number of inputs in input_queue_ per priority class. Classes from
+   *   kNumQueuedClasses - 1 on share the last counter.
+   */
+  static const uint32_t kNumQueuedClasses = 8;
+  std::atomic<int> queued_inputs_[kNumQueuedClasses];
   /*! \brief Interval counter to count number of requests within each interval.
    */
   std::shared_ptr<IntervalCounter> req_counter_;
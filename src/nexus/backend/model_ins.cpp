@@ -73,6 +73,10 @@ ModelInstance::ModelInstance(int gpu_id, const ModelInstanceConfig &config) :
   CHECK(info != nullptr) << "Model not found in the database";
   model_info_ = *info;
   model_session_id_ = ModelSessionToString(model_session_);
+  profile_id_ = ModelSessionToProfileID(model_session_);
+  if (model_info_["type"]) {
+    type_ = model_info_["type"].as<std::string>();
+  }
   cpu_device_ = DeviceManager::Singleton().GetCPUDevice();
 #ifdef USE_GPU
   gpu_device_ = DeviceManager::Singleton().GetGPUDevice(gpu_id);
@@ -34,15 +34,17 @@ class ModelInstance {
   /*! \brief Get GPU ID that model is allocated on. */
   int gpu_id() const { return gpu_id_; }
   /*! \brief Get the framework name. */
-  std::string framework() const { return model_session_.framework(); }
+  const std::string& framework() const { return model_session_.framework(); }
   /*! \brief Get the model name. */
-  std::string model_name() const { return model_session_.model_name(); }
+  const std::string& model_name() const {
+    return model_session_.model_name();
+  }
   /*! \brief Get the model version. */
   int version() const { return model_session_.version(); }
   /*! \brief Get the model session ID. */
-  std::string model_session_id() const { return model_session_id_; }
+  const std::string& model_session_id() const { return model_session_id_; }
   /*! \brief Get the model type. */
-  std::string type() const { return model_info_["type"].as<std::string>(); }
+  const std::string& type() const { return type_; }
   /*! \brief Get the suggested batch size. */
   uint32_t batch() const { return batch_.load(); }
   /*!
@@ -54,9 +56,7 @@ class ModelInstance {
   /*! \brief Get the max batch size allowed according to latency SLA. */
   uint32_t max_batch() const { return max_batch_; }
   /*! \brief Get the profile ID for this model instance. */
-  std::string profile_id() const {
-    return ModelSessionToProfileID(model_session_);
-  }
+  const std::string& profile_id() const { return profile_id_; }
   /*!
    * \brief Get input shape.
    * \return Input shape.
@@ -124,6 +124,10 @@ class ModelInstance {
   ModelSession model_session_;
   /*! \brief Model session ID */
   std::string model_session_id_;
+  /*! \brief Model type, cached from model info */
+  std::string type_;
+  /*! \brief Profile ID, cached from model session */
+  std::string profile_id_;
   /*! \brief Current batch size to use */
   std::atomic<uint32_t> batch_;
   /*! \brief Maximum batch size allowed given latency SLO */
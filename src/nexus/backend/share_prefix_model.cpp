@@ -133,7 +133,7 @@ void SharePrefixModel::Forward(std::shared_ptr<BatchTask> batch_task) {
   // Prepare the suffix batch tasks
   for (uint32_t i = 0; i < batch_size; ++i) {
     auto task = tasks[i];
-    auto model_sess_id = task->query.model_session_id();
+    auto model_sess_id = task->query->model_session_id();
     auto suffix_model = suffix_models.at(model_sess_id);
     task->suffix_model = suffix_model;
     auto suffix_batch_task = std::make_shared<BatchTask>(1);
@@ -1,11 +1,17 @@
+#include <algorithm>
+#include <gflags/gflags.h>
+
 #include "nexus/backend/task.h"
 #include "nexus/common/model_def.h"
 
+DEFINE_int32(task_arena_kb, 64, "Initial arena block size of a task in KB");
+
 namespace nexus {
 namespace backend {
 
-Input::Input(TimePoint deadline, uint64_t tid, int idx, ArrayPtr arr) :
-    DeadlineItem(deadline),
+Input::Input(TimePoint deadline, uint64_t tid, int idx, ArrayPtr arr,
+             uint32_t priority) :
+    DeadlineItem(deadline, priority),
     task_id(tid),
     index(idx),
     array(arr) {}
@@ -23,28 +29,104 @@ Task::Task() : Task(nullptr) {}
 Task::Task(std::shared_ptr<Connection> conn) :
     DeadlineItem(),
     connection(conn),
+    relay_id(0),
     model(nullptr),
     stage(kPreprocess),
-    filled_outputs(0) {
+    filled_outputs(0),
+    chain_depth(0),
+    arena_block_(FLAGS_task_arena_kb * 1024) {
+  google::protobuf::ArenaOptions options;
+  options.initial_block = arena_block_.data();
+  options.initial_block_size = arena_block_.size();
+  arena_.reset(new google::protobuf::Arena(options));
+  Init();
+}
+
+void Task::Reset(std::shared_ptr<Connection> conn) {
+  begin_ = Clock::now();
+  connection = std::move(conn);
+  message = nullptr;
+  model = nullptr;
+  suffix_model = nullptr;
+  stage = kPreprocess;
+  inputs.clear();
+  outputs.clear();
+  filled_outputs = 0;
+  attrs = TaskAttrs();
+  chain_origin.clear();
+  chain_depth = 0;
+  timer.Clear();
+  // Frees the blocks beyond the initial block used by the previous query
+  arena_->Reset();
+  Init();
+}
+
+void Task::ReleaseResources() {
+  connection = nullptr;
+  message = nullptr;
+  model = nullptr;
+  suffix_model = nullptr;
+  inputs.clear();
+  outputs.clear();
+}
+
+void Task::Init() {
   task_id = global_task_id_.fetch_add(1, std::memory_order_relaxed);
+  enqueue_time = Clock::now();
+  query = google::protobuf::Arena::CreateMessage<QueryProto>(arena_.get());
+  result = google::protobuf::Arena::CreateMessage<QueryResultProto>(
+      arena_.get());
   timer.Record("begin");
 }
 
 void Task::DecodeQuery(std::shared_ptr<Message> message) {
   msg_type = message->type();
-  message->DecodeBody(&query);
+  if (msg_type == kBackendRelay) {
+    RelayHeader header;
+    message->DecodeRelayHeader(&header);
+    relay_id = header.relay_id;
+    message->DecodeBody(query, RELAY_HEADER_SIZE);
+  } else {
+    relay_id = 0;
+    message->DecodeBody(query);
+    this->message = std::move(message);
+  }
+  InitDeadline();
+}
+
+void Task::DecodeQuery(const char* data, size_t size) {
+  msg_type = kBackendRequest;
+  relay_id = 0;
+  query->ParseFromArray(data, size);
+  InitDeadline();
+}
+
+void Task::InitDeadline() {
+  if (query->model_session_handle() > 0) {
+    return;
+  }
   ModelSession sess;
-  ParseModelSession(query.model_session_id(), &sess);
-  uint32_t budget = sess.latency_sla();
-  if (query.slack_ms() > 0) {
-    budget += query.slack_ms();
+  ParseModelSession(query->model_session_id(), &sess);
+  InitDeadline(sess.latency_sla());
+}
+
+void Task::InitDeadline(uint32_t latency_sla) {
+  uint32_t budget = latency_sla;
+  if (query->slack_ms() > 0) {
+    budget += query->slack_ms();
     // LOG(INFO) << "slack " << query.slack_ms() << " ms";
   }
+  if (query->deadline_ms() > 0) {
+    // No use to finish after the client gives up
+    budget = std::min(budget, query->deadline_ms());
+  }
   SetDeadline(std::chrono::milliseconds(budget));
+  SetPriority(query->priority());
 }
 
 void Task::AppendInput(ArrayPtr arr) {
-  auto input = std::make_shared<Input>(deadline(), task_id, inputs.size(), arr);
+  auto input = std::make_shared<Input>(deadline(), task_id, inputs.size(), arr,
+                                       priority());
   inputs.push_back(input);
   // Put a placeholder in the outputs
   outputs.push_back(nullptr);
@@ -60,7 +142,9 @@ bool Task::AddOutput(std::shared_ptr<Output> output) {
 }
 
 bool Task::AddVirtualOutput(int index) {
-  result.set_status(TIMEOUT);
+  if (result->status() == CTRL_OK) {
+    result->set_status(TIMEOUT);
+  }
   uint32_t filled = ++filled_outputs;
   if (filled == outputs.size()) {
     return true;
@@ -68,6 +152,34 @@ bool Task::AddVirtualOutput(int index) {
   return false;
 }
 
+TaskPool::TaskPool(size_t capacity) :
+    capacity_(capacity),
+    next_(0) {
+  tasks_.reserve(capacity);
+}
+
+std::shared_ptr<Task> TaskPool::Acquire(std::shared_ptr<Connection> conn) {
+  // Tasks usually finish in arrival order, so probing a few slots after the
+  // last acquired one almost always finds a free task.
+  const size_t kMaxProbes = 8;
+  size_t nprobes = std::min(kMaxProbes, tasks_.size());
+  for (size_t i = 0; i < nprobes; ++i) {
+    auto& task = tasks_[next_];
+    next_ = (next_ + 1) % tasks_.size();
+    if (task.use_count() == 1) {
+      // Synchronizes with the release of the last reference in other threads
+      std::atomic_thread_fence(std::memory_order_acquire);
+      task->Reset(std::move(conn));
+      return task;
+    }
+  }
+  auto task = std::make_shared<Task>(std::move(conn));
+  if (tasks_.size() < capacity_) {
+    tasks_.push_back(task);
+  }
+  return task;
+}
+
 } // namespace backend
 } // namespace nexus
 
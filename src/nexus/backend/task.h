@@ -4,8 +4,8 @@
 #include <atomic>
 #include <chrono>
 #include <memory>
+#include <google/protobuf/arena.h>
 #include <opencv2/opencv.hpp>
-#include <yaml-cpp/yaml.h>
 
 #include "nexus/common/block_queue.h"
 #include "nexus/common/connection.h"
@@ -32,8 +32,10 @@ class Input : public DeadlineItem {
    * \param tid Task id of corresponding task
    * \param idx Index in the inputs of task
    * \param arr Input array that contains the input data
+   * \param priority Priority class of corresponding task
    */
-  Input(TimePoint deadline, uint64_t tid, int idx, ArrayPtr arr);
+  Input(TimePoint deadline, uint64_t tid, int idx, ArrayPtr arr,
+        uint32_t priority = 0);
 
   /*! \brief Task id */
   uint64_t task_id;
@@ -65,6 +67,27 @@ class Output {
   std::unordered_map<std::string, ArrayPtr> arrays;
 };
 
+/*!
+ * \brief TaskAttrs holds the attributes that are produced during
+ *   preprocessing and consumed by later stages of a task.
+ */
+struct TaskAttrs {
+  TaskAttrs() :
+      im_height(0),
+      im_width(0),
+      scale_h(1.),
+      scale_w(1.) {}
+
+  /*! \brief Height of the original input image */
+  int im_height;
+  /*! \brief Width of the original input image */
+  int im_width;
+  /*! \brief Scale between the model input and original image height */
+  float scale_h;
+  /*! \brief Scale between the model input and original image width */
+  float scale_w;
+};
+
 /*! \brief Stage indicates the context processing stage */
 enum Stage {
   /* !\brief Task at the pre-processing stage */
@@ -84,11 +107,34 @@ class Task : public DeadlineItem, public std::enable_shared_from_this<Task> {
    * \param conn Connection to frontend server
    */
   Task(std::shared_ptr<Connection> conn);
+  /*!
+   * \brief Resets the task so that it can be reused for a new query. The
+   *   arena is reset and query and result are re-created on it.
+   * \param conn Connection to frontend server
+   */
+  void Reset(std::shared_ptr<Connection> conn);
+  /*!
+   * \brief Releases inputs, outputs, model and connection held by a finished
+   *   task, so that a pooled task doesn't pin them until its reuse.
+   */
+  void ReleaseResources();
   /*!
    * \brief Decode query from message.
    * \param message Message received from frontend
    */
   void DecodeQuery(std::shared_ptr<Message> message);
+  /*!
+   * \brief Decode query batched in a request batch message. The message
+   *   isn't kept, so relaying the task re-encodes the query.
+   * \param data Encoded query
+   * \param size Size of the encoded query
+   */
+  void DecodeQuery(const char* data, size_t size);
+  /*!
+   * \brief Sets the deadline from the latency SLA and slack of query.
+   * \param latency_sla Latency SLA of the model session in ms
+   */
+  void InitDeadline(uint32_t latency_sla);
   /*!
    * \brief Append preprocessed input array to task.
    * \param arr Input array
@@ -114,10 +160,17 @@ class Task : public DeadlineItem, public std::enable_shared_from_this<Task> {
   std::shared_ptr<Connection> connection;
   /*! \brief Message type */
   MessageType msg_type;
-  /*! \brief Query to process */
-  QueryProto query;
-  /*! \brief Query result */
-  QueryResultProto result;
+  /*!
+   * \brief Request message the query was decoded from, kept until
+   * preprocessing so that it can be relayed to a backup without re-encoding.
+   */
+  std::shared_ptr<Message> message;
+  /*! \brief Relay id assigned by the relaying backend for relayed tasks */
+  uint64_t relay_id;
+  /*! \brief Query to process, allocated on the task arena */
+  QueryProto* query;
+  /*! \brief Query result, allocated on the task arena */
+  QueryResultProto* result;
   /*! \brief Model instance to execute for the task */
   std::shared_ptr<ModelExecutor> model;
   /*!
@@ -133,15 +186,66 @@ class Task : public DeadlineItem, public std::enable_shared_from_this<Task> {
   /*! \brief Number of outputs that has been filled in */
   std::atomic<uint32_t> filled_outputs;
   /*! \brief Attributes that needs to be kept during the task */
-  YAML::Node attrs;
+  TaskAttrs attrs;
   /*! \brief Timer that counts the time spent in each stage */
   Timer timer;
+  /*! \brief Time when the task was last pushed into a task queue */
+  TimePoint enqueue_time;
+  /*!
+   * \brief Model session of the query that a chained task replies to, empty
+   *   if the task is not chained.
+   */
+  std::string chain_origin;
+  /*! \brief Number of chained stages run before this task */
+  uint32_t chain_depth;
 
  private:
+  /*! \brief Assigns a new task id and creates messages on the arena. */
+  void Init();
+  /*!
+   * \brief Sets the deadline from the model session id of query. Queries
+   *   that only carry a handle get their deadline when the handle is resolved.
+   */
+  void InitDeadline();
+
+  /*! \brief Initial arena block, kept across arena resets */
+  std::vector<char> arena_block_;
+  /*! \brief Arena that owns query and result */
+  std::unique_ptr<google::protobuf::Arena> arena_;
   /*! \brief Global task ID */
   static std::atomic<uint64_t> global_task_id_;
 };
 
+/*!
+ * \brief TaskPool recycles tasks so that handling a query doesn't allocate a
+ *   new task and protobuf messages. A pooled task is free for reuse once the
+ *   pool holds the only reference to it. Acquire is not thread-safe and must
+ *   be called from a single thread.
+ */
+class TaskPool {
+ public:
+  /*!
+   * \brief Constructs a task pool.
+   * \param capacity Max number of tasks kept in the pool
+   */
+  explicit TaskPool(size_t capacity);
+  /*!
+   * \brief Gets a reset task from the pool, or a new task if all pooled tasks
+   *   are in use.
+   * \param conn Connection to frontend server
+   * \return Task pointer
+   */
+  std::shared_ptr<Task> Acquire(std::shared_ptr<Connection> conn);
+
+ private:
+  /*! \brief Pooled tasks */
+  std::vector<std::shared_ptr<Task> > tasks_;
+  /*! \brief Max number of pooled tasks */
+  size_t capacity_;
+  /*! \brief Slot to probe first in the next acquire */
+  size_t next_;
+};
+
 } // namespace backend
 } // namespace nexus
 
@@ -232,6 +232,9 @@ TensorflowModel::TensorflowModel(int gpu_id, const ModelInstanceConfig& config):
                         as<std::string>();
     LoadClassnames(cns_path.string(), &classnames_);
   }
+  // Detection graphs already apply NMS, so only thresholds are applied by
+  // default.
+  detection_config_.Load(model_info_);
   LOG(INFO) << "Finished constructor";
 }
 
@@ -311,13 +314,13 @@ void TensorflowModel::Preprocess(std::shared_ptr<Task> task) {
     prepare_image = prepare_image_default;
   }
 
-  const auto& query = task->query;
+  const auto& query = *task->query;
   const auto& input_data = query.input();
   switch (input_data.data_type()) {
     case DT_IMAGE: {
       cv::Mat img = DecodeImage(input_data.image(), CO_RGB);
-      task->attrs["im_height"] = img.rows;
-      task->attrs["im_width"] = img.cols;
+      task->attrs.im_height = img.rows;
+      task->attrs.im_width = img.cols;
       if (query.window_size() > 0) {
         for (int i = 0; i < query.window_size(); ++i) {
           const auto& rect = query.window(i);
@@ -332,8 +335,8 @@ void TensorflowModel::Preprocess(std::shared_ptr<Task> task) {
       break;
     }
     default:
-      task->result.set_status(INPUT_TYPE_INCORRECT);
-      task->result.set_error_message("Input type incorrect: " +
+      task->result->set_status(INPUT_TYPE_INCORRECT);
+      task->result->set_error_message("Input type incorrect: " +
                                      DataType_Name(input_data.data_type()));
       break;
   }
@@ -375,8 +378,8 @@ void TensorflowModel::Forward(std::shared_ptr<BatchTask> batch_task) {
 }
 
 void TensorflowModel::Postprocess(std::shared_ptr<Task> task) {
-  const QueryProto& query = task->query;
-  QueryResultProto* result = &task->result;
+  const QueryProto& query = *task->query;
+  QueryResultProto* result = task->result;
   result->set_status(CTRL_OK);
 
   if (model_name() == "ssd_vgg" || model_name() == "actdet_reid" || model_name() == "obj_det_tf") {
@@ -410,8 +413,8 @@ void TensorflowModel::Postprocess(std::shared_ptr<Task> task) {
                                     &classnames_);
         }
       } else if (type() == "detection") {
-        int im_height = task->attrs["im_height"].as<int>();
-        int im_width = task->attrs["im_width"].as<int>();
+        int im_height = task->attrs.im_height;
+        int im_width = task->attrs.im_width;
         MarshalDetectionResult(query, output, im_height, im_width, result);
       } else {
         std::ostringstream oss;
@@ -448,48 +451,19 @@ void TensorflowModel::MarshalDetectionResult(
   float* scores = output->arrays.at("detection_scores")->Data<float>();
   float* classes = output->arrays.at("detection_classes")->Data<float>();
 
-  std::vector<std::string> output_fields(query.output_field().begin(),
-                                         query.output_field().end());
-  if (output_fields.size() == 0) {
-    output_fields.push_back("rect");
-    output_fields.push_back("class_name");
-  }
+  std::vector<float> pixel_boxes(num_boxes * 4);
+  DecodeNormalizedBoxes(boxes, num_boxes, im_height, im_width,
+                        pixel_boxes.data());
+  std::vector<DetectionBox> dets;
+  dets.reserve(num_boxes);
   for (int i = 0; i < num_boxes; ++i) {
-    auto record = result->add_output();
-    int class_id = static_cast<int>(classes[i]);
-    for (auto field : output_fields) {
-      if (field == "rect") {
-        auto value = record->add_named_value();
-        value->set_name("rect");
-        value->set_data_type(DT_RECT);
-        auto rect = value->mutable_rect();
-        rect->set_top(int(im_height * boxes[i * 4]));
-        rect->set_left(int(im_width * boxes[i * 4 + 1]));
-        rect->set_bottom(int(im_height * boxes[i * 4 + 2]));
-        rect->set_right(int(im_width * boxes[i * 4 + 3]));
-      } else if (field == "score") {
-        auto value = record->add_named_value();
-        value->set_name("score");
-        value->set_data_type(DT_FLOAT);
-        value->set_f(scores[i]);
-      } else if (field == "class_id") {
-        auto value = record->add_named_value();
-        value->set_name("class_id");
-        value->set_data_type(DT_INT32);
-        value->set_i(class_id);
-      } else if (field == "class_name") {
-        auto value = record->add_named_value();
-        value->set_name("class_name");
-        value->set_data_type(DT_STRING);
-        auto iter = classnames_.find(class_id);
-        if (iter == classnames_.end()) {
-          LOG(ERROR) << "Cannot find class name for class id " << class_id;
-        } else {
-          value->set_s(iter->second);
-        }
-      }
-    }
+    const float* box = &pixel_boxes[i * 4];
+    dets.push_back({box[0], box[1], box[2], box[3], scores[i],
+                    static_cast<int>(classes[i]), i});
   }
+  NonMaxSuppression(detection_config_, &dets);
+  MarshalDetections(query, dets, {"rect", "class_name"}, &classnames_,
+                    nullptr, result);
 }
 
 void TensorflowModel::set_slice_tensor(const std::unique_ptr<tf::Tensor>& dst, const std::vector<int32_t> &src) {
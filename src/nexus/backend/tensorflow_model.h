@@ -3,6 +3,7 @@
 
 #ifdef USE_TENSORFLOW
 
+#include "nexus/backend/detection.h"
 #include "nexus/backend/model_ins.h"
 // Tensorflow headers
 #include "tensorflow/core/public/session.h"
@@ -59,6 +60,7 @@ class TensorflowModel : public ModelInstance {
   std::vector<float> input_mean_;
   std::vector<float> input_std_;
   std::unordered_map<int, std::string> classnames_;
+  DetectionConfig detection_config_;
   tf::Allocator* gpu_allocator_;
   std::vector<std::unique_ptr<tf::Tensor> > input_tensors_;
   bool first_input_array_;
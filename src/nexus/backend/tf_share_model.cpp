@@ -137,13 +137,13 @@ void TFShareModel::Forward(std::shared_ptr<BatchTask> batch_task) {
 
 void TFShareModel::Postprocess(std::shared_ptr<Task> task) {
   ModelSession model_sess;
-  ParseModelID(task->query.model_session_id(), &model_sess);
+  ParseModelID(task->query->model_session_id(), &model_sess);
   auto suffix_info_iter = tf_share_info_->suffix_models.find(model_sess.model_name());
   CHECK(suffix_info_iter != tf_share_info_->suffix_models.end());
   const auto &suffix_info = suffix_info_iter->second;
   auto &m = *tf_model_;
-  const QueryProto& query = task->query;
-  QueryResultProto* result = &task->result;
+  const QueryProto& query = *task->query;
+  QueryResultProto* result = task->result;
   result->set_status(CTRL_OK);
   for (const auto& output : task->outputs) {
     if (suffix_info.type == "classification") {
@@ -157,8 +157,8 @@ void TFShareModel::Postprocess(std::shared_ptr<Task> task) {
         PostprocessClassification(query, out_data, output_size, result, &iter->second);
       }
     } else if (suffix_info.type == "detection") {
-      int im_height = task->attrs["im_height"].as<int>();
-      int im_width = task->attrs["im_width"].as<int>();
+      int im_height = task->attrs.im_height;
+      int im_width = task->attrs.im_width;
       m.MarshalDetectionResult(query, output, im_height, im_width, result);
     } else {
       std::ostringstream oss;
@@ -1,19 +1,37 @@
+#include <algorithm>
 #include <chrono>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <pthread.h>
+#include <unordered_set>
 
 #include "nexus/backend/backend_server.h"
 #include "nexus/backend/model_ins.h"
 #include "nexus/backend/worker.h"
 
+DEFINE_int32(worker_scale_up_delay_us, 2000, "Average queueing delay in us "
+             "above which a worker pool adds a worker");
+DEFINE_int32(worker_scale_down_delay_us, 200, "Average queueing delay in us "
+             "below which a worker pool may remove a worker");
+DEFINE_double(worker_scale_down_util, 0.5, "Worker utilization below which "
+              "a worker pool may remove a worker");
+DEFINE_bool(admission_control, true, "Reject or relay tasks that are not "
+            "expected to meet their deadlines before preprocessing");
+DEFINE_int32(reply_batch_window_us, 0, "Window in us to coalesce replies to "
+             "the same frontend into one message, 0 to coalesce replies sent "
+             "within an IO loop iteration, -1 to disable coalescing");
+DEFINE_uint64(max_reply_batch, 32, "Max number of replies in one message");
+DECLARE_int32(occupancy_valid);
+
 namespace nexus {
 namespace backend {
 
 Worker::Worker(int index, BackendServer* server,
-               BlockPriorityQueue<Task>& task_queue) :
+               BlockPriorityQueue<Task>& task_queue, WorkerPool* pool) :
     index_(index),
     server_(server),
     task_queue_(task_queue),
+    pool_(pool),
     running_(false) {}
 
 void Worker::Start(int core) {
@@ -48,7 +66,17 @@ void Worker::Run() {
     if (task == nullptr) {
       continue;
     }
-    Process(task);
+    if (pool_ == nullptr) {
+      Process(std::move(task));
+      continue;
+    }
+    auto beg = Clock::now();
+    auto queue_delay = std::chrono::duration_cast<std::chrono::microseconds>(
+        beg - task->enqueue_time);
+    Process(std::move(task));
+    auto busy = std::chrono::duration_cast<std::chrono::microseconds>(
+        Clock::now() - beg);
+    pool_->RecordTask(queue_delay.count(), busy.count());
   }
   LOG(INFO) << "Worker " << index_ << " stopped";
 }
@@ -56,37 +84,49 @@ void Worker::Run() {
 void Worker::Process(std::shared_ptr<Task> task) {
   switch (task->stage) {
     case kPreprocess: {
-      task->model = server_->GetModel(task->query.model_session_id());
+      if (server_->TakeCancelledQuery(task->connection,
+                                      task->query->query_id())) {
+        // Cancelled while queued. The cancel wasn't acknowledged for this
+        // task, so the frontend still expects a reply.
+        task->result->set_status(CANCELLED);
+        SendReply(std::move(task));
+        break;
+      }
+      // Queries with a handle are resolved when decoded
+      if (task->model == nullptr &&
+          task->query->model_session_handle() == 0) {
+        task->model = server_->GetModel(task->query->model_session_id());
+      }
       if (task->model == nullptr) {
         std::stringstream ss;
-        ss << "Model session is not loaded: " << task->query.model_session_id();
-        task->result.set_status(MODEL_SESSION_NOT_LOADED);
+        ss << "Model session is not loaded: " << task->query->model_session_id();
+        task->result->set_status(MODEL_SESSION_NOT_LOADED);
         SendReply(std::move(task));
         break;
       }
+#ifdef USE_GPU
+      // Reject or relay the task before preprocessing if it is not expected
+      // to meet its deadline here
+      if (FLAGS_admission_control &&
+          !task->model->CanMeetDeadline(task, server_->duty_cycle_us())) {
+        // Relayed tasks are not relayed again
+        if (task->msg_type == kBackendRelay || !RelayToBackup(task)) {
+          task->model->RecordRejectedTask(task);
+          task->result->set_status(TIMEOUT);
+          task->result->set_error_message(
+              "Rejected by admission control: cannot meet the deadline");
+          SendReply(std::move(task));
+        }
+        break;
+      }
+#endif
       // Preprocess task
       if (!task->model->Preprocess(task)) {
-        if (task->result.status() != CTRL_OK) {
+        if (task->result->status() != CTRL_OK) {
           SendReply(std::move(task));
         } else {
           // Relay to the request to backup servers
-          std::vector<uint32_t> backups = task->model->BackupBackends();
-          double min_util = 1.;
-          std::shared_ptr<BackupClient> best_backup = nullptr;
-          for (auto backend_id : backups) {
-            auto backup = server_->GetBackupClient(backend_id);
-            double util = backup->GetUtilization();
-            if (util < min_util) {
-              min_util = util;
-              best_backup = backup;
-            }
-          }
-          if (best_backup != nullptr) {
-            // LOG(INFO) << "Relay request " << task->query.model_session_id() <<
-            //     " to backup " << best_backup->node_id() <<
-            //     " with utilization " << min_util;
-            best_backup->Forward(std::move(task));
-          } else {
+          if (!RelayToBackup(task)) {
             LOG(INFO) << "All backup servers are full";
             task->model->Preprocess(task, true);
           }
@@ -95,11 +135,17 @@ void Worker::Process(std::shared_ptr<Task> task) {
       break;
     }
     case kPostprocess: {
-      if (task->result.status() != CTRL_OK) {
+      if (task->result->status() == CANCELLED) {
+        // Frontend has been acknowledged that no reply will be sent
+        task->ReleaseResources();
+      } else if (task->result->status() != CTRL_OK) {
         SendReply(std::move(task));
       } else {
         task->model->Postprocess(task);
-        SendReply(std::move(task));
+        if (task->query->chain_size() == 0 || task->result->status() != CTRL_OK ||
+            !ChainNextStage(task)) {
+          SendReply(std::move(task));
+        }
       }
       break;
     }
@@ -108,25 +154,248 @@ void Worker::Process(std::shared_ptr<Task> task) {
   }
 }
 
+bool Worker::RelayToBackup(std::shared_ptr<Task> task) {
+  std::vector<uint32_t> backups = task->model->BackupBackends();
+  double min_util = 1.;
+  std::shared_ptr<BackupClient> best_backup = nullptr;
+  for (auto backend_id : backups) {
+    auto backup = server_->GetBackupClient(backend_id);
+    if (backup == nullptr) {
+      continue;
+    }
+    double util = backup->GetUtilization();
+    if (util >= 0 && util < min_util) {
+      min_util = util;
+      best_backup = backup;
+    }
+  }
+  if (best_backup == nullptr) {
+    return false;
+  }
+  // LOG(INFO) << "Relay request " << task->query->model_session_id() <<
+  //     " to backup " << best_backup->node_id() <<
+  //     " with utilization " << min_util;
+  return best_backup->Forward(std::move(task));
+}
+
+bool Worker::ChainNextStage(std::shared_ptr<Task> task) {
+  const auto& stage = task->query->chain(0);
+  auto model = server_->FindModel(stage.model_session_id(),
+                                  stage.model_session_handle());
+  if (model == nullptr) {
+    // Frontend runs the rest of the chain from this result
+    return false;
+  }
+  std::unordered_set<std::string> classes(stage.class_name().begin(),
+                                          stage.class_name().end());
+  auto next = server_->AcquireChainTask(task->connection);
+  auto query = next->query;
+  for (auto& record : task->result->output()) {
+    const RectProto* rect = nullptr;
+    bool selected = classes.empty();
+    for (auto& value : record.named_value()) {
+      if (value.name() == "rect") {
+        rect = &value.rect();
+      } else if (value.name() == "class_name" && !selected) {
+        selected = classes.count(value.s()) > 0;
+      }
+    }
+    if (rect != nullptr && selected) {
+      query->add_window()->CopyFrom(*rect);
+    }
+  }
+  uint32_t depth = task->chain_depth + 1;
+  if (query->window_size() == 0) {
+    // No boxes for the rest of the chain, reply an empty result
+    task->result->clear_output();
+    task->chain_depth += task->query->chain_size();
+    SendReply(std::move(task));
+    return true;
+  }
+  query->set_query_id(task->query->query_id());
+  query->set_model_session_id(stage.model_session_id());
+  query->mutable_input()->CopyFrom(task->query->input());
+  query->set_topk(stage.topk());
+  for (auto& field : stage.output_field()) {
+    query->add_output_field(field);
+  }
+  for (int i = 1; i < task->query->chain_size(); ++i) {
+    query->add_chain()->CopyFrom(task->query->chain(i));
+  }
+  next->model = model;
+  next->msg_type = task->msg_type;
+  next->relay_id = task->relay_id;
+  next->chain_origin = task->chain_origin.empty() ?
+                       task->query->model_session_id() : task->chain_origin;
+  next->chain_depth = depth;
+  // The rest of the chain shares the deadline of the original query, which
+  // also bounds the stage if it is relayed to a backup
+  next->SetDeadline(task->deadline());
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      task->deadline() - Clock::now()).count();
+  query->set_deadline_ms(uint32_t(std::max<int64_t>(remaining, 1)));
+  query->set_slack_ms(task->query->slack_ms());
+  query->set_priority(task->query->priority());
+  next->SetPriority(task->priority());
+  task->ReleaseResources();
+  // Preprocessing is left to the preprocess workers, which keeps this
+  // postprocess worker free for other tasks
+  server_->EnqueueTask(std::move(next));
+  return true;
+}
+
 void Worker::SendReply(std::shared_ptr<Task> task) {
   task->timer.Record("end");
-  task->result.set_query_id(task->query.query_id());
-  task->result.set_model_session_id(task->query.model_session_id());
-  task->result.set_latency_us(task->timer.GetLatencyMicros("begin", "end"));
-  task->result.set_queuing_us(task->timer.GetLatencyMicros("begin", "exec"));
+  task->result->set_query_id(task->query->query_id());
+  // Chained stages reply as the query sent by frontend
+  if (!task->chain_origin.empty()) {
+    task->result->set_model_session_id(task->chain_origin);
+  } else if (task->query->model_session_handle() > 0) {
+    // Frontend routes the reply by handle
+    task->result->set_model_session_handle(
+        task->query->model_session_handle());
+  } else {
+    task->result->set_model_session_id(task->query->model_session_id());
+  }
+  task->result->set_chain_stages(task->chain_depth);
+  task->result->set_latency_us(task->timer.GetLatencyMicros("begin", "end"));
+  task->result->set_queuing_us(task->timer.GetLatencyMicros("begin", "exec"));
   if (task->model != nullptr && task->model->backup()) {
-    task->result.set_use_backup(true);
+    task->result->set_use_backup(true);
   } else {
-    task->result.set_use_backup(false);
+    task->result->set_use_backup(false);
   }
-  MessageType reply_type = kBackendReply;
+  std::shared_ptr<Message> msg;
   if (task->msg_type == kBackendRelay) {
-    reply_type = kBackendRelayReply;
+    // Piggyback utilization so that the relaying backend needn't poll it
+    RelayHeader header;
+    header.relay_id = task->relay_id;
+    header.utilization = 0.;
+    header.valid_ms = 0;
+#ifdef USE_GPU
+    header.utilization = server_->CurrentUtilization();
+    header.valid_ms = FLAGS_occupancy_valid;
+#endif
+    msg = std::make_shared<Message>(
+        kBackendRelayReply, RELAY_HEADER_SIZE + task->result->ByteSizeLong());
+    msg->EncodeRelayHeader(header);
+    msg->EncodeBody(*task->result, RELAY_HEADER_SIZE);
+  } else {
+    msg = std::make_shared<Message>(kBackendReply,
+                                    task->result->ByteSizeLong());
+    msg->EncodeBody(*task->result);
+  }
+  if (task->msg_type == kBackendRelay || FLAGS_reply_batch_window_us < 0) {
+    task->connection->Write(std::move(msg));
+  } else {
+    task->connection->WriteCoalesced(std::move(msg), kBackendReplyBatch,
+                                     FLAGS_reply_batch_window_us,
+                                     FLAGS_max_reply_batch);
+  }
+  task->ReleaseResources();
+}
+
+WorkerPool::WorkerPool(const std::string& name, BackendServer* server,
+                       BlockPriorityQueue<Task>& task_queue,
+                       size_t min_workers, size_t max_workers,
+                       std::vector<int> cores) :
+    name_(name),
+    server_(server),
+    task_queue_(task_queue),
+    min_workers_(std::max(min_workers, size_t(1))),
+    max_workers_(std::max(max_workers, min_workers)),
+    cores_(cores),
+    next_index_(0),
+    num_tasks_(0),
+    queue_delay_us_(0),
+    busy_us_(0) {}
+
+void WorkerPool::Start(size_t num_workers) {
+  num_workers = std::min(std::max(num_workers, min_workers_), max_workers_);
+  for (size_t i = 0; i < num_workers; ++i) {
+    AddWorker();
+  }
+  last_scale_time_ = Clock::now();
+  LOG(INFO) << "Start " << name_ << " worker pool with " << num_workers <<
+      " workers (min " << min_workers_ << ", max " << max_workers_ << ")";
+}
+
+void WorkerPool::Stop() {
+  std::lock_guard<std::mutex> lock(workers_mu_);
+  for (auto& worker : workers_) {
+    worker->Stop();
+  }
+  workers_.clear();
+}
+
+void WorkerPool::Scale() {
+  auto now = Clock::now();
+  double elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      now - last_scale_time_).count();
+  last_scale_time_ = now;
+  uint64_t num_tasks = num_tasks_.exchange(0);
+  uint64_t queue_delay_us = queue_delay_us_.exchange(0);
+  uint64_t busy_us = busy_us_.exchange(0);
+  size_t nworkers = num_workers();
+  if (elapsed_us <= 0 || nworkers == 0) {
+    return;
+  }
+  double avg_delay_us = (num_tasks == 0) ? 0. :
+                        static_cast<double>(queue_delay_us) / num_tasks;
+  double util = busy_us / (elapsed_us * nworkers);
+  // Tasks still waiting in the queue haven't reported their delay yet
+  size_t backlog = task_queue_.size();
+  if ((avg_delay_us > FLAGS_worker_scale_up_delay_us || backlog > nworkers) &&
+      nworkers < max_workers_) {
+    AddWorker();
+    LOG(INFO) << "Scale up " << name_ << " workers to " << nworkers + 1 <<
+        ": avg queue delay " << avg_delay_us << " us, utilization " << util <<
+        ", backlog " << backlog;
+  } else if (avg_delay_us < FLAGS_worker_scale_down_delay_us &&
+             util < FLAGS_worker_scale_down_util && backlog == 0 &&
+             nworkers > min_workers_) {
+    auto worker = RemoveWorker();
+    if (worker != nullptr) {
+      // Joins the worker thread outside the lock
+      worker->Stop();
+      LOG(INFO) << "Scale down " << name_ << " workers to " << nworkers - 1 <<
+          ": avg queue delay " << avg_delay_us << " us, utilization " << util;
+    }
+  }
+}
+
+size_t WorkerPool::num_workers() {
+  std::lock_guard<std::mutex> lock(workers_mu_);
+  return workers_.size();
+}
+
+void WorkerPool::RecordTask(uint64_t queue_delay_us, uint64_t busy_us) {
+  num_tasks_.fetch_add(1, std::memory_order_relaxed);
+  queue_delay_us_.fetch_add(queue_delay_us, std::memory_order_relaxed);
+  busy_us_.fetch_add(busy_us, std::memory_order_relaxed);
+}
+
+void WorkerPool::AddWorker() {
+  int index = next_index_++;
+  std::unique_ptr<Worker> worker(new Worker(index, server_, task_queue_,
+                                            this));
+  if (cores_.empty()) {
+    worker->Start();
+  } else {
+    worker->Start(cores_[index % cores_.size()]);
+  }
+  std::lock_guard<std::mutex> lock(workers_mu_);
+  workers_.push_back(std::move(worker));
+}
+
+std::unique_ptr<Worker> WorkerPool::RemoveWorker() {
+  std::lock_guard<std::mutex> lock(workers_mu_);
+  if (workers_.size() <= min_workers_) {
+    return nullptr;
   }
-  auto msg = std::make_shared<Message>(reply_type,
-                                       task->result.ByteSizeLong());
-  msg->EncodeBody(task->result);
-  task->connection->Write(std::move(msg));
+  std::unique_ptr<Worker> worker = std::move(workers_.back());
+  workers_.pop_back();
+  return worker;
 }
 
 } // namespace backend
@@ -1,9 +1,12 @@
 #ifndef NEXUS_BACKEND_WORKER_H_
 #define NEXUS_BACKEND_WORKER_H_
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "nexus/common/block_queue.h"
 #include "nexus/backend/task.h"
@@ -12,11 +15,12 @@ namespace nexus {
 namespace backend {
 
 class BackendServer;
+class WorkerPool;
 
 class Worker {
  public:
   Worker(int index, BackendServer* server,
-         BlockPriorityQueue<Task>& task_queue);
+         BlockPriorityQueue<Task>& task_queue, WorkerPool* pool = nullptr);
 
   void Start(int core = -1);
 
@@ -27,16 +31,97 @@ class Worker {
  private:
   void Process(std::shared_ptr<Task> task);
 
+  /*!
+   * \brief Relays the task to the least utilized backup backend.
+   * \param task Task to relay
+   * \return Whether the task is relayed, false if all backups are full
+   */
+  bool RelayToBackup(std::shared_ptr<Task> task);
+  /*!
+   * \brief Runs the next chained stage of the query on the boxes detected by
+   *   task, if the stage's model is served by this backend.
+   * \param task Finished task
+   * \return Whether the next stage takes over replying to the query
+   */
+  bool ChainNextStage(std::shared_ptr<Task> task);
+
   void SendReply(std::shared_ptr<Task> task);
 
  private:
   int index_;
   BackendServer* server_;
   BlockPriorityQueue<Task>& task_queue_;
+  /*! \brief Pool that the worker reports its stats to, can be nullptr */
+  WorkerPool* pool_;
   volatile bool running_;
   std::thread thread_;
 };
 
+/*!
+ * \brief WorkerPool runs a group of workers that serve the same task queue.
+ *   It grows or shrinks the group within bounds, based on the queueing delay
+ *   and busy time that its workers measured since the last scaling decision.
+ */
+class WorkerPool {
+ public:
+  /*!
+   * \brief Constructs a worker pool.
+   * \param name Name of the pool used in logs
+   * \param server Backend server
+   * \param task_queue Task queue that workers pop tasks from
+   * \param min_workers Min number of workers
+   * \param max_workers Max number of workers
+   * \param cores Cores to pin workers to, empty for no pinning
+   */
+  WorkerPool(const std::string& name, BackendServer* server,
+             BlockPriorityQueue<Task>& task_queue, size_t min_workers,
+             size_t max_workers, std::vector<int> cores = {});
+  /*!
+   * \brief Starts the pool.
+   * \param num_workers Initial number of workers
+   */
+  void Start(size_t num_workers);
+  /*! \brief Stops all workers. */
+  void Stop();
+  /*!
+   * \brief Adds or removes at most one worker according to the stats since
+   *   the last call. Should be called periodically from a single thread.
+   */
+  void Scale();
+  /*! \brief Gets the current number of workers. */
+  size_t num_workers();
+  /*!
+   * \brief Records stats of a processed task.
+   * \param queue_delay_us Time the task waited in the queue
+   * \param busy_us Time the worker spent processing the task
+   */
+  void RecordTask(uint64_t queue_delay_us, uint64_t busy_us);
+
+ private:
+  void AddWorker();
+
+  std::unique_ptr<Worker> RemoveWorker();
+
+  std::string name_;
+  BackendServer* server_;
+  BlockPriorityQueue<Task>& task_queue_;
+  size_t min_workers_;
+  size_t max_workers_;
+  std::vector<int> cores_;
+  /*! \brief Index of next worker */
+  int next_index_;
+  /*! \brief Workers in the pool. Guarded by workers_mu_. */
+  std::vector<std::unique_ptr<Worker> > workers_;
+  std::mutex workers_mu_;
+  /*! \brief Number of tasks processed since last scaling */
+  std::atomic<uint64_t> num_tasks_;
+  /*! \brief Total queueing delay since last scaling */
+  std::atomic<uint64_t> queue_delay_us_;
+  /*! \brief Total busy time of workers since last scaling */
+  std::atomic<uint64_t> busy_us_;
+  TimePoint last_scale_time_;
+};
+
 } // namespace backend
 } // namespace nexus
 
@@ -16,7 +16,9 @@ BackendSession::BackendSession(const BackendInfo& info,
     server_port_(info.server_port()),
     rpc_port_(info.rpc_port()),
     running_(false),
-    utilization_(-1.) {
+    utilization_(-1.),
+    util_expire_(0),
+    util_requested_(false) {
   std::stringstream rpc_addr;
   rpc_addr << ip_ << ":" << rpc_port_;
   auto channel = grpc::CreateChannel(rpc_addr.str(),
@@ -62,24 +64,43 @@ void BackendSession::DoConnect() {
 }
 
 double BackendSession::GetUtilization() {
-  std::lock_guard<std::mutex> lock(util_mu_);
-  if (utilization_ >= 0 && Clock::now() <= expire_) {
-    return utilization_;
+  if (Clock::now().time_since_epoch().count() > util_expire_.load()) {
+    util_requested_ = true;
   }
+  return utilization_.load();
+}
+
+void BackendSession::UpdateUtilization(double utilization,
+                                       uint32_t valid_ms) {
+  auto expire = Clock::now() + std::chrono::milliseconds(valid_ms);
+  utilization_ = utilization;
+  util_expire_ = expire.time_since_epoch().count();
+}
+
+void BackendSession::RefreshUtilization(
+    std::chrono::system_clock::time_point deadline) {
+  if (!util_requested_.load() ||
+      Clock::now().time_since_epoch().count() <= util_expire_.load()) {
+    util_requested_ = false;
+    return;
+  }
+  if (std::chrono::system_clock::now() >= deadline) {
+    // Out of time this round, leave the request pending for the next one
+    return;
+  }
+  util_requested_ = false;
   UtilizationRequest request;
   UtilizationReply reply;
   request.set_node_id(node_id_);
   grpc::ClientContext ctx;
+  ctx.set_deadline(deadline);
   grpc::Status status = stub_->CurrentUtilization(&ctx, request, &reply);
   if (!status.ok()) {
     LOG(ERROR) << status.error_code() << ": " << status.error_message();
     utilization_ = -1.;
-    return -1.;
+    return;
   }
-  utilization_ = reply.utilization();
-  expire_ = Clock::now() + std::chrono::milliseconds(reply.valid_ms());
-  //LOG(INFO) << "Backup " << node_id_ << " utilization " << utilization_;
-  return utilization_;
+  UpdateUtilization(reply.utilization(), reply.valid_ms());
 }
 
 std::shared_ptr<BackendSession> BackendPool::GetBackend(uint32_t backend_id) {
@@ -147,4 +168,18 @@ void BackendPool::StopAll() {
   backends_.clear();
 }
 
+void BackendPool::RefreshUtilization(std::chrono::milliseconds timeout) {
+  auto deadline = std::chrono::system_clock::now() + timeout;
+  std::vector<std::shared_ptr<BackendSession> > backends;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto iter : backends_) {
+      backends.push_back(iter.second);
+    }
+  }
+  for (auto backend : backends) {
+    backend->RefreshUtilization(deadline);
+  }
+}
+
 } // namespace nexus
@@ -1,6 +1,7 @@
 #ifndef NEXUS_COMMON_BACKEND_POOL_H_
 #define NEXUS_COMMON_BACKEND_POOL_H_
 
+#include <atomic>
 #include <sstream>
 #include <unordered_map>
 
@@ -32,7 +33,24 @@ class BackendSession : public Connection {
 
   virtual void Stop();
 
+  /*!
+   * \brief Returns the last known utilization of the backend without
+   * blocking.
+   *
+   * The cache is filled by utilization piggybacked on relay replies and by
+   * RefreshUtilization. A stale cache marks the backend for refresh.
+   * \return Utilization, or -1 if unknown
+   */
   double GetUtilization();
+  /*! \brief Updates the cached utilization, valid for valid_ms. */
+  void UpdateUtilization(double utilization, uint32_t valid_ms);
+  /*!
+   * \brief Queries utilization by RPC if it was requested while the cache is
+   * stale. Blocks until at most deadline, so must not be called on the
+   * request path.
+   * \param deadline Deadline of the RPC
+   */
+  void RefreshUtilization(std::chrono::system_clock::time_point deadline);
 
  protected:
   /*! \brief Asynchronously connect to backend server. */
@@ -46,9 +64,12 @@ class BackendSession : public Connection {
   std::string rpc_port_;
   std::atomic_bool running_;
   std::unique_ptr<BackendCtrl::Stub> stub_;
-  double utilization_;
-  TimePoint expire_;
-  std::mutex util_mu_;
+  /*! \brief Cached utilization, -1 when unknown */
+  std::atomic<double> utilization_;
+  /*! \brief Expire time of the cached utilization in clock ticks */
+  std::atomic<int64_t> util_expire_;
+  /*! \brief Whether utilization was requested while the cache is stale */
+  std::atomic_bool util_requested_;
 };
 
 class BackendPool {
@@ -66,6 +87,11 @@ class BackendPool {
   std::vector<uint32_t> UpdateBackendList(std::unordered_set<uint32_t> list);
 
   void StopAll();
+  /*!
+   * \brief Refreshes stale utilization of all backends by RPC. Backends not
+   * reached within timeout are refreshed on the next call.
+   */
+  void RefreshUtilization(std::chrono::milliseconds timeout);
 
  protected:
   std::unordered_map<uint32_t, std::shared_ptr<BackendSession> > backends_;
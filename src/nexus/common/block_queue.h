@@ -25,7 +25,7 @@ class BlockQueue {
   bool push(std::shared_ptr<T> item) {
     std::unique_lock<std::mutex> lock(mutex_);
     not_full_.wait(lock, [this](){
-        return max_size_ == 0 || queue_.size() >= max_size_; });
+        return max_size_ == 0 || queue_.size() < max_size_; });
     queue_.push(std::move(item));
     lock.unlock();
     not_empty_.notify_one();
@@ -35,7 +35,7 @@ class BlockQueue {
   bool push(std::shared_ptr<T> item, const std::chrono::microseconds& timeout) {
     std::unique_lock<std::mutex> lock(mutex_);
     if (!not_full_.wait_for(lock, timeout, [this](){
-          return max_size_ == 0 || queue_.size() >= max_size_; })) {
+          return max_size_ == 0 || queue_.size() < max_size_; })) {
       return false;
     }
     queue_.push(std::move(item));
@@ -77,12 +77,13 @@ class BlockQueue {
 
 class DeadlineItem {
  public:
-  DeadlineItem() {
+  DeadlineItem() : priority_(0) {
     begin_ = Clock::now();
   }
   
-  DeadlineItem(TimePoint deadline) :
-      deadline_(deadline) {}
+  DeadlineItem(TimePoint deadline, uint32_t priority = 0) :
+      deadline_(deadline),
+      priority_(priority) {}
   
   void SetDeadline(std::chrono::milliseconds time_budget) {
     deadline_ = begin_ + time_budget;
@@ -91,18 +92,34 @@ class DeadlineItem {
   void SetDeadline(std::chrono::microseconds time_budget) {
     deadline_ = begin_ + time_budget;
   }
+  /*! \brief Sets an absolute deadline, e.g. one inherited from another item */
+  void SetDeadline(TimePoint deadline) {
+    deadline_ = deadline;
+  }
 
   TimePoint deadline() const { return deadline_; }
+  /*! \brief Priority class, 0 is the highest */
+  uint32_t priority() const { return priority_; }
+
+  void SetPriority(uint32_t priority) { priority_ = priority; }
 
  protected:
   TimePoint begin_;
   TimePoint deadline_;
+  uint32_t priority_;
 };
 
+/*!
+ * \brief Orders items by priority class first, and by deadline within a class,
+ *   so that lower classes wait, and expire first, under overload.
+ */
 class CompareDeadlineItem {
  public:
   bool operator()(std::shared_ptr<DeadlineItem> lhs,
                   std::shared_ptr<DeadlineItem> rhs) {
+    if (lhs->priority() != rhs->priority()) {
+      return lhs->priority() > rhs->priority();
+    }
     return lhs->deadline() > rhs->deadline();
   }
 };
@@ -122,7 +139,7 @@ class BlockPriorityQueue {
   bool push(std::shared_ptr<T> item) {
     std::unique_lock<std::mutex> lock(mutex_);
     not_full_.wait(lock, [this](){
-        return max_size_ == 0 || queue_.size() >= max_size_; });
+        return max_size_ == 0 || queue_.size() < max_size_; });
     queue_.push(std::move(item));
     lock.unlock();
     not_empty_.notify_one();
@@ -132,7 +149,7 @@ class BlockPriorityQueue {
   bool push(std::shared_ptr<T> item, const std::chrono::microseconds& timeout) {
     std::unique_lock<std::mutex> lock(mutex_);
     if (!not_full_.wait_for(lock, timeout, [this](){
-          return max_size_ == 0 || queue_.size() >= max_size_; })) {
+          return max_size_ == 0 || queue_.size() < max_size_; })) {
       return false;
     }
     queue_.push(std::move(item));
@@ -141,6 +158,26 @@ class BlockPriorityQueue {
     return true;
   }
 
+  /*!
+   * \brief Pushes a batch of items under one lock acquisition. Waits until the
+   *   queue has room, then pushes the whole batch.
+   */
+  bool push(std::vector<std::shared_ptr<T> > items) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this](){
+        return max_size_ == 0 || queue_.size() < max_size_; });
+    for (auto& item : items) {
+      queue_.push(std::move(item));
+    }
+    lock.unlock();
+    if (items.size() == 1) {
+      not_empty_.notify_one();
+    } else {
+      not_empty_.notify_all();
+    }
+    return true;
+  }
+
   std::shared_ptr<T> pop() {
     std::unique_lock<std::mutex> lock(mutex_);
     not_empty_.wait(lock, [this](){ return queue_.size() != 0; });
@@ -8,7 +8,8 @@ Connection::Connection(boost::asio::ip::tcp::socket socket,
                        MessageHandler* handler) :
     socket_(std::move(socket)),
     handler_(handler),
-    wrong_header_(false) {
+    wrong_header_(false),
+    coalesce_timer_(socket_.get_executor()) {
   boost::asio::ip::tcp::no_delay option(true);
   socket_.set_option(option);
 }
@@ -17,7 +18,8 @@ Connection::Connection(boost::asio::io_service& io_context,
                        MessageHandler* handler) :
     socket_(io_context),
     handler_(handler),
-    wrong_header_(false) {
+    wrong_header_(false),
+    coalesce_timer_(io_context) {
 }
 
 void Connection::Start() {
@@ -39,6 +41,64 @@ void Connection::Write(std::shared_ptr<Message> msg) {
   }
 }
 
+void Connection::WriteCoalesced(std::shared_ptr<Message> msg,
+                                MessageType batch_type, uint32_t window_us,
+                                size_t max_batch) {
+  std::lock_guard<std::mutex> lock(coalesce_mutex_);
+  if (!coalesce_queue_.empty() && coalesce_type_ != batch_type) {
+    // Messages of different batch types are not coalesced together
+    WriteBatch(std::move(coalesce_queue_), coalesce_type_);
+    coalesce_queue_.clear();
+  }
+  coalesce_type_ = batch_type;
+  coalesce_queue_.push_back(std::move(msg));
+  if (coalesce_queue_.size() >= max_batch) {
+    WriteBatch(std::move(coalesce_queue_), batch_type);
+    coalesce_queue_.clear();
+  } else if (coalesce_queue_.size() == 1) {
+    auto self(shared_from_this());
+    if (window_us == 0) {
+      boost::asio::post(socket_.get_executor(),
+                        [this, self]() { FlushCoalesced(); });
+    } else {
+      coalesce_timer_.expires_after(std::chrono::microseconds(window_us));
+      coalesce_timer_.async_wait([this, self](boost::system::error_code ec) {
+          if (ec != boost::asio::error::operation_aborted) {
+            FlushCoalesced();
+          }
+        });
+    }
+  }
+}
+
+void Connection::WriteInOrder(std::shared_ptr<Message> msg) {
+  std::lock_guard<std::mutex> lock(coalesce_mutex_);
+  if (!coalesce_queue_.empty()) {
+    WriteBatch(std::move(coalesce_queue_), coalesce_type_);
+    coalesce_queue_.clear();
+  }
+  Write(std::move(msg));
+}
+
+void Connection::FlushCoalesced() {
+  // Write the batch under the lock so that a later coalesced or in-order
+  // write cannot overtake it
+  std::lock_guard<std::mutex> lock(coalesce_mutex_);
+  if (!coalesce_queue_.empty()) {
+    WriteBatch(std::move(coalesce_queue_), coalesce_type_);
+    coalesce_queue_.clear();
+  }
+}
+
+void Connection::WriteBatch(std::vector<std::shared_ptr<Message> > messages,
+                            MessageType batch_type) {
+  if (messages.size() == 1) {
+    Write(std::move(messages[0]));
+  } else {
+    Write(MergeMessages(batch_type, messages));
+  }
+}
+
 void Connection::DoReadHeader() {
   auto self(shared_from_this());
   std::lock_guard<std::mutex> socket_guard(socket_mutex_);
@@ -5,6 +5,7 @@
 #include <deque>
 #include <memory>
 #include <mutex>
+#include <vector>
 
 #include "nexus/common/message.h"
 
@@ -47,6 +48,23 @@ class Connection : public std::enable_shared_from_this<Connection> {
    * \param msg Shared pointer of message, yield the ownership to the function
    */
   virtual void Write(std::shared_ptr<Message> msg);
+  /*!
+   * \brief sends a message, coalescing it with messages written to the
+   *   connection within a time window into one batch message
+   * \param msg Shared pointer of message, yield the ownership to the function
+   * \param batch_type Type of the batch message
+   * \param window_us Coalescing window in us. If 0, messages written before
+   *   the IO thread gets to flush them are coalesced.
+   * \param max_batch Max number of messages in a batch
+   */
+  void WriteCoalesced(std::shared_ptr<Message> msg, MessageType batch_type,
+                      uint32_t window_us, size_t max_batch);
+  /*!
+   * \brief sends a message right away, after the messages still waiting to be
+   *   coalesced so that it doesn't overtake them
+   * \param msg Shared pointer of message, yield the ownership to the function
+   */
+  void WriteInOrder(std::shared_ptr<Message> msg);
 
  protected:
   Connection(boost::asio::io_service& io_context, MessageHandler* handler);
@@ -56,6 +74,11 @@ class Connection : public std::enable_shared_from_this<Connection> {
   void DoReadBody(std::shared_ptr<Message> msg);
   /*! \brief sends the message to the peer */
   void DoWrite();
+  /*! \brief sends the coalesced messages */
+  void FlushCoalesced();
+  /*! \brief sends messages as one batch message of batch_type */
+  void WriteBatch(std::vector<std::shared_ptr<Message> > messages,
+                  MessageType batch_type);
 
  protected:
   /*! \brief Socket */
@@ -72,6 +95,14 @@ class Connection : public std::enable_shared_from_this<Connection> {
   std::deque<std::shared_ptr<Message> > write_queue_;
   /*! \brief Mutex for write_queue_ */
   std::mutex write_queue_mutex_;
+  /*! \brief Messages waiting to be coalesced. Guarded by coalesce_mutex_. */
+  std::vector<std::shared_ptr<Message> > coalesce_queue_;
+  /*! \brief Batch type of coalesce_queue_. Guarded by coalesce_mutex_. */
+  MessageType coalesce_type_;
+  /*! \brief Timer that ends the coalescing window */
+  boost::asio::steady_timer coalesce_timer_;
+  /*! \brief Mutex for coalesce_queue_ and coalesce_timer_ */
+  std::mutex coalesce_mutex_;
 };
 
 } // namespace nexus
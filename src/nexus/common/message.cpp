@@ -1,5 +1,6 @@
 #include <cstring>
 #include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
 
 #include "nexus/common/message.h"
 
@@ -15,6 +16,9 @@ namespace nexus {
    ((uint64_t) ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((uint64_t)(x) >> 32))
 #endif
 
+/*! \brief Tag of field 1 with length-delimited wire type */
+static const uint32_t kBatchEntryTag = (1 << 3) | 2;
+
 bool DecodeHeader(const char* buffer, MessageHeader* header) {
   header->magic_number = ntohl(*(const uint32_t*) buffer);
   if (header->magic_number != NEXUS_SERVICE_MAGIC_NUMBER) {
@@ -28,23 +32,21 @@ bool DecodeHeader(const char* buffer, MessageHeader* header) {
 Message::Message(const MessageHeader& header) {
   type_ = static_cast<MessageType>(header.msg_type);
   body_length_ = header.body_length;
-  data_ = new char[MESSAGE_HEADER_SIZE + body_length_];
-  *((uint32_t*) data_) = htonl(NEXUS_SERVICE_MAGIC_NUMBER);
-  *((uint32_t*) (data_ + 4)) = htonl((uint32_t) type_);
-  *((uint32_t*) (data_ + 8)) = htonl(body_length_);
+  buffer_ = new char[RELAY_HEADER_SIZE + MESSAGE_HEADER_SIZE + body_length_];
+  data_ = buffer_ + RELAY_HEADER_SIZE;
+  EncodeHeader();
 }
 
 Message::Message(MessageType type, size_t body_length) :
     type_(type),
     body_length_(body_length) {
-  data_ = new char[MESSAGE_HEADER_SIZE + body_length];
-  *((uint32_t*) data_) = htonl(NEXUS_SERVICE_MAGIC_NUMBER);
-  *((uint32_t*) (data_ + 4)) = htonl((uint32_t) type);
-  *((uint32_t*) (data_ + 8)) = htonl(body_length_);
+  buffer_ = new char[MESSAGE_HEADER_SIZE + body_length];
+  data_ = buffer_;
+  EncodeHeader();
 }
 
 Message::~Message() {
-  delete[] data_;
+  delete[] buffer_;
 }
 
 void Message::set_type(MessageType type) {
@@ -52,14 +54,102 @@ void Message::set_type(MessageType type) {
   *((uint32_t*) (data_ + 4)) = htonl((uint32_t) type);
 }
 
-void Message::DecodeBody(google::protobuf::Message* message) const {
-  message->ParseFromArray(body(), body_length_);
+void Message::DecodeBody(google::protobuf::Message* message,
+                         size_t offset) const {
+  message->ParseFromArray(body() + offset, body_length_ - offset);
 }
 
-void Message::EncodeBody(const google::protobuf::Message& message) {
-  CHECK_GE(body_length_, message.ByteSizeLong()) << "Buffer is too small to "
-      "store the message";
-  message.SerializeToArray(body(), body_length_);
+void Message::EncodeBody(const google::protobuf::Message& message,
+                         size_t offset) {
+  CHECK_GE(body_length_, offset + message.ByteSizeLong()) << "Buffer is too "
+      "small to store the message";
+  message.SerializeToArray(body() + offset, body_length_ - offset);
+}
+
+void Message::EncodeRelayHeader(const RelayHeader& header) {
+  CHECK_GE(body_length_, RELAY_HEADER_SIZE) << "Buffer is too small to "
+      "store the relay header";
+  char* buf = body();
+  *((uint32_t*) buf) = htonl((uint32_t) (header.relay_id >> 32));
+  *((uint32_t*) (buf + 4)) = htonl((uint32_t) header.relay_id);
+  uint32_t util;
+  std::memcpy(&util, &header.utilization, sizeof(util));
+  *((uint32_t*) (buf + 8)) = htonl(util);
+  *((uint32_t*) (buf + 12)) = htonl(header.valid_ms);
+}
+
+void Message::DecodeRelayHeader(RelayHeader* header) const {
+  CHECK_GE(body_length_, RELAY_HEADER_SIZE) << "Message has no relay header";
+  const char* buf = body();
+  header->relay_id = ((uint64_t) ntohl(*(const uint32_t*) buf) << 32) |
+                     ntohl(*(const uint32_t*) (buf + 4));
+  uint32_t util = ntohl(*(const uint32_t*) (buf + 8));
+  std::memcpy(&header->utilization, &util, sizeof(util));
+  header->valid_ms = ntohl(*(const uint32_t*) (buf + 12));
+}
+
+void Message::PushRelayHeader(MessageType type, const RelayHeader& header) {
+  CHECK_GE(data_ - buffer_, (std::ptrdiff_t) RELAY_HEADER_SIZE) <<
+      "No room for the relay header";
+  data_ -= RELAY_HEADER_SIZE;
+  type_ = type;
+  body_length_ += RELAY_HEADER_SIZE;
+  EncodeHeader();
+  EncodeRelayHeader(header);
+}
+
+void Message::PopRelayHeader(MessageType type, RelayHeader* header) {
+  DecodeRelayHeader(header);
+  data_ += RELAY_HEADER_SIZE;
+  type_ = type;
+  body_length_ -= RELAY_HEADER_SIZE;
+  EncodeHeader();
+}
+
+bool Message::SplitBatchBody(
+    std::vector<std::pair<const char*, size_t> >* entries) const {
+  using google::protobuf::io::CodedInputStream;
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(body());
+  CodedInputStream input(begin, body_length_);
+  uint32_t tag;
+  while ((tag = input.ReadTag()) != 0) {
+    uint32_t length;
+    if (tag != kBatchEntryTag || !input.ReadVarint32(&length)) {
+      return false;
+    }
+    const char* entry = body() + input.CurrentPosition();
+    if (!input.Skip(length)) {
+      return false;
+    }
+    entries->emplace_back(entry, length);
+  }
+  return input.ConsumedEntireMessage() &&
+      input.CurrentPosition() == (int) body_length_;
+}
+
+void Message::EncodeHeader() {
+  *((uint32_t*) data_) = htonl(NEXUS_SERVICE_MAGIC_NUMBER);
+  *((uint32_t*) (data_ + 4)) = htonl((uint32_t) type_);
+  *((uint32_t*) (data_ + 8)) = htonl(body_length_);
+}
+
+std::shared_ptr<Message> MergeMessages(
+    MessageType type, const std::vector<std::shared_ptr<Message> >& messages) {
+  using google::protobuf::io::CodedOutputStream;
+  size_t length = 0;
+  for (auto& msg : messages) {
+    length += 1 + CodedOutputStream::VarintSize32(msg->body_length()) +
+              msg->body_length();
+  }
+  auto batch = std::make_shared<Message>(type, length);
+  uint8_t* ptr = reinterpret_cast<uint8_t*>(batch->body());
+  for (auto& msg : messages) {
+    ptr = CodedOutputStream::WriteTagToArray(kBatchEntryTag, ptr);
+    ptr = CodedOutputStream::WriteVarint32ToArray(msg->body_length(), ptr);
+    std::memcpy(ptr, msg->body(), msg->body_length());
+    ptr += msg->body_length();
+  }
+  return batch;
 }
 
 } // namespace nexus
@@ -3,7 +3,10 @@
 
 #include <arpa/inet.h>
 #include <google/protobuf/message.h>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace nexus {
 
@@ -25,6 +28,14 @@ enum MessageType {
   kBackendRelay = 102,
   /*! \brief relay reply from backup */
   kBackendRelayReply = 103,
+  /*! \brief cancel queries from frontend to backend */
+  kBackendCancel = 104,
+  /*! \brief acknowledgement of cancelled queries from backend */
+  kBackendCancelReply = 105,
+  /*! \brief batch of requests from frontend to backend */
+  kBackendRequestBatch = 106,
+  /*! \brief batch of replies from backend to frontend */
+  kBackendReplyBatch = 107,
 };
 
 /*! \brief Message header format */
@@ -37,10 +48,25 @@ struct MessageHeader {
   uint32_t body_length;
 };
 
+/*!
+ * \brief Relay header that precedes the body of relay and relay reply
+ * messages between backends.
+ */
+struct RelayHeader {
+  /*! \brief relay id assigned by the relaying backend */
+  uint64_t relay_id;
+  /*! \brief utilization of the backup backend, only set in relay replies */
+  float utilization;
+  /*! \brief time in ms for which the utilization is valid */
+  uint32_t valid_ms;
+};
+
 /*! \brief Magic number for Nexus service */
 #define NEXUS_SERVICE_MAGIC_NUMBER  0xDEADBEEF
 /*! \brief Header length in bytes */
 #define MESSAGE_HEADER_SIZE         sizeof(MessageHeader)
+/*! \brief Relay header length in bytes */
+#define RELAY_HEADER_SIZE           sizeof(RelayHeader)
 
 bool DecodeHeader(const char* buffer, MessageHeader* header);
 
@@ -53,8 +79,9 @@ class Message {
   /*!
    * \brief Construct a nessage.
    *
-   * It allocates the data buffer with maximal size. This constructor is mainly
-   * used to hold an inbound packet when the message size is unknown.
+   * It allocates the data buffer from the header. This constructor is mainly
+   * used to hold an inbound packet. The buffer reserves room in front of the
+   * message so that a relay header can be pushed without copying the body.
    */
   //Message();
   Message(const MessageHeader& header);
@@ -92,16 +119,54 @@ class Message {
   /*!
    * \brief Decode the message from the body
    * \param message Protobuf message for the decoding result
+   * \param offset Offset in the body where the protobuf message starts
    */
-  void DecodeBody(google::protobuf::Message* message) const;
+  void DecodeBody(google::protobuf::Message* message, size_t offset = 0) const;
   /*!
    * \brief Encode the protobuf message and store in the body
    * \param message Protobuf message to encode
+   * \param offset Offset in the body where the protobuf message starts
+   */
+  void EncodeBody(const google::protobuf::Message& message, size_t offset = 0);
+  /*!
+   * \brief Write a relay header at the beginning of the body.
+   * \param header Relay header
+   */
+  void EncodeRelayHeader(const RelayHeader& header);
+  /*!
+   * \brief Read the relay header at the beginning of the body.
+   * \param header Relay header
+   */
+  void DecodeRelayHeader(RelayHeader* header) const;
+  /*!
+   * \brief Turn the message into a relay message in place by inserting a
+   * relay header in front of the body. Only inbound messages have room for it.
+   * \param type New message type
+   * \param header Relay header
+   */
+  void PushRelayHeader(MessageType type, const RelayHeader& header);
+  /*!
+   * \brief Strip the relay header from the body in place.
+   * \param type New message type
+   * \param header Relay header that was stripped
+   */
+  void PopRelayHeader(MessageType type, RelayHeader* header);
+  /*!
+   * \brief Split the body of a batch message into the bodies of the batched
+   *   messages.
+   * \param entries Pointer and length of each batched body
+   * \return false if the body is malformed
    */
-  void EncodeBody(const google::protobuf::Message& message);
+  bool SplitBatchBody(std::vector<std::pair<const char*, size_t> >* entries)
+      const;
 
  private:
-  /*! \brief Data buffer */
+  /*! \brief Write the message header at the beginning of data buffer */
+  void EncodeHeader();
+
+  /*! \brief Allocated buffer */
+  char* buffer_;
+  /*! \brief Data buffer, starting at the message header within buffer_ */
   char* data_;
   /*! \brief Message type */
   MessageType type_;
@@ -109,6 +174,17 @@ class Message {
   size_t body_length_;
 };
 
+/*!
+ * \brief Merge messages into a batch message without re-encoding them. The
+ *   batch body is the wire format of a protobuf message whose field 1 repeats
+ *   the batched messages, e.g. QueryBatchProto.
+ * \param type Type of the batch message
+ * \param messages Messages to merge
+ * \return Batch message
+ */
+std::shared_ptr<Message> MergeMessages(
+    MessageType type, const std::vector<std::shared_ptr<Message> >& messages);
+
 } // namespace nexus
 
 #endif // NEXUS_COMMON_MESSAGE_H_
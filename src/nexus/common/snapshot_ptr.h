@@ -0,0 +1,78 @@
+#ifndef NEXUS_COMMON_SNAPSHOT_PTR_H_
+#define NEXUS_COMMON_SNAPSHOT_PTR_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace nexus {
+
+/*!
+ * \brief Shared pointer to an immutable snapshot that is read by many threads
+ *   and replaced by few writers.
+ *
+ * Readers take no lock. The pointer lives in one of two slots. A reader
+ * announces itself in the counter of the current slot, copies the pointer
+ * and leaves; it only retries if a writer switched slots in between. A
+ * writer fills the spare slot, switches to it, and waits for the readers of
+ * the old slot to leave before dropping the old snapshot, which is therefore
+ * released as soon as the last reader copy goes away.
+ */
+template <class T>
+class SnapshotPtr {
+ public:
+  explicit SnapshotPtr(std::shared_ptr<const T> ptr) : current_(0) {
+    slots_[0] = std::move(ptr);
+    readers_[0].store(0);
+    readers_[1].store(0);
+  }
+  // disable copy
+  SnapshotPtr(const SnapshotPtr&) = delete;
+  SnapshotPtr& operator=(const SnapshotPtr&) = delete;
+  /*! \brief Returns the current snapshot */
+  std::shared_ptr<const T> Load() const {
+    while (true) {
+      int i = current_.load();
+      readers_[i].fetch_add(1);
+      if (current_.load() == i) {
+        std::shared_ptr<const T> ptr = slots_[i];
+        readers_[i].fetch_sub(1, std::memory_order_release);
+        return ptr;
+      }
+      // A writer switched slots, the spare one may be rewritten
+      readers_[i].fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+  /*! \brief Replaces the snapshot. Writers are serialized. */
+  void Store(std::shared_ptr<const T> ptr) {
+    std::lock_guard<std::mutex> lock(write_mu_);
+    int prev = current_.load(std::memory_order_relaxed);
+    int next = 1 - prev;
+    // Readers that saw a stale slot index may still be backing off
+    WaitForReaders(next);
+    slots_[next] = std::move(ptr);
+    current_.store(next);
+    WaitForReaders(prev);
+    slots_[prev].reset();
+  }
+
+ private:
+  void WaitForReaders(int i) const {
+    while (readers_[i].load() != 0) {
+      std::this_thread::yield();
+    }
+  }
+
+  std::shared_ptr<const T> slots_[2];
+  /*! \brief Index of the slot holding the current snapshot */
+  std::atomic<int> current_;
+  /*! \brief Number of readers copying from each slot */
+  mutable std::atomic<int> readers_[2];
+  /*! \brief Mutex serializing writers */
+  std::mutex write_mu_;
+};
+
+} // namespace nexus
+
+#endif // NEXUS_COMMON_SNAPSHOT_PTR_H_
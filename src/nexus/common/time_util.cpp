@@ -28,6 +28,10 @@ uint64_t Timer::GetLatencyMicros(const std::string& beg_tag,
   return d.count();
 }
 
+void Timer::Clear() {
+  time_points_.clear();
+}
+
 TimePoint* Timer::GetTimepoint(const std::string& tag) {
   auto itr = time_points_.find(tag);
   if (itr == time_points_.end()) {
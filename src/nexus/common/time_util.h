@@ -39,6 +39,8 @@ class Timer {
    */
   uint64_t GetLatencyMicros(const std::string& beg_tag,
                             const std::string& end_tag);
+  /*! \brief Removes all recorded time points */
+  void Clear();
 
  private:
   /*!
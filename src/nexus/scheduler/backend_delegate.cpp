@@ -397,6 +397,8 @@ CtrlStatus BackendDelegate::UpdateModelTableRpc() {
     auto cfg = request.add_model_instance_config();
     for (auto& model_sess : inst_info->model_sessions) {
       cfg->add_model_session()->CopyFrom(model_sess);
+      cfg->add_model_session_handle(
+          ModelSessionHandle(ModelSessionToString(model_sess)));
     }
     CHECK_NE(inst_info->batch, 0);
     cfg->set_batch(inst_info->batch);
@@ -411,6 +413,8 @@ CtrlStatus BackendDelegate::UpdateModelTableRpc() {
     auto cfg = request.add_model_instance_config();
     for (auto& model_sess : inst_info->model_sessions) {
       cfg->add_model_session()->CopyFrom(model_sess);
+      cfg->add_model_session_handle(
+          ModelSessionHandle(ModelSessionToString(model_sess)));
     }
     cfg->set_batch(inst_info->batch);
     cfg->set_max_batch(inst_info->max_batch);
@@ -510,6 +514,31 @@ bool BackendDelegate::IsIdle() const {
   return (exec_cycle_us_ == 0);
 }
 
+bool BackendDelegate::IsModelReady(const std::string& model_sess_id) const {
+  return ready_sessions_.count(model_sess_id) > 0;
+}
+
+bool BackendDelegate::IsModelParked(const std::string& model_sess_id) const {
+  return parked_sessions_.count(model_sess_id) > 0;
+}
+
+std::vector<std::string> BackendDelegate::UpdateReadyModels(
+    const ModelsReadyRequest& request) {
+  parked_sessions_.clear();
+  parked_sessions_.insert(request.parked_session_id().begin(),
+                          request.parked_session_id().end());
+  std::vector<std::string> new_ready;
+  std::unordered_set<std::string> ready_sessions;
+  for (auto const& model_sess_id : request.model_session_id()) {
+    if (ready_sessions_.count(model_sess_id) == 0) {
+      new_ready.push_back(model_sess_id);
+    }
+    ready_sessions.insert(model_sess_id);
+  }
+  ready_sessions_.swap(ready_sessions);
+  return new_ready;
+}
+
 void BackendDelegate::ComputeBatchSize(InstanceInfo* inst_info,
                                        double workload) const {
   // 1. Compute the max batch and throughput to saturate an empty GPU
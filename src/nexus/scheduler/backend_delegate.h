@@ -4,6 +4,7 @@
 #include <chrono>
 #include <grpc++/grpc++.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <yaml-cpp/yaml.h>
 
@@ -97,6 +98,24 @@ class BackendDelegate {
   bool IsAlive();
 
   bool IsIdle() const;
+  /*!
+   * \brief Whether the backend has loaded and warmed up the model session.
+   *   Backends only join the route of a model session once it is ready.
+   */
+  bool IsModelReady(const std::string& model_sess_id) const;
+  /*!
+   * \brief Whether the backend keeps the model session parked, so that it
+   *   can be served again without loading the model.
+   */
+  bool IsModelParked(const std::string& model_sess_id) const;
+  /*!
+   * \brief Replaces the model sessions that are ready or parked at the
+   *   backend.
+   * \param request Models reported by the backend
+   * \return Model sessions that become ready
+   */
+  std::vector<std::string> UpdateReadyModels(
+      const ModelsReadyRequest& request);
 
  private:
   void ComputeBatchSize(InstanceInfo* inst_info, double workload) const;
@@ -123,6 +142,10 @@ class BackendDelegate {
    * info due to prefix batching.
    */
   std::unordered_map<std::string, InstanceInfoPtr> session_model_map_;
+  /*! \brief Model sessions loaded and warmed up at the backend */
+  std::unordered_set<std::string> ready_sessions_;
+  /*! \brief Model sessions parked in the standby pool of the backend */
+  std::unordered_set<std::string> parked_sessions_;
   double exec_cycle_us_;
   double duty_cycle_us_;
   bool overload_;
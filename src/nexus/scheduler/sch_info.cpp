@@ -1,9 +1,23 @@
 #include "nexus/scheduler/sch_info.h"
 #include <glog/logging.h>
+#include <mutex>
 
 namespace nexus {
 namespace scheduler {
 
+uint32_t ModelSessionHandle(const std::string& model_sess_id) {
+  static std::mutex mu;
+  static std::unordered_map<std::string, uint32_t> handles;
+  std::lock_guard<std::mutex> lock(mu);
+  auto iter = handles.find(model_sess_id);
+  if (iter != handles.end()) {
+    return iter->second;
+  }
+  uint32_t handle = handles.size() + 1;
+  handles.emplace(model_sess_id, handle);
+  return handle;
+}
+
 void SessionInfo::UpdateWorkload(uint32_t frontend_id, const ModelStatsProto &model_stats) {
   auto iter = workloads.find(frontend_id);
   if (iter == workloads.end()) {
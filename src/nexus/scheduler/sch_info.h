@@ -21,6 +21,16 @@ namespace scheduler {
 using SessionGroup = std::vector<ModelSession>;
 using ServerList = std::unordered_set<uint32_t>;
 
+/*!
+ * \brief Returns the compact handle of a model session, assigning the next
+ *   free one on first use.
+ *
+ * Handles are dense, start from 1 and are never reused, so that frontends
+ * and backends can index tables by handle. 0 stands for no handle.
+ * This function is thread-safe.
+ */
+uint32_t ModelSessionHandle(const std::string& model_sess_id);
+
 struct SessionInfo {
   SessionInfo() :
       has_static_workload(false),
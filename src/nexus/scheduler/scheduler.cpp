@@ -25,6 +25,7 @@ INSTANTIATE_RPC_CALL(AsyncService, Unregister, UnregisterRequest, RpcReply);
 INSTANTIATE_RPC_CALL(AsyncService, LoadModel, LoadModelRequest, LoadModelReply);
 INSTANTIATE_RPC_CALL(AsyncService, ReportWorkload, WorkloadStatsProto, RpcReply);
 INSTANTIATE_RPC_CALL(AsyncService, KeepAlive, KeepAliveRequest, RpcReply);
+INSTANTIATE_RPC_CALL(AsyncService, ModelsReady, ModelsReadyRequest, RpcReply);
 INSTANTIATE_RPC_CALL(AsyncService, ComplexQuerySetup, ComplexQuerySetupRequest, RpcReply);
 INSTANTIATE_RPC_CALL(AsyncService, ComplexQueryAddEdge, ComplexQueryAddEdgeRequest, RpcReply);
 
@@ -340,6 +341,29 @@ void Scheduler::KeepAlive(const grpc::ServerContext& ctx,
   reply->set_status(CTRL_OK);
 }
 
+void Scheduler::ModelsReady(const grpc::ServerContext& ctx,
+                            const ModelsReadyRequest& request,
+                            RpcReply* reply) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto backend = GetBackend(request.node_id());
+  if (backend == nullptr) {
+    reply->set_status(CTRL_SERVER_NOT_REGISTERED);
+    return;
+  }
+  std::unordered_set<SessionInfoPtr> changed_sessions;
+  for (auto const& model_sess_id :
+           backend->UpdateReadyModels(request)) {
+    auto iter = session_table_.find(model_sess_id);
+    if (iter != session_table_.end()) {
+      LOG(INFO) << "Backend " << request.node_id() << " is ready for " <<
+          model_sess_id;
+      changed_sessions.insert(iter->second);
+    }
+  }
+  UpdateModelRoutes(changed_sessions);
+  reply->set_status(CTRL_OK);
+}
+
 void Scheduler::ComplexQuerySetup(const grpc::ServerContext &ctx,
                                   const ComplexQuerySetupRequest &request, RpcReply *reply) {
   std::lock_guard<std::mutex> lock(mutex_);
@@ -387,6 +411,8 @@ void Scheduler::HandleRpcs() {
                           std::bind(&Scheduler::ReportWorkload, this, _1, _2, _3));
   new KeepAlive_Call(&service_, cq_.get(),
                      std::bind(&Scheduler::KeepAlive, this, _1, _2, _3));
+  new ModelsReady_Call(&service_, cq_.get(),
+                       std::bind(&Scheduler::ModelsReady, this, _1, _2, _3));
   new ComplexQuerySetup_Call(&service_, cq_.get(),
                              std::bind(&Scheduler::ComplexQuerySetup, this, _1, _2, _3));
   new ComplexQueryAddEdge_Call(&service_, cq_.get(),
@@ -689,9 +715,15 @@ FrontendDelegatePtr Scheduler::GetFrontend(uint32_t node_id) {
 void Scheduler::GetModelRoute(const std::string& model_sess_id,
                               ModelRouteProto* route) {
   route->set_model_session_id(model_sess_id);
+  route->set_model_session_handle(ModelSessionHandle(model_sess_id));
   for (auto iter : session_table_.at(model_sess_id)->backend_weights) {
+    auto backend = backends_.at(iter.first);
+    if (!backend->IsModelReady(model_sess_id)) {
+      // Added to the route once the model is loaded and warmed up
+      continue;
+    }
     auto backend_rate = route->add_backend_rate();
-    backends_.at(iter.first)->GetInfo(backend_rate->mutable_info());
+    backend->GetInfo(backend_rate->mutable_info());
     backend_rate->set_throughput(iter.second);
   }
 }
@@ -703,6 +735,9 @@ void Scheduler::FindBestBackend(
   using ModelLoad = std::tuple<BackendDelegatePtr, InstanceInfo, double>;
   ModelLoad max_tp_load;
   ModelLoad max_occ_load;
+  // Backends that keep the model parked can serve it almost immediately
+  ModelLoad parked_load;
+  std::string model_sess_id = ModelSessionToString(model_sess);
   for (auto iter : backends_) {
     auto backend = iter.second;
     if (skips.find(backend->node_id()) != skips.end()) {
@@ -729,8 +764,19 @@ void Scheduler::FindBestBackend(
         occupancy > std::get<2>(max_occ_load)) {
       max_occ_load = std::make_tuple(backend, tmp_info, occupancy);
     }
+    if (backend->IsModelParked(model_sess_id) &&
+        (std::fabs(request_rate) < 1e-3 ||
+         tmp_info.throughput >= request_rate) &&
+        (std::get<0>(parked_load) == nullptr ||
+         occupancy > std::get<2>(parked_load))) {
+      parked_load = std::make_tuple(backend, tmp_info, occupancy);
+    }
   }
-  if (std::fabs(request_rate) < 1e-3) {
+  if (std::get<0>(parked_load) != nullptr) {
+    // Prefer a parked placement that can achieve the request rate
+    *best_backend = std::get<0>(parked_load);
+    *inst_info = std::get<1>(parked_load);
+  } else if (std::fabs(request_rate) < 1e-3) {
     // for request rate = 0, return backend that provides highest throughput
     *best_backend = std::get<0>(max_tp_load);
     *inst_info = std::get<1>(max_tp_load);
@@ -104,6 +104,19 @@ class Scheduler : public AsyncRpcServiceBase<AsyncService> {
   void KeepAlive(const grpc::ServerContext& ctx,
                  const KeepAliveRequest& request, RpcReply* reply);
 
+  /*!
+   * \brief Handles ModelsReady RPC. Routes of model sessions that become
+   *   ready at the backend are published to frontends.
+   *
+   * This function acquires mutex_.
+   *
+   * \param ctx RPC server context
+   * \param request Model sessions ready at the backend
+   * \param reply Reply to RPC
+   */
+  void ModelsReady(const grpc::ServerContext& ctx,
+                   const ModelsReadyRequest& request, RpcReply* reply);
+
   void ComplexQuerySetup(const grpc::ServerContext& ctx,
                          const ComplexQuerySetupRequest& request, RpcReply* reply);
 
@@ -191,7 +204,8 @@ class Scheduler : public AsyncRpcServiceBase<AsyncService> {
    */
   FrontendDelegatePtr GetFrontend(uint32_t node_id);
   /*!
-   * \brief Get the model route given the model session id.
+   * \brief Get the model route given the model session id. Only backends
+   *   that report the model session ready are included.
    *
    * This function doesn't acquire mutex_.
    *
@@ -202,6 +216,7 @@ class Scheduler : public AsyncRpcServiceBase<AsyncService> {
                      ModelRouteProto* route);
   /*!
    * \brief Find the best-fit backend to load the model session with workload.
+   *   Backends that keep the model session parked are preferred.
    *
    * This function doesn't acquire mutex_.
    *
@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <cmath>
+#include <gtest/gtest.h>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "nexus/backend/detection.h"
+
+namespace nexus {
+namespace backend {
+
+class DetectionTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    rand_gen_.seed(1234);
+  }
+  /*! \brief Random boxes with distinct scores in (0, 1) and nclasses classes */
+  std::vector<DetectionBox> RandomBoxes(size_t n, int nclasses) {
+    std::uniform_real_distribution<float> pos(0., 500.);
+    std::uniform_real_distribution<float> size(10., 120.);
+    std::uniform_int_distribution<int> cls(0, nclasses - 1);
+    std::vector<int> ranks(n);
+    for (size_t i = 0; i < n; ++i) {
+      ranks[i] = i;
+    }
+    std::shuffle(ranks.begin(), ranks.end(), rand_gen_);
+    std::vector<DetectionBox> boxes(n);
+    for (size_t i = 0; i < n; ++i) {
+      auto& box = boxes[i];
+      box.x1 = pos(rand_gen_);
+      box.y1 = pos(rand_gen_);
+      box.x2 = box.x1 + size(rand_gen_);
+      box.y2 = box.y1 + size(rand_gen_);
+      box.score = (ranks[i] + 1.f) / (n + 1.f);
+      box.class_id = cls(rand_gen_);
+      box.index = i;
+    }
+    return boxes;
+  }
+
+  static float RefIoU(const DetectionBox& a, const DetectionBox& b) {
+    float w = std::min(a.x2, b.x2) - std::max(a.x1, b.x1);
+    float h = std::min(a.y2, b.y2) - std::max(a.y1, b.y1);
+    if (w <= 0 || h <= 0) {
+      return 0.;
+    }
+    float inter = w * h;
+    float uni = (a.x2 - a.x1) * (a.y2 - a.y1) + (b.x2 - b.x1) * (b.y2 - b.y1) -
+                inter;
+    return inter / uni;
+  }
+
+  static void RefSort(std::vector<DetectionBox>* boxes) {
+    std::stable_sort(boxes->begin(), boxes->end(),
+                     [](const DetectionBox& a, const DetectionBox& b) {
+                       return a.score > b.score;
+                     });
+  }
+
+  static std::vector<DetectionBox> RefGreedyNms(
+      const DetectionConfig& config, std::vector<DetectionBox> boxes) {
+    RefSort(&boxes);
+    std::vector<DetectionBox> kept;
+    for (const auto& box : boxes) {
+      if (!(box.score > config.ScoreThreshold(box.class_id))) {
+        continue;
+      }
+      bool suppressed = false;
+      for (const auto& k : kept) {
+        if ((config.class_agnostic || k.class_id == box.class_id) &&
+            RefIoU(k, box) > config.nms_threshold) {
+          suppressed = true;
+          break;
+        }
+      }
+      if (!suppressed) {
+        kept.push_back(box);
+      }
+    }
+    return kept;
+  }
+
+  static std::vector<DetectionBox> RefSoftNms(
+      const DetectionConfig& config, std::vector<DetectionBox> boxes) {
+    std::vector<DetectionBox> pending;
+    for (const auto& box : boxes) {
+      if (box.score > config.ScoreThreshold(box.class_id)) {
+        pending.push_back(box);
+      }
+    }
+    std::vector<DetectionBox> kept;
+    while (!pending.empty()) {
+      RefSort(&pending);
+      DetectionBox best = pending.front();
+      pending.erase(pending.begin());
+      kept.push_back(best);
+      std::vector<DetectionBox> rest;
+      for (auto box : pending) {
+        if (config.class_agnostic || box.class_id == best.class_id) {
+          float iou = RefIoU(best, box);
+          box.score *= std::exp(-iou * iou / config.soft_nms_sigma);
+          if (!(box.score > config.ScoreThreshold(box.class_id))) {
+            continue;
+          }
+        }
+        rest.push_back(box);
+      }
+      pending.swap(rest);
+    }
+    return kept;
+  }
+
+  static std::vector<int> Indices(const std::vector<DetectionBox>& boxes) {
+    std::vector<int> indices;
+    for (const auto& box : boxes) {
+      indices.push_back(box.index);
+    }
+    return indices;
+  }
+
+  std::mt19937 rand_gen_;
+};
+
+TEST_F(DetectionTest, SortByScore) {
+  for (size_t n : {0, 1, 2, 7, 100, 3000}) {
+    auto boxes = RandomBoxes(n, 1);
+    auto expected = boxes;
+    RefSort(&expected);
+    SortByScore(&boxes);
+    ASSERT_EQ(Indices(boxes), Indices(expected)) << "n = " << n;
+  }
+}
+
+TEST_F(DetectionTest, SortByScoreWithTies) {
+  auto boxes = RandomBoxes(1000, 1);
+  for (auto& box : boxes) {
+    box.score = std::round(box.score * 10.f) / 10.f;
+  }
+  SortByScore(&boxes);
+  for (size_t i = 1; i < boxes.size(); ++i) {
+    ASSERT_GE(boxes[i - 1].score, boxes[i].score);
+  }
+  for (auto& box : boxes) {
+    box.score = 0.5;
+  }
+  SortByScore(&boxes);
+  ASSERT_EQ(boxes.size(), 1000u);
+}
+
+TEST_F(DetectionTest, SortByScoreNonFinite) {
+  const float inf = std::numeric_limits<float>::infinity();
+  auto boxes = RandomBoxes(200, 1);
+  boxes[3].score = std::numeric_limits<float>::quiet_NaN();
+  boxes[10].score = inf;
+  boxes[42].score = -inf;
+  boxes[0].score = std::numeric_limits<float>::quiet_NaN();
+  SortByScore(&boxes);
+  ASSERT_EQ(boxes.size(), 200u);
+  EXPECT_EQ(boxes.front().index, 10);
+  // Finite scores are still in descending order
+  float last = inf;
+  for (const auto& box : boxes) {
+    if (std::isfinite(box.score)) {
+      EXPECT_LE(box.score, last);
+      last = box.score;
+    }
+  }
+}
+
+TEST_F(DetectionTest, FilterDropsNaN) {
+  DetectionConfig config(0.3, 1.);
+  auto boxes = RandomBoxes(50, 2);
+  boxes[5].score = std::numeric_limits<float>::quiet_NaN();
+  NonMaxSuppression(config, &boxes);
+  for (const auto& box : boxes) {
+    EXPECT_GT(box.score, 0.3);
+  }
+}
+
+TEST_F(DetectionTest, GreedyNms) {
+  for (bool class_agnostic : {false, true}) {
+    for (float nms_thresh : {0.3f, 0.5f, 0.7f}) {
+      DetectionConfig config(0.1, nms_thresh);
+      config.class_agnostic = class_agnostic;
+      config.class_thresholds[2] = 0.6;
+      auto boxes = RandomBoxes(2000, 4);
+      auto expected = RefGreedyNms(config, boxes);
+      NonMaxSuppression(config, &boxes);
+      ASSERT_EQ(Indices(boxes), Indices(expected)) <<
+          "nms_threshold = " << nms_thresh << ", class_agnostic = " <<
+          class_agnostic;
+    }
+  }
+}
+
+TEST_F(DetectionTest, SoftNms) {
+  for (bool class_agnostic : {false, true}) {
+    DetectionConfig config(0.2, 0.5);
+    config.soft_nms = true;
+    config.class_agnostic = class_agnostic;
+    auto boxes = RandomBoxes(300, 3);
+    auto expected = RefSoftNms(config, boxes);
+    NonMaxSuppression(config, &boxes);
+    ASSERT_EQ(Indices(boxes), Indices(expected));
+    for (size_t i = 0; i < boxes.size(); ++i) {
+      EXPECT_FLOAT_EQ(boxes[i].score, expected[i].score);
+    }
+  }
+}
+
+TEST_F(DetectionTest, DecodeNormalizedBoxes) {
+  const int height = 480;
+  const int width = 640;
+  std::uniform_real_distribution<float> dis(0., 1.);
+  for (size_t n : {0, 1, 5, 64}) {
+    std::vector<float> boxes(n * 4);
+    for (auto& v : boxes) {
+      v = dis(rand_gen_);
+    }
+    std::vector<float> out(n * 4);
+    DecodeNormalizedBoxes(boxes.data(), n, height, width, out.data());
+    for (size_t i = 0; i < n; ++i) {
+      EXPECT_FLOAT_EQ(out[i * 4], boxes[i * 4 + 1] * width);
+      EXPECT_FLOAT_EQ(out[i * 4 + 1], boxes[i * 4] * height);
+      EXPECT_FLOAT_EQ(out[i * 4 + 2], boxes[i * 4 + 3] * width);
+      EXPECT_FLOAT_EQ(out[i * 4 + 3], boxes[i * 4 + 2] * height);
+    }
+    // Decoding in place gives the same result
+    DecodeNormalizedBoxes(boxes.data(), n, height, width, boxes.data());
+    ASSERT_EQ(boxes, out);
+  }
+}
+
+TEST_F(DetectionTest, DecodeDeltaBoxes) {
+  const int height = 480;
+  const int width = 640;
+  const float scale = 1.6;
+  const float means[4] = {0.01, -0.02, 0.03, 0.};
+  const float stds[4] = {0.1, 0.1, 0.2, 0.2};
+  std::uniform_real_distribution<float> pos(0., 900.);
+  std::uniform_real_distribution<float> delta(-2., 2.);
+  for (size_t n : {0, 1, 5, 64}) {
+    std::vector<float> rois(n * 5);
+    std::vector<float> deltas(n * 4);
+    for (size_t i = 0; i < n; ++i) {
+      rois[i * 5] = 0;
+      rois[i * 5 + 1] = pos(rand_gen_);
+      rois[i * 5 + 2] = pos(rand_gen_);
+      rois[i * 5 + 3] = rois[i * 5 + 1] + pos(rand_gen_) / 4;
+      rois[i * 5 + 4] = rois[i * 5 + 2] + pos(rand_gen_) / 4;
+      for (int j = 0; j < 4; ++j) {
+        deltas[i * 4 + j] = delta(rand_gen_);
+      }
+    }
+    std::vector<float> out(n * 4);
+    DecodeDeltaBoxes(rois.data(), deltas.data(), means, stds, scale, n,
+                     height, width, out.data());
+    for (size_t i = 0; i < n; ++i) {
+      double x1 = rois[i * 5 + 1] / scale;
+      double y1 = rois[i * 5 + 2] / scale;
+      double w = rois[i * 5 + 3] / scale - x1 + 1;
+      double h = rois[i * 5 + 4] / scale - y1 + 1;
+      double cx = x1 + 0.5 * w + (deltas[i * 4] * stds[0] + means[0]) * w;
+      double cy = y1 + 0.5 * h + (deltas[i * 4 + 1] * stds[1] + means[1]) * h;
+      w *= std::exp(deltas[i * 4 + 2] * stds[2] + means[2]);
+      h *= std::exp(deltas[i * 4 + 3] * stds[3] + means[3]);
+      auto clip = [](double v, double hi) {
+        return std::max(std::min(v, hi), 0.);
+      };
+      EXPECT_NEAR(out[i * 4], clip(cx - 0.5 * w, width - 1), 1e-2);
+      EXPECT_NEAR(out[i * 4 + 1], clip(cy - 0.5 * h, height - 1), 1e-2);
+      EXPECT_NEAR(out[i * 4 + 2], clip(cx + 0.5 * w, width - 1), 1e-2);
+      EXPECT_NEAR(out[i * 4 + 3], clip(cy + 0.5 * h, height - 1), 1e-2);
+    }
+  }
+}
+
+} // namespace backend
+} // namespace nexus
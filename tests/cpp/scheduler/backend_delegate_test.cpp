@@ -103,8 +103,83 @@ TEST_F(BackendDelegateTest, PrepareLoadModel) {
   ASSERT_NEAR(backend_->Occupancy(), occupancy, 1e-3);
 }
 
+TEST_F(BackendDelegateTest, UpdateReadyModels) {
+  ModelSession vgg16_sess;
+  vgg16_sess.set_framework("caffe");
+  vgg16_sess.set_model_name("vgg16");
+  vgg16_sess.set_version(1);
+  vgg16_sess.set_latency_sla(500);
+  std::string vgg16_id = ModelSessionToString(vgg16_sess);
+
+  ModelSession vgg_face_sess;
+  vgg_face_sess.set_framework("caffe");
+  vgg_face_sess.set_model_name("vgg_face");
+  vgg_face_sess.set_version(1);
+  vgg_face_sess.set_latency_sla(300);
+  std::string vgg_face_id = ModelSessionToString(vgg_face_sess);
+
+  ASSERT_FALSE(backend_->IsModelReady(vgg16_id));
+
+  ModelsReadyRequest request;
+  request.set_node_id(backend_->node_id());
+  request.add_model_session_id(vgg16_id);
+  auto new_ready = backend_->UpdateReadyModels(request);
+  ASSERT_EQ(new_ready.size(), 1u);
+  ASSERT_EQ(new_ready[0], vgg16_id);
+  ASSERT_TRUE(backend_->IsModelReady(vgg16_id));
+  ASSERT_FALSE(backend_->IsModelReady(vgg_face_id));
+
+  // Re-sent reports don't make sessions ready again
+  ASSERT_TRUE(backend_->UpdateReadyModels(request).empty());
+  ASSERT_TRUE(backend_->IsModelReady(vgg16_id));
+
+  // Each report replaces the ready set
+  request.clear_model_session_id();
+  request.add_model_session_id(vgg_face_id);
+  new_ready = backend_->UpdateReadyModels(request);
+  ASSERT_EQ(new_ready.size(), 1u);
+  ASSERT_EQ(new_ready[0], vgg_face_id);
+  ASSERT_FALSE(backend_->IsModelReady(vgg16_id));
+  ASSERT_TRUE(backend_->IsModelReady(vgg_face_id));
+}
+
+TEST_F(BackendDelegateTest, ParkedModels) {
+  ModelSession vgg16_sess;
+  vgg16_sess.set_framework("caffe");
+  vgg16_sess.set_model_name("vgg16");
+  vgg16_sess.set_version(1);
+  vgg16_sess.set_latency_sla(500);
+  std::string vgg16_id = ModelSessionToString(vgg16_sess);
+
+  ModelSession vgg_face_sess;
+  vgg_face_sess.set_framework("caffe");
+  vgg_face_sess.set_model_name("vgg_face");
+  vgg_face_sess.set_version(1);
+  vgg_face_sess.set_latency_sla(300);
+  std::string vgg_face_id = ModelSessionToString(vgg_face_sess);
+
+  ModelsReadyRequest request;
+  request.set_node_id(backend_->node_id());
+  request.add_model_session_id(vgg_face_id);
+  request.add_parked_session_id(vgg16_id);
+  // Parked sessions are not ready to serve
+  auto new_ready = backend_->UpdateReadyModels(request);
+  ASSERT_EQ(new_ready.size(), 1u);
+  ASSERT_EQ(new_ready[0], vgg_face_id);
+  ASSERT_TRUE(backend_->IsModelParked(vgg16_id));
+  ASSERT_FALSE(backend_->IsModelReady(vgg16_id));
+  ASSERT_FALSE(backend_->IsModelParked(vgg_face_id));
+
+  // Each report replaces the parked set
+  request.clear_parked_session_id();
+  backend_->UpdateReadyModels(request);
+  ASSERT_FALSE(backend_->IsModelParked(vgg16_id));
+  ASSERT_TRUE(backend_->IsModelReady(vgg_face_id));
+}
+
 TEST_F(BackendDelegateTest, CheckAlive) {
-  std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+  // Backend times out after 3 beacons without a tick
+  std::this_thread::sleep_for(std::chrono::milliseconds(3100));
   ASSERT_FALSE(backend_->IsAlive());
   backend_->Tick();
   ASSERT_TRUE(backend_->IsAlive());
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <chrono>
 #include <gtest/gtest.h>
 #include <memory>
@@ -28,7 +29,7 @@ class SchedulerTest : public ::testing::Test {
     for (int i = 0; i < 5; ++i) {
       auto backend = std::make_shared<BackendDelegate>(
           i + 1, "127.0.0.1", "8001", "8002", gpu_device_,
-          gpu_available_memory_, FLAGS_beacon, FLAGS_epoch);
+          gpu_available_memory_, FLAGS_beacon);
       RegisterReply reply;
       scheduler_->RegisterBackend(backend, &reply);
       ASSERT_EQ(reply.status(), CTRL_OK);
@@ -63,16 +64,10 @@ class SchedulerTest : public ::testing::Test {
     return reply.model_route().model_session_id();
   }
 
-  void UpdateBackendStats(const std::string& model_sess_id,
-                          std::vector<uint64_t> num_requests) {
-    auto iter_session_info = scheduler_->session_table_.find(model_sess_id);
-    ASSERT_NE(iter_session_info, scheduler_->session_table_.end());
-    BackendStatsProto request;
-    auto session_info = iter_session_info->second;
-    for (auto iter : session_info->backend_throughputs) {
-      request.set_node_id(iter.first);
-      break;
-    }
+  void ReportWorkload(uint32_t frontend_id, const std::string& model_sess_id,
+                      std::vector<uint64_t> num_requests) {
+    WorkloadStatsProto request;
+    request.set_node_id(frontend_id);
     auto model_stats = request.add_model_stats();
     model_stats->set_model_session_id(model_sess_id);
     for (auto n : num_requests) {
@@ -80,15 +75,59 @@ class SchedulerTest : public ::testing::Test {
     }
     RpcReply reply;
     grpc::ServerContext ctx;
-    scheduler_->UpdateBackendStats(ctx, request, &reply);
+    scheduler_->ReportWorkload(ctx, request, &reply);
     ASSERT_EQ(reply.status(), CTRL_OK);
   }
-  
+
+  CtrlStatus ReportModelsReady(uint32_t backend_id,
+                               const std::vector<std::string>& ready,
+                               const std::vector<std::string>& parked) {
+    ModelsReadyRequest request;
+    request.set_node_id(backend_id);
+    for (auto const& model_sess_id : ready) {
+      request.add_model_session_id(model_sess_id);
+    }
+    for (auto const& model_sess_id : parked) {
+      request.add_parked_session_id(model_sess_id);
+    }
+    RpcReply reply;
+    grpc::ServerContext ctx;
+    scheduler_->ModelsReady(ctx, request, &reply);
+    return reply.status();
+  }
+
+  ModelRouteProto GetModelRoute(const std::string& model_sess_id) {
+    ModelRouteProto route;
+    scheduler_->GetModelRoute(model_sess_id, &route);
+    return route;
+  }
+
+  std::vector<uint32_t> AssignedBackends(const std::string& model_sess_id) {
+    std::vector<uint32_t> backend_ids;
+    auto iter = scheduler_->session_table_.find(model_sess_id);
+    if (iter != scheduler_->session_table_.end()) {
+      for (auto const& weight : iter->second->backend_weights) {
+        backend_ids.push_back(weight.first);
+      }
+    }
+    return backend_ids;
+  }
+
+  BackendDelegatePtr FindBestBackend(
+      const ModelSession& model_sess, double request_rate,
+      const std::unordered_set<uint32_t>& skips) {
+    BackendDelegatePtr best_backend;
+    InstanceInfo inst_info;
+    scheduler_->FindBestBackend(model_sess, request_rate, skips,
+                                &best_backend, &inst_info);
+    return best_backend;
+  }
+
   void TickAll() {
     for (auto backend : backends_) {
       backend->Tick();
     }
-    for (auto frontend : backends_) {
+    for (auto frontend : frontends_) {
       frontend->Tick();
     }
   }
@@ -105,26 +144,81 @@ TEST_F(SchedulerTest, LoadModel) {
   LoadModel(2, "caffe", "vgg_s", 100, 500.);
 }
 
+TEST_F(SchedulerTest, ModelsReady) {
+  auto model_sess_id = LoadModel(1, "caffe", "vgg16", 200, 500.);
+  auto assigned = AssignedBackends(model_sess_id);
+  ASSERT_FALSE(assigned.empty());
+  // Backends join the route only once they report the model ready
+  ASSERT_EQ(GetModelRoute(model_sess_id).backend_rate_size(), 0);
+
+  ASSERT_EQ(ReportModelsReady(assigned[0], {model_sess_id}, {}), CTRL_OK);
+  auto route = GetModelRoute(model_sess_id);
+  ASSERT_EQ(route.backend_rate_size(), 1);
+  ASSERT_EQ(route.backend_rate(0).info().node_id(), assigned[0]);
+
+  // Re-sent reports don't change the route
+  ASSERT_EQ(ReportModelsReady(assigned[0], {model_sess_id}, {}), CTRL_OK);
+  ASSERT_EQ(GetModelRoute(model_sess_id).backend_rate_size(), 1);
+
+  // Backends not assigned to the session stay out of its route
+  for (auto backend : backends_) {
+    if (std::find(assigned.begin(), assigned.end(), backend->node_id()) ==
+        assigned.end()) {
+      ASSERT_EQ(ReportModelsReady(backend->node_id(), {model_sess_id}, {}),
+                CTRL_OK);
+    }
+  }
+  ASSERT_EQ(GetModelRoute(model_sess_id).backend_rate_size(), 1);
+
+  // A backend leaves the route when the session is no longer reported
+  ASSERT_EQ(ReportModelsReady(assigned[0], {}, {}), CTRL_OK);
+  ASSERT_EQ(GetModelRoute(model_sess_id).backend_rate_size(), 0);
+}
+
+TEST_F(SchedulerTest, ModelsReadyFromUnknownBackend) {
+  ASSERT_EQ(ReportModelsReady(100, {}, {}), CTRL_SERVER_NOT_REGISTERED);
+}
+
+TEST_F(SchedulerTest, FindBestBackendPrefersParked) {
+  ModelSession model_sess;
+  model_sess.set_framework("caffe");
+  model_sess.set_model_name("vgg16");
+  model_sess.set_version(1);
+  model_sess.set_latency_sla(200);
+  std::string model_sess_id = ModelSessionToString(model_sess);
+  TickAll();
+
+  for (size_t i = 0; i < backends_.size(); ++i) {
+    uint32_t parked_id = backends_[i]->node_id();
+    for (auto backend : backends_) {
+      std::vector<std::string> parked;
+      if (backend->node_id() == parked_id) {
+        parked.push_back(model_sess_id);
+      }
+      ASSERT_EQ(ReportModelsReady(backend->node_id(), {}, parked), CTRL_OK);
+    }
+    for (double rate : {0., 50., 100.}) {
+      auto best = FindBestBackend(model_sess, rate, {});
+      ASSERT_NE(best, nullptr);
+      ASSERT_EQ(best->node_id(), parked_id) << "request rate " << rate;
+    }
+    // Skipped backends are not chosen even if parked
+    auto best = FindBestBackend(model_sess, 50., {parked_id});
+    ASSERT_NE(best, nullptr);
+    ASSERT_NE(best->node_id(), parked_id);
+  }
+}
+
 TEST_F(SchedulerTest, EpochSchedule) {
   auto model1_id = LoadModel(1, "caffe", "vgg16", 200, 500.);
   auto model2_id = LoadModel(2, "caffe", "vgg_s", 100, 500.);
   scheduler_->DisplayModelTable();
   TickAll();
-  UpdateBackendStats(model1_id, {550});
-  UpdateBackendStats(model2_id, {450});
-  scheduler_->BeaconCheck();
-  UpdateBackendStats(model1_id, {550});
-  UpdateBackendStats(model2_id, {450});
-  scheduler_->BeaconCheck();
-  UpdateBackendStats(model1_id, {550});
-  UpdateBackendStats(model2_id, {450});
-  scheduler_->BeaconCheck();
-  UpdateBackendStats(model1_id, {550});
-  UpdateBackendStats(model2_id, {450});
-  scheduler_->BeaconCheck();
-  UpdateBackendStats(model1_id, {550});
-  UpdateBackendStats(model2_id, {450});
-  scheduler_->BeaconCheck();
+  for (int i = 0; i < 5; ++i) {
+    ReportWorkload(1, model1_id, {550});
+    ReportWorkload(2, model2_id, {450});
+    scheduler_->BeaconCheck();
+  }
   scheduler_->EpochSchedule();
 }
 
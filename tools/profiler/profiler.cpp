@@ -125,7 +125,7 @@ class ModelProfiler {
         std::string im;
         ReadImage(test_images_[idx], &im);
         auto task = std::make_shared<Task>();
-        auto input = task->query.mutable_input();
+        auto input = task->query->mutable_input();
         input->set_data_type(DT_IMAGE);
         auto image = input->mutable_image();
         image->set_data(im);
@@ -156,8 +156,8 @@ class ModelProfiler {
         int idx = i % preproc_tasks.size();
         auto task = std::make_shared<Task>();
         task->SetDeadline(std::chrono::milliseconds(1000000));
-        task->query.set_query_id(i);
-        task->query.set_model_session_id(
+        task->query->set_query_id(i);
+        task->query->set_model_session_id(
             model_sessions_[i % model_sessions_.size()]);
         task->attrs = preproc_tasks[idx]->attrs;
         task->AppendInput(preproc_tasks[idx]->inputs[0]->array);
@@ -180,8 +180,8 @@ class ModelProfiler {
       LOG(INFO) << "memory usage: " << memory_usage;
       for (int i = 0; i < batch * (repeat + dryrun); ++i) {
         auto task = task_queue.pop();
-        CHECK_EQ(task->result.status(), CTRL_OK) << "Error detected: " <<
-            task->result.status();
+        CHECK_EQ(task->result->status(), CTRL_OK) << "Error detected: " <<
+            task->result->status();
         auto beg = std::chrono::high_resolution_clock::now();
         model->Postprocess(task);
         auto end = std::chrono::high_resolution_clock::now();